@@ -0,0 +1,127 @@
+//===================== Copyright 2020, Jake Grossman =======================//
+//
+// Purpose: measure the speed and output size of each compression profile
+//
+// Embeds random data into a png with every profile, and reports the rate
+// pixel data is written at and the size of the output relative to the
+// decoded pixels.
+//
+// This file is subject to the terms and conditions defined in the
+// file 'LICENSE.txt', which is part of this source code package
+//
+//===========================================================================//
+#include <stdio.h>
+#include <stdlib.h> // malloc
+#include <stdint.h> // uint8_t
+#include <time.h> // clock_gettime
+#include "../src/csteg.h"
+
+// every profile is run at least this many times, and for at least this long
+#define MIN_RUNS 3
+#define MIN_SECONDS 1.0
+
+// names of the compression profiles, in csteg_compression order
+static const char* compression_names[] = { "default", "fast", "max", "store" };
+
+// read a whole file into memory
+static uint8_t* load_file(const char* filename, size_t* size) {
+	FILE* file_ptr = fopen(filename, "rb");
+	if (!file_ptr) {
+		return NULL;
+	}
+
+	fseek(file_ptr, 0, SEEK_END);
+	*size = ftell(file_ptr);
+	fseek(file_ptr, 0, SEEK_SET);
+
+	uint8_t* data = (uint8_t*) malloc(*size ? *size : 1);
+	if (data && fread(data, 1, *size, file_ptr) != *size) {
+		free(data);
+		data = NULL;
+	}
+
+	fclose(file_ptr);
+	return data;
+}
+
+// size of the decoded pixels of a png, from its header
+static size_t pixel_bytes(const uint8_t* png, size_t size) {
+	if (size < 33) {
+		return 0;
+	}
+
+	size_t width = ((size_t) png[16] << 24) | (png[17] << 16) | (png[18] << 8) | png[19];
+	size_t height = ((size_t) png[20] << 24) | (png[21] << 16) | (png[22] << 8) | png[23];
+	size_t bit_depth = png[24];
+	size_t channels = png[25] == 6 ? 4 : png[25] == 2 ? 3 : png[25] == 4 ? 2 : 1;
+
+	return width * height * channels * bit_depth / 8;
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		printf("Usage: compress png [threads] [data_bytes]\n");
+		return 1;
+	}
+
+	int threads = argc > 2 ? atoi(argv[2]) : 1;
+	size_t data_size = argc > 3 ? strtoul(argv[3], NULL, 10) : 4096;
+
+	size_t png_size;
+	uint8_t* png = load_file(argv[1], &png_size);
+	if (!png) {
+		fprintf(stderr, "could not read %s\n", argv[1]);
+		return 1;
+	}
+	size_t raw_size = pixel_bytes(png, png_size);
+
+	// data is random, as encrypted or compressed payloads are
+	uint8_t* data = (uint8_t*) malloc(data_size ? data_size : 1);
+	for (size_t i = 0; i < data_size; i++) {
+		data[i] = rand();
+	}
+
+	csteg_ctx* ctx = csteg_ctx_new();
+	if (!ctx || csteg_set_threads(ctx, threads) != CSTEG_OK) {
+		fprintf(stderr, "could not create context with %d threads\n", threads);
+		return 1;
+	}
+
+	printf("%-8s %10s %12s %8s\n", "profile", "MB/s", "bytes", "ratio");
+
+	for (size_t i = 0; i < sizeof(compression_names) / sizeof(compression_names[0]); i++) {
+		csteg_set_compression(ctx, (csteg_compression) i);
+
+		size_t runs = 0;
+		size_t out_size = 0;
+		double start = now();
+		double elapsed;
+
+		do {
+			void* out;
+			if (csteg_embed_memory(ctx, png, png_size, "bench.bin", data, data_size, &out, &out_size) != CSTEG_OK) {
+				fprintf(stderr, "%s\n", csteg_ctx_error(ctx));
+				return 1;
+			}
+			free(out);
+
+			runs++;
+			elapsed = now() - start;
+		} while (runs < MIN_RUNS || elapsed < MIN_SECONDS);
+
+		printf("%-8s %10.1f %12zu %8.3f\n", compression_names[i], raw_size * runs / elapsed / 1e6, out_size,
+		       raw_size ? (double) out_size / raw_size : 0.0);
+	}
+
+	csteg_ctx_free(ctx);
+	free(data);
+	free(png);
+
+	return 0;
+}
@@ -0,0 +1,283 @@
+//===================== Copyright 2020, Jake Grossman =======================//
+//
+// Purpose: run the embeddings and extractions listed in a manifest on a pool
+//          of worker threads
+//
+// Every worker reads the next line of the manifest as soon as it is done
+// with the last one, so the manifest is never held in memory, and runs it
+// with a context and block buffer of its own that are kept across items.
+// Memory use only grows with the number of workers, and with the carriers
+// kept decoded, which are shared by every worker.
+//
+// This file is subject to the terms and conditions defined in the
+// file 'LICENSE.txt', which is part of this source code package
+//
+//===========================================================================//
+#include <stdio.h>
+#include <stdarg.h> // va_list, va_start, va_end
+#include <stdlib.h> // malloc
+#include <stdint.h> // uint8_t
+#include <string.h> // strchr
+#include <unistd.h> // access
+#include <pthread.h>
+#include "batch.h"
+#include "pool.h"
+#include "cache.h"
+
+// size of the blocks extracted data is written in, by each worker
+#define BATCH_BLOCK_SIZE (1 << 20)
+
+// most fields of a manifest line
+#define BATCH_MAX_FIELDS 3
+
+// state shared by the workers of a batch
+typedef struct {
+	const batch_options* options;
+	const char* filename;
+	FILE* manifest;
+	carrier_cache* cache; // carriers kept decoded, NULL if they aren't
+	pthread_mutex_t lock; // held while reading the manifest or reporting a failure
+	size_t line; // number of the last line read
+	long failed; // items that failed
+} batch_job;
+
+// state of a worker, kept across the items it runs
+typedef struct {
+	csteg_ctx* ctx;
+	uint8_t* block; // holds extracted data before it is written
+	char* line; // last line read from the manifest
+	size_t line_capacity;
+	char error[512]; // why the last item failed
+} batch_worker;
+
+// record why the item a worker is running failed, returning -1
+__attribute__((format(printf, 2, 3)))
+static int item_error(batch_worker* worker, const char* fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(worker->error, sizeof(worker->error), fmt, args);
+	va_end(args);
+	return -1;
+}
+
+// read the next item of the manifest into worker->line, split into fields.
+// returns the number of fields, or 0 once the manifest is exhausted
+static size_t next_item(batch_job* job, batch_worker* worker, char** fields, size_t* line) {
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		ssize_t length = getline(&worker->line, &worker->line_capacity, job->manifest);
+		*line = ++job->line;
+		pthread_mutex_unlock(&job->lock);
+
+		if (length < 0) {
+			return 0;
+		}
+
+		// strip the line ending, \r\n included
+		char* text = worker->line;
+		while (length > 0 && (text[length - 1] == '\n' || text[length - 1] == '\r')) {
+			text[--length] = '\0';
+		}
+
+		// skip blank lines and comments
+		if (length == 0 || text[0] == '#') {
+			continue;
+		}
+
+		// split into fields, any past the last one are kept in it so the
+		// line is reported as malformed
+		size_t count = 0;
+		fields[count++] = text;
+		while (count < BATCH_MAX_FIELDS + 1 && (text = strchr(text, '\t'))) {
+			*text++ = '\0';
+			fields[count++] = text;
+		}
+
+		return count;
+	}
+}
+
+// embed data_file_in into png_in, writing png_out
+static int batch_embed(batch_job* job, batch_worker* worker, char** fields) {
+	const char* png_out = fields[2];
+
+	if (!job->options->force && access(png_out, F_OK) != -1) {
+		return item_error(worker, "batch_embed() : File %s already exists", png_out);
+	}
+
+	// a carrier reused by many items is only decoded the first time
+	cached_carrier* entry = NULL;
+	if (job->cache && carrier_cache_file(job->cache, worker->ctx, fields[0], &entry) != CSTEG_OK) {
+		return item_error(worker, "%s", csteg_ctx_error(worker->ctx));
+	}
+
+	csteg_status status;
+	if (entry) {
+		status = csteg_embed_carrier_file(worker->ctx, cached_carrier_pixels(entry), fields[1], png_out);
+	} else {
+		status = csteg_embed_file(worker->ctx, fields[0], fields[1], png_out);
+	}
+	carrier_cache_release(job->cache, entry);
+
+	if (status != CSTEG_OK) {
+		return item_error(worker, "%s", csteg_ctx_error(worker->ctx));
+	}
+
+	return 0;
+}
+
+// extract png_in, to data_file_out if it is given or to the name stored in
+// the image otherwise. a partly written output is removed
+static int batch_extract(batch_job* job, batch_worker* worker, char** fields, size_t count) {
+	csteg_ctx* ctx = worker->ctx;
+
+	if (csteg_open_file(ctx, fields[0]) != CSTEG_OK) {
+		return item_error(worker, "%s", csteg_ctx_error(ctx));
+	}
+
+	// the name stored in the image is released if reading fails
+	char* data_filename = strdup(count > 1 ? fields[1] : csteg_payload_name(ctx));
+	if (!data_filename) {
+		csteg_close(ctx);
+		return item_error(worker, "batch_extract() : out of memory");
+	}
+
+	int result = 0;
+	FILE* file_ptr = NULL;
+
+	if (!job->options->force && access(data_filename, F_OK) != -1) {
+		result = item_error(worker, "batch_extract() : File %s already exists", data_filename);
+	} else if (!(file_ptr = fopen(data_filename, "wb"))) {
+		result = item_error(worker, "batch_extract() : could not open %s for writing", data_filename);
+	}
+
+	if (file_ptr) {
+		size_t size;
+		do {
+			if (csteg_read(ctx, worker->block, BATCH_BLOCK_SIZE, &size) != CSTEG_OK) {
+				result = item_error(worker, "%s", csteg_ctx_error(ctx));
+				break;
+			}
+
+			if (fwrite(worker->block, 1, size, file_ptr) != size) {
+				result = item_error(worker, "batch_extract() : error writing to %s", data_filename);
+				break;
+			}
+		} while (size == BATCH_BLOCK_SIZE);
+
+		if (fclose(file_ptr) != 0 && result == 0) {
+			result = item_error(worker, "batch_extract() : error writing to %s", data_filename);
+		}
+
+		if (result != 0) {
+			remove(data_filename);
+		}
+	}
+
+	csteg_close(ctx);
+	free(data_filename);
+	return result;
+}
+
+// run a single item of count fields
+static int run_item(batch_job* job, batch_worker* worker, char** fields, size_t count) {
+	if (!worker->ctx || !worker->block) {
+		return item_error(worker, "run_item() : could not allocate worker");
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		if (fields[i][0] == '\0') {
+			return item_error(worker, "run_item() : field %zu is empty", i + 1);
+		}
+	}
+
+	switch (count) {
+		case 1: // fall through intentional
+		case 2:
+			return batch_extract(job, worker, fields, count);
+		case 3:
+			return batch_embed(job, worker, fields);
+	}
+
+	return item_error(worker, "run_item() : expected 1 to %d tab separated fields", BATCH_MAX_FIELDS);
+}
+
+// run items of the manifest until there are none left
+static void batch_task(void* arg, size_t index, size_t count) {
+	batch_job* job = (batch_job*) arg;
+	const batch_options* options = job->options;
+	(void) index;
+	(void) count;
+
+	batch_worker worker = {
+		.ctx = csteg_ctx_new(),
+		.block = (uint8_t*) malloc(BATCH_BLOCK_SIZE),
+		.line = NULL,
+		.line_capacity = 0,
+	};
+
+	// each item runs on this thread alone
+	if (worker.ctx) {
+		csteg_set_depth(worker.ctx, options->depth);
+		csteg_set_alpha(worker.ctx, options->alpha);
+		csteg_set_compression(worker.ctx, options->compression);
+	}
+
+	char* fields[BATCH_MAX_FIELDS + 1];
+	size_t line;
+	size_t field_count;
+
+	while ((field_count = next_item(job, &worker, fields, &line)) > 0) {
+		if (run_item(job, &worker, fields, field_count) != 0) {
+			pthread_mutex_lock(&job->lock);
+			fprintf(stderr, "%s:%zu: %s\n", job->filename, line, worker.error);
+			job->failed++;
+			pthread_mutex_unlock(&job->lock);
+		}
+	}
+
+	csteg_ctx_free(worker.ctx);
+	free(worker.block);
+	free(worker.line);
+}
+
+long run_batch(const char* filename, const batch_options* options) {
+	batch_job job = {
+		.options = options,
+		.filename = filename,
+		.line = 0,
+		.failed = 0,
+	};
+
+	job.manifest = fopen(filename, "r");
+	if (!job.manifest) {
+		return -1;
+	}
+
+	thread_pool* pool = pool_create(options->workers);
+	if (!pool) {
+		fclose(job.manifest);
+		return -1;
+	}
+
+	if (options->cache_size > 0) {
+		job.cache = carrier_cache_create(options->cache_size);
+		if (!job.cache) {
+			pool_destroy(pool);
+			fclose(job.manifest);
+			return -1;
+		}
+	}
+
+	pthread_mutex_init(&job.lock, NULL);
+	pool_run(pool, batch_task, &job);
+	pthread_mutex_destroy(&job.lock);
+	pool_destroy(pool);
+	carrier_cache_free(job.cache);
+
+	// a manifest that couldn't be read to the end fails the whole batch
+	int read_error = ferror(job.manifest);
+	fclose(job.manifest);
+
+	return read_error ? -1 : job.failed;
+}
@@ -0,0 +1,37 @@
+//===================== Copyright 2020, Jake Grossman =======================//
+//
+// Purpose: run the embeddings and extractions listed in a manifest on a pool
+//          of worker threads
+//
+// This file is subject to the terms and conditions defined in the
+// file 'LICENSE.txt', which is part of this source code package
+//
+//===========================================================================//
+#ifndef CSTEG_BATCH_H
+#define CSTEG_BATCH_H
+
+#include <stddef.h> // size_t
+#include "csteg.h"
+
+// options every item of a batch is run with
+typedef struct {
+	int workers; // items run at once, each on a single thread
+	int force; // overwrite existing output files instead of failing the item
+	int depth; // bits per channel when embedding
+	int alpha; // also store data in alpha channels when embedding
+	csteg_compression compression; // compression of images written
+	size_t cache_size; // bytes of carriers kept decoded across items, 0 decodes every one
+} batch_options;
+
+// run every item of the manifest filename, a tab separated file with one
+// item per line. a line holding png_in, data_file_in and png_out embeds, a
+// line holding png_in extracts to the name stored in the image, and a line
+// holding png_in and data_file_out extracts to data_file_out. blank lines
+// and lines starting with # are skipped
+//
+// items that fail are reported on stderr with their line number, and do not
+// stop the batch. returns the number of items that failed, or -1 if the
+// batch could not be run at all
+long run_batch(const char* filename, const batch_options* options);
+
+#endif
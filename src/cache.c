@@ -0,0 +1,315 @@
+//===================== Copyright 2020, Jake Grossman =======================//
+//
+// Purpose: memory bounded cache of decoded carriers, shared by the workers
+//          of a batch or server
+//
+// Carriers are kept in a list, most recently used first, and looked up by
+// walking it, since only as many carriers as fit in memory are ever held.
+// Workers decode a carrier outside of the lock, so a slow decode never holds
+// up the others, and take a reference to it until they are done embedding.
+// A carrier evicted while still in use is freed when its last user is done.
+//
+// Carriers held in memory with no file to tell them apart by are keyed by
+// the CRC of their contents, and a copy of them is kept so a hit is only
+// taken once the contents are known to be the same.
+//
+// This file is subject to the terms and conditions defined in the
+// file 'LICENSE.txt', which is part of this source code package
+//
+//===========================================================================//
+#include <stdio.h>
+#include <stdlib.h> // malloc
+#include <stdint.h> // uint8_t, uint32_t
+#include <string.h> // memcmp, memcpy
+#include <zlib.h> // crc32, crc32_z
+#include <pthread.h>
+#include "cache.h"
+
+struct cached_carrier {
+	cached_carrier* prev; // more recently used neighbour in the cache
+	cached_carrier* next; // less recently used neighbour in the cache
+
+	// identity of the png the carrier was decoded from
+	int by_content; // whether png and crc identify it, rather than a file
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	uint32_t crc;
+	uint8_t* png; // copy of the png, if identified by content
+	size_t png_size;
+
+	csteg_carrier* carrier;
+	size_t bytes; // memory held, counted against the limit of the cache
+	size_t refs; // workers using the carrier
+	int cached; // whether the entry is still in the cache
+};
+
+struct carrier_cache {
+	pthread_mutex_t lock; // held while the list or counters are used
+	size_t limit;
+	cached_carrier* head; // most recently used
+	cached_carrier* tail; // least recently used
+	size_t entries, bytes;
+	size_t hits, misses;
+};
+
+carrier_cache* carrier_cache_create(size_t limit) {
+	carrier_cache* cache = (carrier_cache*) calloc(1, sizeof(carrier_cache));
+
+	if (cache) {
+		cache->limit = limit;
+		pthread_mutex_init(&cache->lock, NULL);
+	}
+
+	return cache;
+}
+
+static void free_entry(cached_carrier* entry) {
+	csteg_carrier_free(entry->carrier);
+	free(entry->png);
+	free(entry);
+}
+
+void carrier_cache_free(carrier_cache* cache) {
+	if (!cache) {
+		return;
+	}
+
+	cached_carrier* entry = cache->head;
+	while (entry) {
+		cached_carrier* next = entry->next;
+		free_entry(entry);
+		entry = next;
+	}
+
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+// whether entry was decoded from the png key identifies
+static int same_png(const cached_carrier* entry, const cached_carrier* key, const uint8_t* png) {
+	if (entry->by_content != key->by_content) {
+		return 0;
+	}
+
+	if (key->by_content) {
+		return entry->crc == key->crc && entry->png_size == key->png_size && memcmp(entry->png, png, key->png_size) == 0;
+	}
+
+	return entry->dev == key->dev && entry->ino == key->ino && entry->size == key->size &&
+	       entry->mtime.tv_sec == key->mtime.tv_sec && entry->mtime.tv_nsec == key->mtime.tv_nsec;
+}
+
+static void unlink_entry(carrier_cache* cache, cached_carrier* entry) {
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		cache->head = entry->next;
+	}
+
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		cache->tail = entry->prev;
+	}
+
+	entry->prev = NULL;
+	entry->next = NULL;
+}
+
+static void push_front(carrier_cache* cache, cached_carrier* entry) {
+	entry->next = cache->head;
+	if (cache->head) {
+		cache->head->prev = entry;
+	} else {
+		cache->tail = entry;
+	}
+	cache->head = entry;
+}
+
+// find the entry of the png key identifies and take a reference to it,
+// marking it most recently used. called with the lock held
+static cached_carrier* take_entry(carrier_cache* cache, const cached_carrier* key, const uint8_t* png) {
+	for (cached_carrier* entry = cache->head; entry; entry = entry->next) {
+		if (same_png(entry, key, png)) {
+			unlink_entry(cache, entry);
+			push_front(cache, entry);
+			entry->refs++;
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+// evict the least recently used entries until the cache is within its
+// limit, sparing keep. called with the lock held
+static void evict(carrier_cache* cache, cached_carrier* keep) {
+	cached_carrier* entry = cache->tail;
+
+	while (entry && cache->bytes > cache->limit) {
+		cached_carrier* prev = entry->prev;
+
+		if (entry != keep) {
+			unlink_entry(cache, entry);
+			entry->cached = 0;
+			cache->entries--;
+			cache->bytes -= entry->bytes;
+
+			// entries in use are freed by their last user
+			if (entry->refs == 0) {
+				free_entry(entry);
+			}
+		}
+
+		entry = prev;
+	}
+}
+
+// decoded size of the png, if it can be probed
+static size_t decoded_size(const csteg_image* image) {
+	size_t channels = image->color_type == 6 ? 4 : image->color_type == 2 ? 3 : image->color_type == 4 ? 2 : 1;
+	return image->width * image->height * channels * (image->bit_depth / 8);
+}
+
+// take the carrier of the png key identifies, read from png_in or png,
+// decoding it if it isn't cached
+static csteg_status take_carrier(carrier_cache* cache, csteg_ctx* ctx, cached_carrier* key, const char* png_in,
+                                 const uint8_t* png, size_t png_size, cached_carrier** entry) {
+	*entry = NULL;
+
+	pthread_mutex_lock(&cache->lock);
+	cached_carrier* found = take_entry(cache, key, png);
+	if (found) {
+		cache->hits++;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	if (found) {
+		*entry = found;
+		return CSTEG_OK;
+	}
+
+	// images too large to be cached are left to be decoded as they are
+	// embedded into, a band at a time. uncompressed images are embedded into
+	// in place, and never decoded
+	csteg_image image;
+	csteg_status status = png_in ? csteg_probe_file(ctx, png_in, &image) : csteg_probe_memory(ctx, png, png_size, &image);
+	if (status != CSTEG_OK || image.uncompressed || decoded_size(&image) + key->png_size > cache->limit) {
+		return CSTEG_OK;
+	}
+
+	csteg_carrier* carrier;
+	status = png_in ? csteg_decode_file(ctx, png_in, &carrier) : csteg_decode_memory(ctx, png, png_size, &carrier);
+	if (status != CSTEG_OK) {
+		return status;
+	}
+
+	cached_carrier* created = (cached_carrier*) malloc(sizeof(cached_carrier));
+	uint8_t* copy = key->by_content ? (uint8_t*) malloc(key->png_size) : NULL;
+
+	if (!created || (key->by_content && !copy)) {
+		// the png is embedded into without the cache
+		free(created);
+		free(copy);
+		csteg_carrier_free(carrier);
+		return CSTEG_OK;
+	}
+
+	*created = *key;
+	if (copy) {
+		memcpy(copy, png, key->png_size);
+	}
+	created->png = copy;
+	created->carrier = carrier;
+	created->bytes = csteg_carrier_size(carrier) + key->png_size;
+	created->refs = 1;
+	created->cached = 1;
+
+	pthread_mutex_lock(&cache->lock);
+	cache->misses++;
+
+	// another worker may have decoded the same png meanwhile
+	found = take_entry(cache, key, png);
+	if (!found) {
+		push_front(cache, created);
+		cache->entries++;
+		cache->bytes += created->bytes;
+		evict(cache, created);
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	if (found) {
+		free_entry(created);
+		created = found;
+	}
+
+	*entry = created;
+	return CSTEG_OK;
+}
+
+// fill in the identity of the file st describes
+static void file_key(cached_carrier* key, const struct stat* st) {
+	memset(key, 0, sizeof(*key));
+	key->dev = st->st_dev;
+	key->ino = st->st_ino;
+	key->size = st->st_size;
+	key->mtime = st->st_mtim;
+}
+
+csteg_status carrier_cache_file(carrier_cache* cache, csteg_ctx* ctx, const char* png_in, cached_carrier** entry) {
+	struct stat st;
+	if (stat(png_in, &st) != 0) {
+		// reported by the embedding itself
+		*entry = NULL;
+		return CSTEG_OK;
+	}
+
+	cached_carrier key;
+	file_key(&key, &st);
+	return take_carrier(cache, ctx, &key, png_in, NULL, 0, entry);
+}
+
+csteg_status carrier_cache_memory(carrier_cache* cache, csteg_ctx* ctx, const void* png, size_t png_size,
+                                  const struct stat* st, cached_carrier** entry) {
+	cached_carrier key;
+
+	if (st) {
+		file_key(&key, st);
+	} else {
+		memset(&key, 0, sizeof(key));
+		key.by_content = 1;
+		key.crc = crc32_z(crc32(0, NULL, 0), (const Bytef*) png, png_size);
+		key.png_size = png_size;
+	}
+
+	return take_carrier(cache, ctx, &key, NULL, (const uint8_t*) png, png_size, entry);
+}
+
+const csteg_carrier* cached_carrier_pixels(const cached_carrier* entry) {
+	return entry->carrier;
+}
+
+void carrier_cache_release(carrier_cache* cache, cached_carrier* entry) {
+	if (!entry) {
+		return;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	int unused = --entry->refs == 0 && !entry->cached;
+	pthread_mutex_unlock(&cache->lock);
+
+	if (unused) {
+		free_entry(entry);
+	}
+}
+
+void carrier_cache_stats(carrier_cache* cache, cache_stats* stats) {
+	pthread_mutex_lock(&cache->lock);
+	stats->hits = cache->hits;
+	stats->misses = cache->misses;
+	stats->entries = cache->entries;
+	stats->bytes = cache->bytes;
+	pthread_mutex_unlock(&cache->lock);
+}
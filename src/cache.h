@@ -0,0 +1,62 @@
+//===================== Copyright 2020, Jake Grossman =======================//
+//
+// Purpose: memory bounded cache of decoded carriers, shared by the workers
+//          of a batch or server
+//
+// This file is subject to the terms and conditions defined in the
+// file 'LICENSE.txt', which is part of this source code package
+//
+//===========================================================================//
+#ifndef CSTEG_CACHE_H
+#define CSTEG_CACHE_H
+
+#include <stddef.h> // size_t
+#include <sys/stat.h> // struct stat
+#include "csteg.h"
+
+// default memory held by the decoded carriers of a cache, in MiB
+#define CACHE_DEFAULT_MIB 256
+
+typedef struct carrier_cache carrier_cache;
+
+// carrier taken from a cache, held until it is released
+typedef struct cached_carrier cached_carrier;
+
+// counters of a cache
+typedef struct {
+	size_t hits; // carriers found decoded
+	size_t misses; // carriers decoded
+	size_t entries; // carriers held
+	size_t bytes; // memory held by the carriers
+} cache_stats;
+
+// create a cache holding at most limit bytes of decoded carriers, evicting
+// the least recently used ones past that. returns NULL if out of memory
+carrier_cache* carrier_cache_create(size_t limit);
+
+// release a cache once no carrier taken from it is held, NULL is ignored
+void carrier_cache_free(carrier_cache* cache);
+
+// take the decoded carrier of the png file png_in, decoding it with ctx if
+// the file isn't cached or changed since. files are told apart by device,
+// inode, size and modification time. *entry is NULL if the image would not
+// fit in the cache, could not be probed or is uncompressed, and should be
+// embedded into without it. returns the error of ctx if decoding failed
+csteg_status carrier_cache_file(carrier_cache* cache, csteg_ctx* ctx, const char* png_in, cached_carrier** entry);
+
+// take the decoded carrier of the png held in png. if st describes the file
+// it was read from, it is told apart by it as carrier_cache_file does,
+// otherwise by its contents
+csteg_status carrier_cache_memory(carrier_cache* cache, csteg_ctx* ctx, const void* png, size_t png_size,
+                                  const struct stat* st, cached_carrier** entry);
+
+// pixels of a carrier taken from a cache
+const csteg_carrier* cached_carrier_pixels(const cached_carrier* entry);
+
+// give back a carrier taken from a cache, NULL is ignored
+void carrier_cache_release(carrier_cache* cache, cached_carrier* entry);
+
+// fill in the counters of a cache
+void carrier_cache_stats(carrier_cache* cache, cache_stats* stats);
+
+#endif
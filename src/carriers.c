@@ -0,0 +1,608 @@
+//===================== Copyright 2020, Jake Grossman =======================//
+//
+// Purpose: index of the carriers in a directory, picking the smallest one
+//          that holds a payload without decoding any of them
+//
+// The index is a single file mapped as is. It holds one fixed size entry per
+// file, sorted by name so an update can find the entry of each file again,
+// and for every depth, with and without alpha, the usable entries sorted by
+// capacity, so the smallest carrier that holds a payload is found with a
+// binary search. Entries record the capacity under an empty name, and the
+// header of the image, so the exact capacity for a name is worked out from
+// the index alone.
+//
+// This file is subject to the terms and conditions defined in the
+// file 'LICENSE.txt', which is part of this source code package
+//
+//===========================================================================//
+#include <stdio.h>
+#include <stdlib.h> // malloc, qsort
+#include <stdint.h> // uint8_t, uint32_t, uint64_t
+#include <string.h> // strcmp, memcpy
+#include <unistd.h> // close
+#include <fcntl.h> // open
+#include <dirent.h> // opendir, readdir
+#include <sys/stat.h> // stat
+#include <sys/mman.h> // mmap, munmap
+#include "carriers.h"
+#include "csteg.h"
+#include "pool.h"
+
+#define INDEX_MAGIC "CSTGIDX"
+#define INDEX_VERSION 1
+
+// the index is written in the byte order of the machine, and rebuilt on one
+// that reads this back differently
+#define INDEX_BYTE_ORDER 0x01020304
+
+// capacities are kept for every depth, without alpha and then with alpha
+#define CARRIER_MODES (2 * (CSTEG_MAX_DEPTH - CSTEG_MIN_DEPTH + 1))
+
+// start of the index file
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint64_t count; // entries
+	uint64_t usable; // entries of images that can hold data
+	uint64_t entries_offset; // count entries, sorted by name
+	uint64_t order_offset; // CARRIER_MODES arrays of usable entry indices, sorted by capacity
+	uint64_t names_offset; // names of the files, each followed by a null
+	uint64_t names_size;
+	int64_t dir_mtime_sec, dir_mtime_nsec; // modification time of the directory when indexed
+} index_header;
+
+// a file of the directory
+typedef struct {
+	int64_t mtime_sec, mtime_nsec; // modification time when probed
+	uint64_t file_size; // size when probed
+	uint64_t capacity[CARRIER_MODES]; // bytes that fit under an empty name, by mode
+	uint32_t name_offset; // offset of the name in the names of the index
+	uint32_t name_length;
+	uint32_t width, height;
+	uint8_t color_type, bit_depth, interlaced;
+	uint8_t usable; // whether the file is a png that can hold data
+	uint32_t reserved;
+} index_entry;
+
+_Static_assert(sizeof(index_entry) == 112, "index entries must have the same layout on every build");
+
+// an index mapped in memory
+typedef struct {
+	void* base;
+	size_t size;
+	const index_header* header;
+	const index_entry* entries;
+	const uint32_t* order;
+	const char* names;
+} carrier_index;
+
+// a file found while updating the index
+typedef struct {
+	index_entry entry;
+	char* name;
+	int probe; // whether the header has to be read
+} index_item;
+
+// files probed by every thread of a pool
+typedef struct {
+	const char* dir;
+	index_item** items; // files to probe
+	size_t count;
+	size_t next; // index of the next file to be probed, taken atomically
+} probe_job;
+
+// index of the capacities of mode depth and alpha in an entry
+static size_t carrier_mode(int depth, int alpha) {
+	return (alpha ? CSTEG_MAX_DEPTH - CSTEG_MIN_DEPTH + 1 : 0) + depth - CSTEG_MIN_DEPTH;
+}
+
+// path of the file name in the directory dir, released with free()
+static char* carrier_path(const char* dir, const char* name) {
+	size_t size = strlen(dir) + strlen(name) + 2;
+	char* path = (char*) malloc(size);
+
+	if (path) {
+		snprintf(path, size, "%s/%s", dir, name);
+	}
+
+	return path;
+}
+
+// header of the image of an entry, as probed
+static csteg_image entry_image(const index_entry* entry) {
+	return (csteg_image) {
+		.width = entry->width,
+		.height = entry->height,
+		.color_type = entry->color_type,
+		.bit_depth = entry->bit_depth,
+		.interlaced = entry->interlaced,
+	};
+}
+
+//===========================================================================//
+// index file
+//===========================================================================//
+
+// map the index of the directory dir, returns 0 if there is no valid index
+static int open_index(const char* dir, carrier_index* index) {
+	memset(index, 0, sizeof(*index));
+
+	char* path = carrier_path(dir, CARRIER_INDEX_NAME);
+	int fd = path ? open(path, O_RDONLY) : -1;
+	free(path);
+
+	if (fd < 0) {
+		return 0;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(index_header)) {
+		close(fd);
+		return 0;
+	}
+
+	void* base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (base == MAP_FAILED) {
+		return 0;
+	}
+
+	index->base = base;
+	index->size = st.st_size;
+	index->header = (const index_header*) base;
+
+	// every part must lie within the file
+	const index_header* header = index->header;
+	int valid = memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0 && header->version == INDEX_VERSION &&
+	            header->byte_order == INDEX_BYTE_ORDER && header->usable <= header->count &&
+	            header->count <= index->size / sizeof(index_entry) &&
+	            header->entries_offset <= index->size - header->count * sizeof(index_entry) &&
+	            header->order_offset <= index->size - header->usable * CARRIER_MODES * sizeof(uint32_t) &&
+	            header->names_offset <= index->size && header->names_size <= index->size - header->names_offset;
+
+	if (!valid) {
+		munmap(base, index->size);
+		index->base = NULL;
+		return 0;
+	}
+
+	index->entries = (const index_entry*) ((const uint8_t*) base + header->entries_offset);
+	index->order = (const uint32_t*) ((const uint8_t*) base + header->order_offset);
+	index->names = (const char*) base + header->names_offset;
+	return 1;
+}
+
+// release an index mapped with open_index
+static void close_index(carrier_index* index) {
+	if (index->base) {
+		munmap(index->base, index->size);
+		index->base = NULL;
+	}
+}
+
+// name of an entry of an index, NULL if it doesn't lie within the names
+static const char* index_name(const carrier_index* index, const index_entry* entry) {
+	if (entry->name_offset > index->header->names_size || entry->name_length >= index->header->names_size - entry->name_offset ||
+	    index->names[entry->name_offset + entry->name_length] != '\0') {
+		return NULL;
+	}
+
+	return &index->names[entry->name_offset];
+}
+
+// entry of a file in an index, NULL if it has none
+static const index_entry* find_entry(const carrier_index* index, const char* name) {
+	size_t low = 0;
+	size_t high = index->base ? index->header->count : 0;
+
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		const char* middle_name = index_name(index, &index->entries[middle]);
+		if (!middle_name) {
+			return NULL;
+		}
+
+		int order = strcmp(name, middle_name);
+		if (order == 0) {
+			return &index->entries[middle];
+		}
+
+		if (order < 0) {
+			high = middle;
+		} else {
+			low = middle + 1;
+		}
+	}
+
+	return NULL;
+}
+
+// capacity of an entry and its index, sorted to build the order of a mode
+typedef struct {
+	uint64_t capacity;
+	uint32_t entry;
+} capacity_order;
+
+static int compare_capacities(const void* a, const void* b) {
+	const capacity_order* order_a = (const capacity_order*) a;
+	const capacity_order* order_b = (const capacity_order*) b;
+
+	if (order_a->capacity != order_b->capacity) {
+		return order_a->capacity < order_b->capacity ? -1 : 1;
+	}
+	return (order_a->entry > order_b->entry) - (order_a->entry < order_b->entry);
+}
+
+static int compare_items(const void* a, const void* b) {
+	return strcmp(((const index_item*) a)->name, ((const index_item*) b)->name);
+}
+
+// write the index of count items, sorting them by name. it is written to a
+// temporary file first, so readers only ever map a complete index
+static int write_index(const char* dir, const struct stat* dir_st, index_item* items, size_t count) {
+	qsort(items, count, sizeof(index_item), compare_items);
+
+	// lay out the entries, the orders and then the names
+	index_header header = {
+		.magic = INDEX_MAGIC,
+		.version = INDEX_VERSION,
+		.byte_order = INDEX_BYTE_ORDER,
+		.count = count,
+		.entries_offset = sizeof(index_header),
+		.dir_mtime_sec = dir_st->st_mtim.tv_sec,
+		.dir_mtime_nsec = dir_st->st_mtim.tv_nsec,
+	};
+
+	for (size_t i = 0; i < count; i++) {
+		items[i].entry.name_offset = header.names_size;
+		items[i].entry.name_length = strlen(items[i].name);
+		header.names_size += items[i].entry.name_length + 1;
+		header.usable += items[i].entry.usable;
+	}
+	header.order_offset = header.entries_offset + count * sizeof(index_entry);
+	header.names_offset = header.order_offset + header.usable * CARRIER_MODES * sizeof(uint32_t);
+
+	size_t size = header.names_offset + header.names_size;
+	uint8_t* data = (uint8_t*) malloc(size);
+	capacity_order* orders = (capacity_order*) malloc(sizeof(capacity_order) * (header.usable ? header.usable : 1));
+
+	if (!data || !orders) {
+		free(data);
+		free(orders);
+		fprintf(stderr, "write_index() : could not allocate %zu bytes\n", size);
+		return -1;
+	}
+
+	memcpy(data, &header, sizeof(header));
+
+	index_entry* entries = (index_entry*) (data + header.entries_offset);
+	for (size_t i = 0; i < count; i++) {
+		entries[i] = items[i].entry;
+		memcpy(data + header.names_offset + items[i].entry.name_offset, items[i].name, items[i].entry.name_length + 1);
+	}
+
+	// usable entries of each mode, from the least capacity to the most
+	uint32_t* order = (uint32_t*) (data + header.order_offset);
+	for (size_t mode = 0; mode < CARRIER_MODES; mode++) {
+		size_t usable = 0;
+		for (size_t i = 0; i < count; i++) {
+			if (entries[i].usable) {
+				orders[usable++] = (capacity_order) { entries[i].capacity[mode], i };
+			}
+		}
+
+		qsort(orders, usable, sizeof(capacity_order), compare_capacities);
+		for (size_t i = 0; i < usable; i++) {
+			order[mode * usable + i] = orders[i].entry;
+		}
+	}
+	free(orders);
+
+	char* path = carrier_path(dir, CARRIER_INDEX_NAME);
+	char* temp_path = carrier_path(dir, CARRIER_INDEX_NAME ".tmp");
+	int result = -1;
+
+	if (path && temp_path) {
+		FILE* file_ptr = fopen(temp_path, "wb");
+
+		if (!file_ptr) {
+			fprintf(stderr, "write_index() : File %s could not be opened for writing\n", temp_path);
+		} else if (fwrite(data, 1, size, file_ptr) != size || fclose(file_ptr) != 0) {
+			fprintf(stderr, "write_index() : error writing %s\n", temp_path);
+			remove(temp_path);
+		} else if (rename(temp_path, path) != 0) {
+			fprintf(stderr, "write_index() : could not replace %s\n", path);
+			remove(temp_path);
+		} else {
+			result = 0;
+		}
+	}
+
+	free(path);
+	free(temp_path);
+	free(data);
+	return result;
+}
+
+//===========================================================================//
+// updating
+//===========================================================================//
+
+// read the header of a file into its entry. files that aren't pngs, or
+// that can't hold data, are kept in the index as unusable so they aren't
+// probed again until they change
+static void probe_item(csteg_ctx* ctx, const char* dir, index_item* item) {
+	index_entry* entry = &item->entry;
+	char* path = carrier_path(dir, item->name);
+	csteg_image image;
+
+	entry->usable = 0;
+
+	if (!ctx || !path || csteg_probe_file(ctx, path, &image) != CSTEG_OK) {
+		free(path);
+		return;
+	}
+	free(path);
+
+	entry->usable = 1;
+	entry->width = image.width;
+	entry->height = image.height;
+	entry->color_type = image.color_type;
+	entry->bit_depth = image.bit_depth;
+	entry->interlaced = image.interlaced;
+
+	for (int alpha = 0; alpha <= 1; alpha++) {
+		for (int depth = CSTEG_MIN_DEPTH; depth <= CSTEG_MAX_DEPTH; depth++) {
+			entry->capacity[carrier_mode(depth, alpha)] = csteg_capacity(&image, depth, alpha, 0);
+		}
+	}
+}
+
+// probe files until there are none left
+static void probe_task(void* arg, size_t index, size_t count) {
+	probe_job* job = (probe_job*) arg;
+	csteg_ctx* ctx = csteg_ctx_new();
+	(void) index;
+	(void) count;
+
+	for (;;) {
+		size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+		if (i >= job->count) {
+			break;
+		}
+
+		probe_item(ctx, job->dir, job->items[i]);
+	}
+
+	csteg_ctx_free(ctx);
+}
+
+int carrier_index_update(const char* dir, int workers) {
+	struct stat dir_st;
+	DIR* dir_ptr = opendir(dir);
+
+	if (!dir_ptr || fstat(dirfd(dir_ptr), &dir_st) != 0) {
+		fprintf(stderr, "carrier_index_update() : could not open directory %s\n", dir);
+		if (dir_ptr) {
+			closedir(dir_ptr);
+		}
+		return -1;
+	}
+
+	// entries of files that haven't changed are kept
+	carrier_index old;
+	open_index(dir, &old);
+
+	size_t count = 0, capacity = 1024;
+	index_item* items = (index_item*) malloc(sizeof(index_item) * capacity);
+	int result = items ? 0 : -1;
+
+	struct dirent* dirent;
+	while (result == 0 && (dirent = readdir(dir_ptr))) {
+		// skips the index itself, along with any other hidden file
+		if (dirent->d_name[0] == '.') {
+			continue;
+		}
+
+		char* path = carrier_path(dir, dirent->d_name);
+		struct stat st;
+		int regular = path && stat(path, &st) == 0 && S_ISREG(st.st_mode);
+		free(path);
+
+		if (!regular) {
+			continue;
+		}
+
+		if (count == capacity) {
+			capacity *= 2;
+			index_item* grown = (index_item*) realloc(items, sizeof(index_item) * capacity);
+			if (!grown) {
+				result = -1;
+				break;
+			}
+			items = grown;
+		}
+
+		index_item* item = &items[count];
+		const index_entry* entry = find_entry(&old, dirent->d_name);
+
+		item->name = strdup(dirent->d_name);
+		if (!item->name) {
+			result = -1;
+			break;
+		}
+		count++;
+
+		if (entry && entry->mtime_sec == st.st_mtim.tv_sec && entry->mtime_nsec == st.st_mtim.tv_nsec &&
+		    entry->file_size == (uint64_t) st.st_size) {
+			item->entry = *entry;
+			item->probe = 0;
+		} else {
+			memset(&item->entry, 0, sizeof(item->entry));
+			item->entry.mtime_sec = st.st_mtim.tv_sec;
+			item->entry.mtime_nsec = st.st_mtim.tv_nsec;
+			item->entry.file_size = st.st_size;
+			item->probe = 1;
+		}
+	}
+	closedir(dir_ptr);
+	close_index(&old);
+
+	if (result != 0) {
+		fprintf(stderr, "carrier_index_update() : out of memory listing %s\n", dir);
+	}
+
+	// probe new and changed files
+	probe_job job = {
+		.dir = dir,
+		.items = (index_item**) malloc(sizeof(index_item*) * (count ? count : 1)),
+		.count = 0,
+		.next = 0,
+	};
+
+	if (result == 0 && !job.items) {
+		fprintf(stderr, "carrier_index_update() : out of memory listing %s\n", dir);
+		result = -1;
+	}
+
+	if (result == 0) {
+		for (size_t i = 0; i < count; i++) {
+			if (items[i].probe) {
+				job.items[job.count++] = &items[i];
+			}
+		}
+
+		if (job.count > 0) {
+			size_t threads = (size_t) workers < job.count ? (size_t) workers : job.count;
+			thread_pool* pool = pool_create(threads);
+
+			if (!pool) {
+				fprintf(stderr, "carrier_index_update() : could not start %zu threads\n", threads);
+				result = -1;
+			} else {
+				pool_run(pool, probe_task, &job);
+				pool_destroy(pool);
+			}
+		}
+	}
+
+	if (result == 0) {
+		result = write_index(dir, &dir_st, items, count);
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		free(items[i].name);
+	}
+	free(items);
+	free(job.items);
+
+	return result;
+}
+
+//===========================================================================//
+// selecting
+//===========================================================================//
+
+// most bytes the name of a payload can take from the capacity recorded for
+// an empty name. the name is stored at 2 bits per color channel, 4 channels
+// a byte, pushing the data back by as many channels, rounded up to a whole
+// pixel of at most 4 channels when the data also uses alpha
+static uint64_t name_cost(size_t name_length, int depth) {
+	return ((8 * (uint64_t) name_length + 8) * depth + 7) / 8 + 1;
+}
+
+// entry at position i of the order of mode, NULL if the index is corrupt
+static const index_entry* ordered_entry(const carrier_index* index, size_t mode, size_t i) {
+	uint32_t entry = index->order[mode * index->header->usable + i];
+	return entry < index->header->count ? &index->entries[entry] : NULL;
+}
+
+// first position in the order of mode whose capacity is at least size
+static size_t lower_bound(const carrier_index* index, size_t mode, uint64_t size) {
+	size_t low = 0;
+	size_t high = index->header->usable;
+
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		const index_entry* entry = ordered_entry(index, mode, middle);
+		if (entry && entry->capacity[mode] < size) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+
+	return low;
+}
+
+char* carrier_select(const char* dir, uint64_t size, size_t name_length, int depth, int alpha, int workers) {
+	struct stat dir_st;
+	if (stat(dir, &dir_st) != 0 || !S_ISDIR(dir_st.st_mode)) {
+		fprintf(stderr, "carrier_select() : %s is not a directory\n", dir);
+		return NULL;
+	}
+
+	// files added or removed since the index was built change the directory
+	carrier_index index;
+	int current = open_index(dir, &index) && index.header->dir_mtime_sec == dir_st.st_mtim.tv_sec &&
+	              index.header->dir_mtime_nsec == dir_st.st_mtim.tv_nsec;
+
+	if (!current) {
+		close_index(&index);
+		if (carrier_index_update(dir, workers) != 0 || !open_index(dir, &index)) {
+			fprintf(stderr, "carrier_select() : could not index %s\n", dir);
+			return NULL;
+		}
+	}
+
+	// the recorded capacities are for an empty name, so every carrier that
+	// holds the payload is at or after the first to hold size bytes. the
+	// name takes at most name_cost bytes, so past the carriers holding that
+	// much more, none have less capacity than the best found
+	size_t mode = carrier_mode(depth, alpha);
+	uint64_t cost = name_cost(name_length, depth);
+	char* best_path = NULL;
+	uint64_t best_capacity = 0;
+
+	for (size_t i = lower_bound(&index, mode, size); i < index.header->usable; i++) {
+		const index_entry* entry = ordered_entry(&index, mode, i);
+		if (!entry) {
+			continue;
+		}
+
+		if (best_path && entry->capacity[mode] > best_capacity + cost) {
+			break;
+		}
+
+		csteg_image image = entry_image(entry);
+		uint64_t capacity = csteg_capacity(&image, depth, alpha, name_length);
+		if (capacity < size || (best_path && capacity >= best_capacity)) {
+			continue;
+		}
+
+		// files changed in place since they were indexed are passed over
+		const char* name = index_name(&index, entry);
+		char* path = name ? carrier_path(dir, name) : NULL;
+		struct stat st;
+
+		if (!path || stat(path, &st) != 0 || entry->mtime_sec != st.st_mtim.tv_sec ||
+		    entry->mtime_nsec != st.st_mtim.tv_nsec || entry->file_size != (uint64_t) st.st_size) {
+			free(path);
+			continue;
+		}
+
+		free(best_path);
+		best_path = path;
+		best_capacity = capacity;
+	}
+	close_index(&index);
+
+	if (!best_path) {
+		fprintf(stderr, "carrier_select() : no carrier in %s holds %llu bytes at %d bits per channel\n",
+		        dir, (unsigned long long) size, depth);
+	}
+
+	return best_path;
+}
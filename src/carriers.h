@@ -0,0 +1,31 @@
+//===================== Copyright 2020, Jake Grossman =======================//
+//
+// Purpose: index of the carriers in a directory, picking the smallest one
+//          that holds a payload without decoding any of them
+//
+// This file is subject to the terms and conditions defined in the
+// file 'LICENSE.txt', which is part of this source code package
+//
+//===========================================================================//
+#ifndef CSTEG_CARRIERS_H
+#define CSTEG_CARRIERS_H
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint64_t
+
+// name of the index file kept in a carrier directory
+#define CARRIER_INDEX_NAME ".csteg-index"
+
+// build the index of the pngs in the directory dir, or update it, probing
+// the header of every file that is new or whose modification time or size
+// changed on workers threads. returns 0, or -1 after printing why to stderr
+int carrier_index_update(const char* dir, int workers);
+
+// path of the carrier in the directory dir with the least capacity that
+// still holds size bytes stored under a name of name_length bytes, at depth
+// bits per channel and in the alpha channel too if alpha is set. the index
+// is updated first if the directory changed since it was built. returns a
+// path released with free(), or NULL after printing why to stderr
+char* carrier_select(const char* dir, uint64_t size, size_t name_length, int depth, int alpha, int workers);
+
+#endif
@@ -0,0 +1,549 @@
+//===================== Copyright 2020, Jake Grossman =======================//
+//
+// Purpose: send embed, extract and probe requests to a running server
+//
+// This file is subject to the terms and conditions defined in the
+// file 'LICENSE.txt', which is part of this source code package
+//
+//===========================================================================//
+#include <stdio.h>
+#include <stdlib.h> // malloc
+#include <stdint.h> // uint8_t, uint32_t
+#include <string.h> // strlen, memcpy
+#include <errno.h> // errno, EEXIST
+#include <fcntl.h> // open
+#include <unistd.h> // access, close
+#include <sys/socket.h> // socket, connect
+#include <sys/stat.h> // stat
+#include <sys/un.h> // sockaddr_un
+#include "client.h"
+#include "frame.h"
+
+// bytes of a png a probe reads, its signature and IHDR chunk. only pngs
+// are sent to the server, see check_carrier
+#define PROBE_LIMIT 33
+
+// connect to the server. returns the socket, or -1 after printing why
+static int connect_server(const char* socket_path) {
+	struct sockaddr_un address = { .sun_family = AF_UNIX };
+
+	if (strlen(socket_path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "connect_server() : socket path %s is too long\n", socket_path);
+		return -1;
+	}
+	strcpy(address.sun_path, socket_path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr*) &address, sizeof(address)) != 0) {
+		fprintf(stderr, "connect_server() : could not connect to %s\n", socket_path);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+
+	return fd;
+}
+
+// send the frame starting a request, block holds FRAME_MAX_SIZE bytes
+static int send_request(int fd, uint8_t operation, const char* name, const client_options* options, uint8_t* block) {
+	size_t name_length = strlen(name);
+	if (name_length > FRAME_MAX_SIZE - FRAME_REQUEST_SIZE) {
+		fprintf(stderr, "send_request() : name %s is too long\n", name);
+		return -1;
+	}
+
+	block[0] = operation;
+	block[1] = options->depth;
+	block[2] = options->alpha;
+	block[3] = options->compression;
+	memcpy(&block[FRAME_REQUEST_SIZE], name, name_length);
+
+	return frame_write(fd, FRAME_REQUEST, block, FRAME_REQUEST_SIZE + name_length);
+}
+
+// read the next frame of an answer into block, which holds FRAME_MAX_SIZE
+// bytes. returns 0, or -1 after printing why
+static int read_frame(int fd, uint8_t* type, uint32_t* size, uint8_t* block) {
+	if (frame_read_header(fd, type, size) != 0 || frame_read_body(fd, block, *size) != 0) {
+		fprintf(stderr, "read_frame() : connection to the server was lost\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+// check the status frame ending an answer about filename
+static int check_status(const char* filename, const uint8_t* block, uint32_t size) {
+	if (size < FRAME_STATUS_SIZE) {
+		fprintf(stderr, "check_status() : malformed answer from the server\n");
+		return -1;
+	}
+
+	if (block[0] != CSTEG_OK) {
+		fprintf(stderr, "%s: %.*s\n", filename, (int) (size - FRAME_STATUS_SIZE), (const char*) &block[FRAME_STATUS_SIZE]);
+		return -1;
+	}
+
+	return 0;
+}
+
+// send the first limit bytes of the file filename as a stream of frames
+static int send_file(int fd, uint8_t type, const char* filename, size_t limit, uint8_t* block) {
+	FILE* file_ptr = fopen(filename, "rb");
+	if (!file_ptr) {
+		fprintf(stderr, "send_file() : could not open %s for reading\n", filename);
+		return -1;
+	}
+
+	int result = frame_write_file(fd, type, file_ptr, limit, block);
+	fclose(file_ptr);
+
+	if (result != 0) {
+		// a server refusing the stream answers before closing the connection
+		uint8_t frame_type;
+		uint32_t size;
+		if (frame_read_header(fd, &frame_type, &size) == 0 && frame_type == FRAME_STATUS && frame_read_body(fd, block, size) == 0) {
+			check_status(filename, block, size);
+		} else {
+			fprintf(stderr, "send_file() : could not send %s\n", filename);
+		}
+	}
+
+	return result;
+}
+
+// write the frames of type of an answer about filename to file_ptr, if set,
+// until its status frame. returns 0, or -1 after printing why
+static int receive_stream(int fd, uint8_t type, FILE* file_ptr, const char* filename, const char* output, uint8_t* block) {
+	int result = 0;
+
+	for (;;) {
+		uint8_t frame_type;
+		uint32_t size;
+
+		if (read_frame(fd, &frame_type, &size, block) != 0) {
+			return -1;
+		}
+
+		if (frame_type == FRAME_STATUS) {
+			return check_status(filename, block, size) == 0 ? result : -1;
+		}
+
+		if (frame_type != type) {
+			fprintf(stderr, "receive_stream() : malformed answer from the server\n");
+			return -1;
+		}
+
+		// the rest of the answer is still read, so the connection stays usable
+		if (file_ptr && result == 0 && fwrite(block, 1, size, file_ptr) != size) {
+			fprintf(stderr, "receive_stream() : error writing to %s\n", output);
+			result = -1;
+		}
+	}
+}
+
+// allocate the block frames are read into and connect to the server
+static int open_request(const client_options* options, uint8_t** block) {
+	*block = (uint8_t*) malloc(FRAME_MAX_SIZE);
+	if (!*block) {
+		fprintf(stderr, "open_request() : out of memory\n");
+		return -1;
+	}
+
+	int fd = connect_server(options->socket_path);
+	if (fd < 0) {
+		free(*block);
+	}
+
+	return fd;
+}
+
+// whether filename is a regular file, which the server can map when passed
+// as a descriptor
+static int is_regular(const char* filename) {
+	struct stat st;
+	return stat(filename, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+// open a file written in place of filename, renamed over it by
+// finish_output once the request succeeds, so filename, which may be the
+// very image the server is reading, is untouched until then. devices and
+// pipes are opened directly. returns the descriptor, or -1 after printing why
+static int open_output(const char* filename, int flags, char** temp_filename) {
+	*temp_filename = NULL;
+
+	struct stat st;
+	int exists = stat(filename, &st) == 0;
+
+	if (exists && !S_ISREG(st.st_mode)) {
+		int fd = open(filename, flags | O_CLOEXEC);
+		if (fd < 0) {
+			fprintf(stderr, "open_output() : could not open %s for writing\n", filename);
+		}
+		return fd;
+	}
+
+	size_t size = strlen(filename) + 32;
+	*temp_filename = (char*) malloc(size);
+	if (!*temp_filename) {
+		fprintf(stderr, "open_output() : out of memory\n");
+		return -1;
+	}
+
+	// a name no other client is using
+	static unsigned int temp_count;
+	int fd;
+	do {
+		snprintf(*temp_filename, size, "%s.%ld.%u.tmp", filename, (long) getpid(), temp_count++);
+		fd = open(*temp_filename, flags | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+	} while (fd < 0 && errno == EEXIST);
+
+	if (fd < 0) {
+		fprintf(stderr, "open_output() : could not open %s for writing\n", filename);
+		free(*temp_filename);
+		*temp_filename = NULL;
+		return -1;
+	}
+
+	// the file replaced keeps its permissions
+	if (exists) {
+		fchmod(fd, st.st_mode & 07777);
+	}
+
+	return fd;
+}
+
+// put the file opened with open_output in place of filename if the request
+// succeeded, or remove it if it failed. only that file is ever removed,
+// never filename. returns result, or -1 if filename couldn't be replaced
+static int finish_output(const char* filename, char* temp_filename, int result) {
+	if (!temp_filename) {
+		return result;
+	}
+
+	if (result == 0 && rename(temp_filename, filename) != 0) {
+		fprintf(stderr, "finish_output() : could not replace %s\n", filename);
+		result = -1;
+	}
+
+	if (result != 0) {
+		remove(temp_filename);
+	}
+
+	free(temp_filename);
+	return result;
+}
+
+// refuse carriers the server can't read. uncompressed images are embedded
+// into in place and read a row at a time, which only works on files opened
+// locally. only regular files are probed, as a pipe can't be read twice;
+// the server refuses those itself. returns 0, or -1 after printing why
+static int check_carrier(const char* png_in) {
+	if (!is_regular(png_in)) {
+		return 0;
+	}
+
+	csteg_ctx* ctx = csteg_ctx_new();
+	csteg_image image;
+	int uncompressed = ctx && csteg_probe_file(ctx, png_in, &image) == CSTEG_OK && image.uncompressed;
+	csteg_ctx_free(ctx);
+
+	if (uncompressed) {
+		fprintf(stderr, "check_carrier() : %s is an uncompressed image, which the server can't read, run without --client\n", png_in);
+		return -1;
+	}
+
+	return 0;
+}
+
+// pass the file filename to the server in place of the stream of type
+static int pass_file(int fd, uint8_t type, const char* filename) {
+	int file_fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (file_fd < 0) {
+		fprintf(stderr, "pass_file() : could not open %s for reading\n", filename);
+		return -1;
+	}
+
+	int result = frame_write_file_fd(fd, type, file_fd);
+	if (result != 0) {
+		fprintf(stderr, "pass_file() : could not pass %s\n", filename);
+	}
+
+	close(file_fd);
+	return result;
+}
+
+// have the server map png_in and data_filename and write png_out itself
+static int embed_files(int fd, const char* png_in, const char* data_filename, const char* png_out,
+                       const client_options* options, uint8_t* block) {
+	int result = send_request(fd, FRAME_OP_EMBED_FILES, data_filename, options, block);
+	if (result == 0) {
+		result = pass_file(fd, FRAME_CARRIER, png_in);
+	}
+	if (result == 0) {
+		result = pass_file(fd, FRAME_DATA, data_filename);
+	}
+
+	if (result != 0) {
+		return -1;
+	}
+
+	// the server still reads png_in, which may be png_out itself
+	char* temp_filename;
+	int out_fd = open_output(png_out, O_WRONLY, &temp_filename);
+
+	// the server waits for the file, or to be told there is none
+	result = frame_write_file_fd(fd, FRAME_OUTPUT, out_fd);
+	if (out_fd >= 0) {
+		close(out_fd);
+	} else {
+		result = -1;
+	}
+
+	if (result == 0) {
+		result = receive_stream(fd, FRAME_OUTPUT, NULL, png_in, png_out, block);
+	}
+
+	// don't leave a partial png behind
+	return finish_output(png_out, temp_filename, result);
+}
+
+// stream png_in and data_filename to the server, writing the png it sends
+static int embed_stream(int fd, const char* png_in, const char* data_filename, const char* png_out,
+                        const client_options* options, uint8_t* block) {
+	// the server stores the name the data is sent under
+	int result = send_request(fd, FRAME_OP_EMBED, data_filename, options, block);
+	if (result == 0) {
+		result = send_file(fd, FRAME_CARRIER, png_in, SIZE_MAX, block);
+	}
+	if (result == 0) {
+		result = send_file(fd, FRAME_DATA, data_filename, SIZE_MAX, block);
+	}
+
+	FILE* file_ptr = NULL;
+	char* temp_filename = NULL;
+	if (result == 0) {
+		int out_fd = open_output(png_out, O_WRONLY, &temp_filename);
+
+		if (out_fd < 0) {
+			result = -1;
+		} else if (!(file_ptr = fdopen(out_fd, "wb"))) {
+			close(out_fd);
+			fprintf(stderr, "embed_stream() : could not open %s for writing\n", png_out);
+			result = -1;
+		}
+	}
+
+	if (result == 0) {
+		result = receive_stream(fd, FRAME_OUTPUT, file_ptr, png_in, png_out, block);
+	}
+
+	if (file_ptr && fclose(file_ptr) != 0 && result == 0) {
+		fprintf(stderr, "embed_stream() : error writing to %s\n", png_out);
+		result = -1;
+	}
+
+	// don't leave a partial png behind
+	return finish_output(png_out, temp_filename, result);
+}
+
+int client_embed(const char* png_in, const char* data_filename, const char* png_out, const client_options* options) {
+	if (!options->force && access(png_out, F_OK) != -1) {
+		fprintf(stderr, "client_embed() : File %s already exists\n", png_out);
+		return -1;
+	}
+
+	if (check_carrier(png_in) != 0) {
+		return -1;
+	}
+
+	uint8_t* block;
+	int fd = open_request(options, &block);
+	if (fd < 0) {
+		return -1;
+	}
+
+	// regular files are passed rather than copied through the socket,
+	// anything else, like a pipe, is streamed
+	int result;
+	if (is_regular(png_in) && is_regular(data_filename)) {
+		result = embed_files(fd, png_in, data_filename, png_out, options, block);
+	} else {
+		result = embed_stream(fd, png_in, data_filename, png_out, options, block);
+	}
+
+	close(fd);
+	free(block);
+	return result;
+}
+
+// open the file data_filename named by the server for the payload, which
+// may name the image being extracted from. returns the descriptor, or -1
+// after printing why
+static int open_target(const char* data_filename, const client_options* options, char** temp_filename) {
+	*temp_filename = NULL;
+
+	if (!options->force && access(data_filename, F_OK) != -1) {
+		fprintf(stderr, "client_extract() : File %s already exists\n", data_filename);
+		return -1;
+	}
+
+	// the server maps the file to write to it, which takes read access too
+	return open_output(data_filename, O_RDWR, temp_filename);
+}
+
+int client_extract(const char* png_in, const client_options* options) {
+	if (check_carrier(png_in) != 0) {
+		return -1;
+	}
+
+	uint8_t* block;
+	int fd = open_request(options, &block);
+	if (fd < 0) {
+		return -1;
+	}
+
+	// a regular file is passed and extracted from in place, so is the file
+	// the payload is extracted to
+	int pass = is_regular(png_in);
+	int result = send_request(fd, pass ? FRAME_OP_EXTRACT_FILES : FRAME_OP_EXTRACT, "", options, block);
+	if (result == 0) {
+		result = pass ? pass_file(fd, FRAME_CARRIER, png_in) : send_file(fd, FRAME_CARRIER, png_in, SIZE_MAX, block);
+	}
+
+	// the name comes first, unless the image couldn't be read
+	uint8_t type;
+	uint32_t size;
+	if (result == 0) {
+		result = read_frame(fd, &type, &size, block);
+	}
+
+	if (result == 0 && type == FRAME_STATUS) {
+		check_status(png_in, block, size);
+		result = -1;
+	} else if (result == 0 && (type != FRAME_NAME || size == 0 || memchr(block, '\0', size))) {
+		fprintf(stderr, "client_extract() : malformed answer from the server\n");
+		result = -1;
+	}
+
+	char* data_filename = NULL;
+	char* temp_filename = NULL;
+
+	if (result == 0) {
+		data_filename = strndup((const char*) block, size);
+		if (!data_filename) {
+			fprintf(stderr, "client_extract() : out of memory\n");
+			result = -1;
+		}
+	}
+
+	if (result == 0 && pass) {
+		int data_fd = open_target(data_filename, options, &temp_filename);
+
+		// the server waits for the file, or to be told there is none
+		if (frame_write_file_fd(fd, FRAME_DATA, data_fd) != 0) {
+			fprintf(stderr, "client_extract() : could not pass %s\n", data_filename);
+			result = -1;
+		} else {
+			result = receive_stream(fd, FRAME_DATA, NULL, png_in, data_filename, block);
+		}
+
+		if (data_fd >= 0) {
+			close(data_fd);
+		} else {
+			result = -1;
+		}
+	} else if (result == 0) {
+		FILE* file_ptr = NULL;
+		int data_fd = open_target(data_filename, options, &temp_filename);
+
+		if (data_fd >= 0 && !(file_ptr = fdopen(data_fd, "wb"))) {
+			close(data_fd);
+			fprintf(stderr, "client_extract() : could not open %s for writing\n", data_filename);
+		}
+
+		if (file_ptr) {
+			result = receive_stream(fd, FRAME_DATA, file_ptr, png_in, data_filename, block);
+		} else {
+			result = -1;
+		}
+
+		if (file_ptr && fclose(file_ptr) != 0 && result == 0) {
+			fprintf(stderr, "client_extract() : error writing to %s\n", data_filename);
+			result = -1;
+		}
+	}
+
+	// don't leave partial data behind
+	result = finish_output(data_filename, temp_filename, result);
+
+	free(data_filename);
+	close(fd);
+	free(block);
+	return result;
+}
+
+int client_probe(const char* png_in, csteg_image* image, const client_options* options) {
+	if (check_carrier(png_in) != 0) {
+		return -1;
+	}
+
+	uint8_t* block;
+	int fd = open_request(options, &block);
+	if (fd < 0) {
+		return -1;
+	}
+
+	// the header is all the server reads
+	int result = send_request(fd, FRAME_OP_PROBE, "", options, block);
+	if (result == 0) {
+		result = send_file(fd, FRAME_CARRIER, png_in, PROBE_LIMIT, block);
+	}
+
+	uint8_t type;
+	uint32_t size;
+	if (result == 0) {
+		result = read_frame(fd, &type, &size, block);
+	}
+
+	if (result == 0 && type == FRAME_STATUS) {
+		check_status(png_in, block, size);
+		result = -1;
+	} else if (result == 0 && (type != FRAME_INFO || size != FRAME_PROBE_SIZE)) {
+		fprintf(stderr, "client_probe() : malformed answer from the server\n");
+		result = -1;
+	}
+
+	if (result == 0) {
+		image->width = frame_load(block, 4);
+		image->height = frame_load(&block[4], 4);
+		image->color_type = block[8];
+		image->bit_depth = block[9];
+		image->interlaced = block[10];
+		image->uncompressed = 0; // see check_carrier
+
+		result = receive_stream(fd, FRAME_INFO, NULL, png_in, NULL, block);
+	}
+
+	close(fd);
+	free(block);
+	return result;
+}
+
+int client_stats(const client_options* options) {
+	uint8_t* block;
+	int fd = open_request(options, &block);
+	if (fd < 0) {
+		return -1;
+	}
+
+	int result = send_request(fd, FRAME_OP_STATS, "", options, block);
+	if (result == 0) {
+		result = receive_stream(fd, FRAME_INFO, stdout, options->socket_path, "stdout", block);
+	}
+
+	close(fd);
+	free(block);
+	return result;
+}
@@ -0,0 +1,40 @@
+//===================== Copyright 2020, Jake Grossman =======================//
+//
+// Purpose: send embed, extract and probe requests to a running server
+//
+// This file is subject to the terms and conditions defined in the
+// file 'LICENSE.txt', which is part of this source code package
+//
+//===========================================================================//
+#ifndef CSTEG_CLIENT_H
+#define CSTEG_CLIENT_H
+
+#include "csteg.h"
+
+// server requests are sent to, and the options they are run with
+typedef struct {
+	const char* socket_path; // unix domain socket the server listens on
+	int force; // overwrite existing output files
+	int depth; // bits per channel when embedding
+	int alpha; // also store data in alpha channels when embedding
+	csteg_compression compression; // compression of images written
+} client_options;
+
+// have the server embed the file data_filename into png_in, writing the
+// result to png_out. the server only reads pngs, so uncompressed images
+// are refused. returns 0, or -1 after printing why to stderr
+int client_embed(const char* png_in, const char* data_filename, const char* png_out, const client_options* options);
+
+// have the server extract the payload of png_in, writing it to the file
+// named by the image. returns 0, or -1 after printing why to stderr
+int client_extract(const char* png_in, const client_options* options);
+
+// have the server read the header of png_in. returns 0, or -1 after
+// printing why to stderr
+int client_probe(const char* png_in, csteg_image* image, const client_options* options);
+
+// print the latencies of the requests the server answered to stdout.
+// returns 0, or -1 after printing why to stderr
+int client_stats(const client_options* options);
+
+#endif
@@ -0,0 +1,2935 @@
+//===================== Copyright 2020, Jake Grossman =======================//
+//
+// Purpose: libcsteg, embedding files in PNG images and extracting them
+//
+// Every public function sets a jump buffer in its context, and any error
+// below it (including those reported by libpng) jumps back there through
+// fail(). Everything an operation allocates is held in the context, so the
+// public function releases it with reset_ctx() and returns the error code.
+//
+// This file is subject to the terms and conditions defined in the
+// file 'LICENSE.txt', which is part of this source code package
+//
+//===========================================================================//
+#define _GNU_SOURCE // copy_file_range
+#include <stdio.h>
+#include <stdarg.h> // va_list, va_start, va_end
+#include <stdlib.h> // malloc
+#include <stdint.h> // uint8_t
+#include <string.h> // strlen
+#include <errno.h> // errno, EEXIST
+#include <unistd.h> // read, close, copy_file_range
+#include <fcntl.h> // open
+#include <sys/stat.h> // fstat
+#include <sys/mman.h> // mmap, madvise, munmap
+#include <sys/sendfile.h> // sendfile
+#include <sys/ioctl.h> // ioctl
+#include <linux/fs.h> // FICLONE
+#include <ctype.h> // isspace, isdigit
+#include <png.h> // libpng
+#include <zlib.h> // Z_DEFAULT_COMPRESSION, Z_FILTERED
+#include <setjmp.h> // jmp_buf, setjmp, longjmp
+#include "csteg.h"
+#include "kernel.h"
+#include "pool.h"
+#include "encoder.h"
+
+// signatures start with a magic number and a version, followed by flags,
+// the 32-bit filename length, the 64-bit data size and the filename. legacy
+// signatures start with the 32-bit filename length instead, so they would
+// need a filename of over a gigabyte to start with the magic number
+#define SIG_MAGIC "CSTG"
+#define SIG_MAGIC_SIZE 4
+#define SIG_VERSION 2
+#define SIG_HEADER_SIZE 18 // magic, version, flags, filename length and data size
+
+// legacy signatures hold a 32-bit filename length and a 32-bit data size
+#define SIG_LEGACY_SIZE_BITS 32
+#define SIG_LEGACY_HEADER_SIZE 8
+
+// flags describing how the data is stored. legacy signatures keep them in
+// the top byte of the filename length, where they are 0 for images using
+// the default depth, which were readable by versions that stored
+// everything at 2 bits per channel
+#define SIG_FLAG_PRESENT 0x80 // legacy only, flags are set, filename length is 24 bits
+#define SIG_FLAG_DEPTH 0x03 // bits per channel used for the data, minus one
+#define SIG_FLAG_ALPHA 0x04 // data is stored in every channel, alpha included
+#define SIG_FLAG_COMPRESSION 0x18 // how the data is compressed, 0 for none (the only method so far)
+#define SIG_FLAG_SHARD 0x20 // version 2 only, the data is one shard of a larger payload
+
+// shards follow the header with the payload id, the 32-bit shard index and
+// count, the 64-bit offset of the shard in the payload and the 64-bit size
+// of the payload, before the filename
+#define SIG_SHARD_SIZE CSTEG_SHARD_HEADER_SIZE
+
+// a png starts with an 8 byte signature and its IHDR chunk, made of the
+// length, the type, 13 bytes of data and a crc
+#define PNG_SIG_SIZE 8
+#define IHDR_DATA_SIZE 13
+#define PROBE_SIZE (PNG_SIG_SIZE + 8 + IHDR_DATA_SIZE + 4)
+
+// pixel buffers are aligned for the vector kernels, and rows are padded to
+// keep every row aligned. buffers of at least a huge page are mapped
+// directly so the kernel can back them with huge pages
+#define ARENA_ALIGNMENT 64
+#define HUGE_PAGE_SIZE (2 << 20)
+
+// precooked carriers start with a magic number and a version, followed by
+// the 32-bit width and height, the channels per pixel, the bits per channel
+// and the 32-bit distance between rows. rows start on the page after it, so
+// a mapped file hands them out as aligned as a decoded carrier would
+#define RAW_MAGIC "CSTGRAW"
+#define RAW_MAGIC_SIZE 8 // null terminator included
+#define RAW_VERSION 1
+#define RAW_HEADER_SIZE 26
+#define RAW_DATA_OFFSET 4096
+
+// uncompressed images. their header has to lie within the first
+// RAW_IMAGE_HEADER_MAX bytes of the file
+#define RAW_IMAGE_HEADER_MAX 4096
+#define BMP_HEADER_SIZE 54 // file header and BITMAPINFOHEADER
+#define BMP_FILE_HEADER_SIZE 14
+#define BMP_INFO_HEADER_SIZE 40
+#define BMP_V4_HEADER_SIZE 108 // first info header holding an alpha mask
+#define BMP_MASKS_SIZE 12 // red, green and blue masks following a BITMAPINFOHEADER
+#define BMP_RGB 0 // uncompressed
+#define BMP_BITFIELDS 3 // uncompressed, with channel masks
+
+// size of the blocks non-regular data files are read in
+#define PAYLOAD_BLOCK_SIZE (1 << 20)
+
+// rows are decoded into bands of about this size before being split across
+// threads, small enough to stay in cache and large enough to keep each
+// thread busy for much longer than it takes to wake it
+#define BAND_BYTES (4 << 20)
+
+// zlib settings and row filters of each csteg_compression. the default
+// matches what libpng does when left alone
+static const encoder_profile compression_profiles[] = {
+	[CSTEG_COMPRESS_DEFAULT] = { Z_DEFAULT_COMPRESSION, Z_FILTERED, 8, 15, ENCODER_FILTER_ALL },
+	[CSTEG_COMPRESS_FAST] = { 1, Z_DEFAULT_STRATEGY, 9, 15, ENCODER_FILTER_UP },
+	[CSTEG_COMPRESS_MAX] = { 9, Z_FILTERED, 9, 15, ENCODER_FILTER_ALL },
+	[CSTEG_COMPRESS_STORE] = { 0, Z_DEFAULT_STRATEGY, 8, 15, ENCODER_FILTER_NONE },
+};
+
+// properties of the image being read, and of the image written from it
+typedef struct {
+	size_t width, height; // width and height of png
+	png_byte color_type; // color type of png
+	png_byte bit_depth; // bit depth of png
+	size_t pixel_channels; // channels per pixel, including alpha
+	size_t color_channels; // color channels per pixel, excluding alpha
+	size_t sample_bytes; // bytes per channel, 2 for 16-bit images
+	int number_of_passes;
+} image_info;
+
+// single allocation holding pixel rows
+typedef struct {
+	uint8_t* base; // start of the allocation
+	size_t mapped_size; // size of the mapping, 0 if allocated with posix_memalign
+} pixel_arena;
+
+// png read from memory
+typedef struct {
+	const uint8_t* data;
+	size_t size;
+	size_t pos; // index of the next byte to be read
+} memory_source;
+
+// png written to memory
+typedef struct {
+	uint8_t* data;
+	size_t size;
+	size_t capacity;
+} memory_sink;
+
+// state of a png being read one row at a time
+typedef struct {
+	FILE* file_ptr; // NULL when reading from memory
+	memory_source source;
+	png_structp png_ptr;
+	png_infop info_ptr;
+	size_t rowbytes; // size of a single row in bytes
+	size_t next_row; // index of the next row to be returned
+	png_bytep* row_pointers; // every row, only used for interlaced images
+	pixel_arena arena; // holds a band of rows, or every row of interlaced images
+
+	// uncompressed images are read a row at a time with pread, never decoded
+	int raw; // whether the image is an uncompressed BMP, PGM, PPM or PAM file
+	int raw_fd;
+	uint64_t raw_size; // size of the file
+	uint64_t raw_offset; // offset of the first row stored in the file
+	size_t raw_stride; // distance between the rows stored in the file
+	int raw_bottom_up; // whether the last row is stored first, as in most BMPs
+} png_reader;
+
+// state of a png being written one band at a time. libpng writes it on a
+// single thread, otherwise the encoder deflates each band on every thread
+typedef struct {
+	FILE* file_ptr; // NULL when writing to memory
+	const char* filename;
+	char* temp_filename; // written in place of filename and renamed over it once complete
+	memory_sink sink;
+	png_structp png_ptr;
+	png_infop info_ptr;
+	png_encoder* encoder;
+} png_writer;
+
+// part of the payload stored at a fixed depth in a run of consecutive
+// channels, numbered across the whole image. the signature is always stored
+// at 2 bits per color channel from the first channel on, so it can be read
+// before the depth of the data is known. the data follows right after it,
+// or from the next pixel on if it also uses the alpha channel
+typedef struct {
+	size_t first_channel; // first channel holding the region
+	size_t channels; // number of channels holding the region
+	int depth; // bits stored in each channel
+	int all_channels; // whether alpha channels are used as well as color channels
+	size_t bit_pos; // index of the next bit to extract, when reading
+} payload_region;
+
+// data being embedded. regular files are mapped, anything else (such as a
+// pipe) is read whole in blocks, since its size has to be known before the
+// signature is written. memory passed in by the caller is used in place
+typedef struct {
+	const uint8_t* data; // contents of the data
+	size_t size; // size of data in bytes
+	size_t mapped_size; // size of the mapping, 0 if data isn't mapped
+	int owned; // whether data was allocated by open_payload
+	size_t offset; // bytes of the mapping or allocation before data
+	int fd; // data file while it is being loaded, -1 otherwise
+} payload_buffer;
+
+// every pixel row of a decoded png, read by any number of contexts at once
+struct csteg_carrier {
+	image_info image;
+	size_t rowbytes; // size of a single row in bytes
+	size_t stride; // distance between the rows of arena
+	pixel_arena arena; // rows, unless mapped from a precooked file
+	uint8_t* mapping; // precooked file holding the rows, NULL if they are in arena
+	size_t mapping_size;
+};
+
+// channels of a band being extracted, split across threads
+typedef struct {
+	const payload_region* region;
+	uint8_t* buffer; // holds the bytes of the region from bit start_bit on
+	size_t size;
+	size_t start_bit;
+	size_t first, last; // channels of the region to extract
+} extract_job;
+
+struct csteg_ctx {
+	// options
+	int depth; // bits per channel used for the data when embedding
+	int alpha; // whether alpha channels are used when embedding
+	size_t threads; // threads embedding or extracting each band of rows
+	csteg_compression compression; // compression of images written
+
+	// error handling
+	jmp_buf jmp; // set by the public function running, fail() returns to it
+	csteg_status status; // code of the last error
+	char error[256]; // message describing the last error
+
+	image_info image;
+
+	// state of the running operation, released by reset_ctx
+	int reader_open, writer_open, payload_open;
+	png_reader reader;
+	png_writer writer;
+	payload_buffer payload;
+	uint8_t* signature;
+	size_t signature_size;
+	const csteg_shard* embed_shard; // shard being embedded, NULL for a whole payload
+	const csteg_carrier* carrier; // decoded carrier embedded into, NULL when a png is read
+	csteg_carrier* owned_carrier; // carrier decoded or loaded by the operation, released with it
+	pixel_arena scratch; // color channels of rows with alpha, one row per thread
+	size_t scratch_stride; // distance between the rows of scratch
+	payload_region sig_region;
+	payload_region data_region;
+
+	// rows decoded together, embedded or extracted by every thread at once
+	thread_pool* pool; // started on first use, kept across operations
+	png_bytep* band_rows;
+	size_t band_capacity; // most rows a band holds
+	size_t band_first, band_count; // index of the first row of the band, and number of rows in it
+	extract_job job;
+
+	// state of extraction, between csteg_open_* and csteg_close
+	int extracting;
+	char* data_filename;
+	size_t data_size;
+	size_t data_remaining; // payload bytes not yet extracted from the image
+	int sharded; // whether the image holds a shard of a payload
+	csteg_shard shard; // the shard held by the image, if sharded
+	uint8_t block[MAX_DEPTH]; // bytes extracted ahead of a read that wasn't a whole number of chunks
+	size_t block_pos, block_length;
+};
+
+//===========================================================================//
+// errors
+//===========================================================================//
+
+// record an error in ctx, returning its code
+static csteg_status set_error(csteg_ctx* ctx, csteg_status status, const char* fmt, va_list args) {
+	ctx->status = status;
+	vsnprintf(ctx->error, sizeof(ctx->error), fmt, args);
+	return status;
+}
+
+// record an error and return to the public function that was called
+__attribute__((noreturn, format(printf, 3, 4)))
+static void fail(csteg_ctx* ctx, csteg_status status, const char* fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	set_error(ctx, status, fmt, args);
+	va_end(args);
+	longjmp(ctx->jmp, 1);
+}
+
+// record an error without jumping, for checks made before the jump buffer is set
+__attribute__((format(printf, 3, 4)))
+static csteg_status refuse(csteg_ctx* ctx, csteg_status status, const char* fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	set_error(ctx, status, fmt, args);
+	va_end(args);
+	return status;
+}
+
+// libpng reports errors here instead of to its own jump buffer
+static void png_error_handler(png_structp png_ptr, png_const_charp message) {
+	fail((csteg_ctx*) png_get_error_ptr(png_ptr), CSTEG_ERR_PNG, "libpng : %s", message);
+}
+
+// warnings are not errors, and a library doesn't print them
+static void png_warning_handler(png_structp png_ptr, png_const_charp message) {
+	(void) png_ptr;
+	(void) message;
+}
+
+// malloc, failing instead of returning NULL
+static void* alloc_or_fail(csteg_ctx* ctx, size_t size) {
+	void* ptr = malloc(size ? size : 1);
+
+	if (!ptr) {
+		fail(ctx, CSTEG_ERR_NOMEM, "could not allocate %zu bytes", size);
+	}
+
+	return ptr;
+}
+
+//===========================================================================//
+// pixel arenas
+//===========================================================================//
+
+// allocate an arena of size bytes, aligned to ARENA_ALIGNMENT
+static void alloc_pixel_arena(csteg_ctx* ctx, pixel_arena* arena, size_t size) {
+	arena->mapped_size = 0;
+
+	if (size >= HUGE_PAGE_SIZE) {
+		size_t mapped_size = (size + HUGE_PAGE_SIZE - 1) & ~((size_t) HUGE_PAGE_SIZE - 1);
+		void* base = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (base != MAP_FAILED) {
+#ifdef MADV_HUGEPAGE
+			// a hint only, the arena works the same without huge pages
+			madvise(base, mapped_size, MADV_HUGEPAGE);
+#endif
+			arena->base = (uint8_t*) base;
+			arena->mapped_size = mapped_size;
+			return;
+		}
+	}
+
+	// small arenas, or mmap failed
+	void* base;
+	if (posix_memalign(&base, ARENA_ALIGNMENT, size ? size : 1) != 0) {
+		fail(ctx, CSTEG_ERR_NOMEM, "alloc_pixel_arena() : could not allocate %zu bytes", size);
+	}
+	arena->base = (uint8_t*) base;
+}
+
+// release an arena allocated with alloc_pixel_arena, if any
+static void free_pixel_arena(pixel_arena* arena) {
+	if (!arena->base) {
+		return;
+	}
+
+	if (arena->mapped_size) {
+		munmap(arena->base, arena->mapped_size);
+	} else {
+		free(arena->base);
+	}
+	arena->base = NULL;
+}
+
+// distance between rows in an arena, rounded up to keep rows aligned
+static size_t arena_row_stride(size_t rowbytes) {
+	return (rowbytes + ARENA_ALIGNMENT - 1) & ~((size_t) ARENA_ALIGNMENT - 1);
+}
+
+//===========================================================================//
+// png input and output
+//===========================================================================//
+
+// libpng read callback for pngs held in memory
+static void read_memory(png_structp png_ptr, png_bytep data, png_size_t length) {
+	memory_source* source = (memory_source*) png_get_io_ptr(png_ptr);
+
+	if (length > source->size - source->pos) {
+		png_error(png_ptr, "unexpected end of image");
+	}
+
+	memcpy(data, source->data + source->pos, length);
+	source->pos += length;
+}
+
+// append length bytes to a png written to memory
+static void append_memory(csteg_ctx* ctx, memory_sink* sink, const uint8_t* data, size_t length) {
+	// grow geometrically so appending stays linear
+	if (length > sink->capacity - sink->size) {
+		size_t capacity = sink->capacity ? sink->capacity : 1 << 16;
+		while (length > capacity - sink->size) {
+			capacity *= 2;
+		}
+
+		uint8_t* data = (uint8_t*) realloc(sink->data, capacity);
+		if (!data) {
+			fail(ctx, CSTEG_ERR_NOMEM, "append_memory() : could not allocate %zu bytes", capacity);
+		}
+
+		sink->data = data;
+		sink->capacity = capacity;
+	}
+
+	memcpy(sink->data + sink->size, data, length);
+	sink->size += length;
+}
+
+// libpng write callback for pngs written to memory
+static void write_memory(png_structp png_ptr, png_bytep data, png_size_t length) {
+	append_memory((csteg_ctx*) png_get_error_ptr(png_ptr), (memory_sink*) png_get_io_ptr(png_ptr), data, length);
+}
+
+// encoder output callback, writing to the file or memory of the writer
+static void write_encoded(void* io, const uint8_t* data, size_t size) {
+	csteg_ctx* ctx = (csteg_ctx*) io;
+	png_writer* writer = &ctx->writer;
+
+	if (!writer->file_ptr) {
+		append_memory(ctx, &writer->sink, data, size);
+	} else if (fwrite(data, 1, size, writer->file_ptr) != size) {
+		fail(ctx, CSTEG_ERR_IO, "write_encoded() : error writing %s", writer->filename);
+	}
+}
+
+// libpng flush callback for pngs written to memory
+static void flush_memory(png_structp png_ptr) {
+	(void) png_ptr;
+}
+
+// channels per pixel of a color type, including and excluding alpha.
+// returns 0 if data can't be stored in images of the color type
+static int format_channels(int color_type, size_t* pixel_channels, size_t* color_channels) {
+	switch (color_type) {
+		case PNG_COLOR_TYPE_RGB:
+			*pixel_channels = 3;
+			*color_channels = 3;
+			return 1;
+		case PNG_COLOR_TYPE_RGBA:
+			*pixel_channels = 4;
+			*color_channels = 3;
+			return 1;
+		case PNG_COLOR_TYPE_GRAY:
+			*pixel_channels = 1;
+			*color_channels = 1;
+			return 1;
+		case PNG_COLOR_TYPE_GA:
+			*pixel_channels = 2;
+			*color_channels = 1;
+			return 1;
+	}
+
+	return 0;
+}
+
+// fill in the channels of an image from its color type and bit depth,
+// failing if they can't hold data
+static void set_image_format(csteg_ctx* ctx, image_info* image, const char* filename) {
+	// fail if color type is not RGB, RGBA, gray or gray with alpha
+	if (!format_channels(image->color_type, &image->pixel_channels, &image->color_channels)) {
+		fail(ctx, CSTEG_ERR_FORMAT, "set_image_format() : File %s is not RGB, RGBA, gray or gray with alpha", filename);
+	}
+
+	// gray images may pack several pixels into a byte
+	if (image->bit_depth < 8) {
+		fail(ctx, CSTEG_ERR_FORMAT, "set_image_format() : File %s has less than 8 bits per channel", filename);
+	}
+
+	// 16-bit samples are big-endian, data goes into their low (second) byte
+	image->sample_bytes = image->bit_depth / 8;
+}
+
+// whether size bytes at header start an uncompressed image file: a
+// BMP, PGM, PPM or PAM image
+static int is_raw_image_header(const uint8_t* header, size_t size) {
+	if (size >= 2 && header[0] == 'B' && header[1] == 'M') {
+		return 1;
+	}
+
+	return size >= 3 && header[0] == 'P' && (header[1] == '5' || header[1] == '6' || header[1] == '7') && isspace(header[2]);
+}
+
+// open a png and read its header into ctx->image. the png is read from the
+// file filename, or from png_size bytes at png if filename is NULL
+static void open_png_reader(csteg_ctx* ctx, const char* filename, const void* png, size_t png_size) {
+	png_reader* reader = &ctx->reader;
+	image_info* image = &ctx->image;
+
+	memset(reader, 0, sizeof(*reader));
+	ctx->reader_open = 1;
+
+	// test that file is png
+	unsigned char header[8];
+	size_t header_size;
+
+	if (filename) {
+		// open file
+		reader->file_ptr = fopen(filename, "rb");
+
+		// check that file_ptr exists
+		if (!reader->file_ptr) {
+			fail(ctx, CSTEG_ERR_IO, "open_png_reader() : File %s could not be opened for reading", filename);
+		}
+
+		// copy first 8 bytes of file
+		header_size = fread(header, 1, 8, reader->file_ptr);
+	} else {
+		filename = "(memory)";
+
+		// copy first 8 bytes of buffer
+		reader->source.data = (const uint8_t*) png;
+		reader->source.size = png_size;
+		header_size = png_size < 8 ? png_size : 8;
+		memcpy(header, png, header_size);
+		reader->source.pos = header_size;
+	}
+
+	// validate
+	int is_png = header_size == 8 && !png_sig_cmp(header, 0, 8);
+	if (!is_png && is_raw_image_header(header, header_size)) {
+		// those are only ever read from a file, a row at a time
+		if (reader->file_ptr) {
+			fail(ctx, CSTEG_ERR_FORMAT, "open_png_reader() : File %s is an uncompressed image, which is embedded into in place rather than decoded", filename);
+		}
+		fail(ctx, CSTEG_ERR_FORMAT, "open_png_reader() : uncompressed images can only be read from a file, not from memory");
+	}
+	if (!is_png) {
+		fail(ctx, CSTEG_ERR_NOT_PNG, "open_png_reader() : File %s is not recognized as a PNG file", filename);
+	}
+
+	// initialize variables, errors are reported to png_error_handler
+	reader->png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, ctx, png_error_handler, png_warning_handler);
+
+	// check that png_ptr was created successfully
+	if (!reader->png_ptr) {
+		fail(ctx, CSTEG_ERR_NOMEM, "open_png_reader() : png_create_read_struct failed");
+	}
+
+	reader->info_ptr = png_create_info_struct(reader->png_ptr);
+
+	// check that info_ptr was created successfully
+	if (!reader->info_ptr) {
+		fail(ctx, CSTEG_ERR_NOMEM, "open_png_reader() : png_create_info_struct failed");
+	}
+
+	if (reader->file_ptr) {
+		png_init_io(reader->png_ptr, reader->file_ptr);
+	} else {
+		png_set_read_fn(reader->png_ptr, &reader->source, read_memory);
+	}
+	png_set_sig_bytes(reader->png_ptr, 8);
+
+	// read information from png
+	png_read_info(reader->png_ptr, reader->info_ptr);
+
+	// set image variables
+	image->width = png_get_image_width(reader->png_ptr, reader->info_ptr);
+	image->height = png_get_image_height(reader->png_ptr, reader->info_ptr);
+	image->color_type = png_get_color_type(reader->png_ptr, reader->info_ptr);
+	image->bit_depth = png_get_bit_depth(reader->png_ptr, reader->info_ptr);
+
+	set_image_format(ctx, image, filename);
+
+	image->number_of_passes = png_set_interlace_handling(reader->png_ptr);
+	png_read_update_info(reader->png_ptr, reader->info_ptr);
+
+	reader->rowbytes = png_get_rowbytes(reader->png_ptr, reader->info_ptr);
+}
+
+// returns the next row of the png
+//
+// non-interlaced images are decoded one row at a time into slot of a band
+// of ctx->band_capacity rows, which is valid until the slot is read into
+// again. interlaced images cannot be streamed, so the whole image is decoded
+// into row_pointers on the first call
+static png_bytep read_png_row(csteg_ctx* ctx, size_t slot) {
+	png_reader* reader = &ctx->reader;
+	size_t height = ctx->image.height;
+
+	if (ctx->image.number_of_passes > 1) {
+		// decode the whole image on first use, into a single arena
+		if (!reader->row_pointers) {
+			size_t stride = arena_row_stride(reader->rowbytes);
+			alloc_pixel_arena(ctx, &reader->arena, stride * height);
+
+			reader->row_pointers = (png_bytep*) alloc_or_fail(ctx, sizeof(png_bytep) * height);
+			for (size_t y = 0; y < height; y++) {
+				reader->row_pointers[y] = reader->arena.base + y * stride;
+			}
+			png_read_image(reader->png_ptr, reader->row_pointers);
+		}
+
+		return reader->row_pointers[reader->next_row++];
+	}
+
+	// allocate band on first use
+	size_t stride = arena_row_stride(reader->rowbytes);
+	if (!reader->arena.base) {
+		alloc_pixel_arena(ctx, &reader->arena, stride * ctx->band_capacity);
+	}
+
+	png_bytep row = reader->arena.base + slot * stride;
+	png_read_row(reader->png_ptr, row, NULL);
+	reader->next_row++;
+
+	return row;
+}
+
+// take the header of a decoded carrier in place of a png opened with
+// open_png_reader. its rows are then returned by carrier_row
+static void open_carrier(csteg_ctx* ctx, const csteg_carrier* carrier) {
+	memset(&ctx->reader, 0, sizeof(ctx->reader));
+	ctx->reader_open = 1;
+	ctx->reader.rowbytes = carrier->rowbytes;
+
+	ctx->image = carrier->image;
+	ctx->carrier = carrier;
+}
+
+// decode every row of the open png into a new carrier
+static csteg_carrier* decode_carrier(csteg_ctx* ctx) {
+	png_reader* reader = &ctx->reader;
+	size_t height = ctx->image.height;
+
+	csteg_carrier* carrier = (csteg_carrier*) alloc_or_fail(ctx, sizeof(csteg_carrier));
+	memset(carrier, 0, sizeof(*carrier));
+	ctx->owned_carrier = carrier;
+
+	carrier->image = ctx->image;
+	carrier->rowbytes = reader->rowbytes;
+	carrier->stride = arena_row_stride(reader->rowbytes);
+	alloc_pixel_arena(ctx, &carrier->arena, carrier->stride * height);
+
+	// libpng handles interlacing when the whole image is read at once
+	reader->row_pointers = (png_bytep*) alloc_or_fail(ctx, sizeof(png_bytep) * height);
+	for (size_t y = 0; y < height; y++) {
+		reader->row_pointers[y] = carrier->arena.base + y * carrier->stride;
+	}
+	png_read_image(reader->png_ptr, reader->row_pointers);
+
+	ctx->owned_carrier = NULL;
+	return carrier;
+}
+
+// close a png opened with open_png_reader, skipping any rows not yet read
+static void close_png_reader(csteg_ctx* ctx) {
+	png_reader* reader = &ctx->reader;
+
+	if (!ctx->reader_open) {
+		return;
+	}
+	ctx->reader_open = 0;
+
+	if (reader->png_ptr) {
+		png_destroy_read_struct(&reader->png_ptr, &reader->info_ptr, NULL);
+	}
+
+	// cleanup allocated memory, every row is released at once
+	free_pixel_arena(&reader->arena);
+	free(reader->row_pointers);
+
+	if (reader->file_ptr) {
+		fclose(reader->file_ptr);
+	}
+
+	if (reader->raw) {
+		close(reader->raw_fd);
+	}
+}
+
+// libpng filter flags of a set of ENCODER_FILTER_*
+static int png_filters(int filters) {
+	return (filters & ENCODER_FILTER_NONE ? PNG_FILTER_NONE : 0) |
+	       (filters & ENCODER_FILTER_SUB ? PNG_FILTER_SUB : 0) |
+	       (filters & ENCODER_FILTER_UP ? PNG_FILTER_UP : 0) |
+	       (filters & ENCODER_FILTER_AVERAGE ? PNG_FILTER_AVG : 0) |
+	       (filters & ENCODER_FILTER_PAETH ? PNG_FILTER_PAETH : 0);
+}
+
+// open the file filename for writing into ctx->writer. regular files are
+// written to a new file next to them, renamed over them by close_output once
+// complete, so the file replaced, which may well be the one being read, is
+// left untouched until then. anything else, such as a device, is written to
+// directly
+static void open_output(csteg_ctx* ctx, const char* filename, const char* mode) {
+	png_writer* writer = &ctx->writer;
+	writer->filename = filename;
+
+	struct stat st;
+	int exists = stat(filename, &st) == 0;
+
+	if (exists && !S_ISREG(st.st_mode)) {
+		writer->file_ptr = fopen(filename, mode);
+
+		if (!writer->file_ptr) {
+			fail(ctx, CSTEG_ERR_IO, "open_output() : File %s could not be opened for writing", filename);
+		}
+		return;
+	}
+
+	// a name no other writer, in this process or another, is using
+	static unsigned int temp_count;
+	size_t size = strlen(filename) + 32;
+	char* temp_filename = (char*) alloc_or_fail(ctx, size);
+	int fd;
+
+	do {
+		unsigned int count = __atomic_fetch_add(&temp_count, 1, __ATOMIC_RELAXED);
+		snprintf(temp_filename, size, "%s.%ld.%u.tmp", filename, (long) getpid(), count);
+		fd = open(temp_filename, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+	} while (fd < 0 && errno == EEXIST);
+
+	if (fd < 0) {
+		free(temp_filename);
+		fail(ctx, CSTEG_ERR_IO, "open_output() : File %s could not be opened for writing", filename);
+	}
+	writer->temp_filename = temp_filename;
+
+	// the file replaced keeps its permissions
+	if (exists) {
+		fchmod(fd, st.st_mode & 07777);
+	}
+
+	writer->file_ptr = fdopen(fd, mode);
+	if (!writer->file_ptr) {
+		close(fd);
+		fail(ctx, CSTEG_ERR_IO, "open_output() : File %s could not be opened for writing", filename);
+	}
+}
+
+// close the file opened with open_output, putting it in place of the file
+// it replaces
+static void close_output(csteg_ctx* ctx) {
+	png_writer* writer = &ctx->writer;
+
+	FILE* file_ptr = writer->file_ptr;
+	writer->file_ptr = NULL;
+
+	// buffered bytes may only fail to be written now
+	if (fclose(file_ptr) != 0) {
+		fail(ctx, CSTEG_ERR_IO, "close_output() : error writing %s", writer->filename);
+	}
+
+	if (writer->temp_filename) {
+		if (rename(writer->temp_filename, writer->filename) != 0) {
+			fail(ctx, CSTEG_ERR_IO, "close_output() : File %s could not be replaced", writer->filename);
+		}
+
+		free(writer->temp_filename);
+		writer->temp_filename = NULL;
+	}
+}
+
+// create a png and write its header from ctx->image. the png is written to
+// the file filename, or to memory if filename is NULL, in bands of the size
+// set by open_bands
+static void open_png_writer(csteg_ctx* ctx, const char* filename) {
+	png_writer* writer = &ctx->writer;
+	image_info* image = &ctx->image;
+
+	memset(writer, 0, sizeof(*writer));
+	ctx->writer_open = 1;
+
+	if (filename) {
+		open_output(ctx, filename, "wb");
+	}
+
+	// bands are deflated by every thread
+	if (ctx->threads > 1) {
+		writer->encoder = encoder_create(image->width, image->height, image->bit_depth, image->color_type, image->pixel_channels,
+		                                 ctx->band_capacity, ctx->threads, &compression_profiles[ctx->compression],
+		                                 write_encoded, ctx);
+
+		if (!writer->encoder) {
+			fail(ctx, CSTEG_ERR_NOMEM, "open_png_writer() : could not create encoder");
+		}
+
+		encoder_write_header(writer->encoder);
+		return;
+	}
+
+	// initialize variables, errors are reported to png_error_handler
+	writer->png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, ctx, png_error_handler, png_warning_handler);
+
+	// check that png_ptr was created successfully
+	if (!writer->png_ptr) {
+		fail(ctx, CSTEG_ERR_NOMEM, "open_png_writer() : png_create_write_struct failed");
+	}
+
+	writer->info_ptr = png_create_info_struct(writer->png_ptr);
+
+	// check that info_ptr was created successfully
+	if (!writer->info_ptr) {
+		fail(ctx, CSTEG_ERR_NOMEM, "open_png_writer() : png_create_info_struct failed");
+	}
+
+	if (writer->file_ptr) {
+		png_init_io(writer->png_ptr, writer->file_ptr);
+	} else {
+		png_set_write_fn(writer->png_ptr, &writer->sink, write_memory, flush_memory);
+	}
+
+	// the default is left to libpng, keeping its output unchanged
+	if (ctx->compression != CSTEG_COMPRESS_DEFAULT) {
+		const encoder_profile* profile = &compression_profiles[ctx->compression];
+
+		png_set_compression_level(writer->png_ptr, profile->level);
+		png_set_compression_strategy(writer->png_ptr, profile->strategy);
+		png_set_compression_mem_level(writer->png_ptr, profile->mem_level);
+		png_set_compression_window_bits(writer->png_ptr, profile->window_bits);
+		png_set_filter(writer->png_ptr, PNG_FILTER_TYPE_BASE, png_filters(profile->filters));
+	}
+
+	// write header
+	png_set_IHDR(writer->png_ptr, writer->info_ptr, image->width, image->height, image->bit_depth, image->color_type,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+
+	// write info to info_ptr
+	png_write_info(writer->png_ptr, writer->info_ptr);
+}
+
+// write the rows of the band as the next rows of the png
+static void write_png_band(csteg_ctx* ctx) {
+	png_writer* writer = &ctx->writer;
+
+	if (!writer->encoder) {
+		for (size_t i = 0; i < ctx->band_count; i++) {
+			png_write_row(writer->png_ptr, ctx->band_rows[i]);
+		}
+		return;
+	}
+
+	encoder_status status = encoder_write_band(writer->encoder, ctx->pool, ctx->band_rows, ctx->band_count);
+	if (status == ENCODER_ERR_NOMEM) {
+		fail(ctx, CSTEG_ERR_NOMEM, "write_png_band() : out of memory deflating rows");
+	} else if (status != ENCODER_OK) {
+		fail(ctx, CSTEG_ERR_PNG, "write_png_band() : zlib failed to deflate rows");
+	}
+}
+
+// finish writing a png opened with open_png_writer
+static void close_png_writer(csteg_ctx* ctx) {
+	png_writer* writer = &ctx->writer;
+
+	// end write
+	if (writer->encoder) {
+		encoder_finish(writer->encoder);
+		encoder_free(writer->encoder);
+		writer->encoder = NULL;
+	} else {
+		png_write_end(writer->png_ptr, NULL);
+		png_destroy_write_struct(&writer->png_ptr, &writer->info_ptr);
+	}
+
+	if (writer->file_ptr) {
+		close_output(ctx);
+	}
+
+	ctx->writer_open = 0;
+}
+
+// abandon a png opened with open_png_writer, removing the file created for it
+static void discard_png_writer(csteg_ctx* ctx) {
+	png_writer* writer = &ctx->writer;
+
+	if (!ctx->writer_open) {
+		return;
+	}
+	ctx->writer_open = 0;
+
+	if (writer->png_ptr) {
+		png_destroy_write_struct(&writer->png_ptr, &writer->info_ptr);
+	}
+	encoder_free(writer->encoder);
+	writer->encoder = NULL;
+
+	if (writer->file_ptr) {
+		fclose(writer->file_ptr);
+	}
+
+	// only the file created in place of the output is removed. the output
+	// itself is never removed, as it may have been there all along
+	if (writer->temp_filename) {
+		remove(writer->temp_filename);
+		free(writer->temp_filename);
+		writer->temp_filename = NULL;
+	}
+
+	free(writer->sink.data);
+}
+
+//===========================================================================//
+// signature and regions
+//===========================================================================//
+
+// store size bytes of value in network byte order
+static void store_be(uint8_t* bytes, uint64_t value, size_t size) {
+	for (size_t i = 0; i < size; i++) {
+		bytes[i] = (value >> ((size - 1 - i) * 8)) & 0xFF;
+	}
+}
+
+// load size bytes in network byte order
+static uint64_t load_be(const uint8_t* bytes, size_t size) {
+	uint64_t value = 0;
+	for (size_t i = 0; i < size; i++) {
+		value = (value << 8) | bytes[i];
+	}
+
+	return value;
+}
+
+// build the signature of a payload, or of a shard of it if shard isn't
+// NULL, in ctx->signature, returning its size
+static size_t generate_signature(csteg_ctx* ctx, const char* filename, uint64_t file_size, uint8_t flags, const csteg_shard* shard) {
+	// calculate size of signature in bytes
+	size_t filename_length = strlen(filename);
+	size_t header_size = SIG_HEADER_SIZE + (shard ? SIG_SHARD_SIZE : 0);
+	size_t sig_length = header_size + filename_length;
+
+	if (filename_length == 0 || filename_length > UINT32_MAX) {
+		fail(ctx, CSTEG_ERR_TOO_LARGE, "generate_signature() : filename %s is empty or too long", filename);
+	}
+
+	// allocate memory for signature
+	uint8_t* signature = (uint8_t*) alloc_or_fail(ctx, sig_length);
+	ctx->signature = signature;
+
+	// write header
+	memcpy(signature, SIG_MAGIC, SIG_MAGIC_SIZE);
+	signature[4] = SIG_VERSION;
+	signature[5] = flags;
+	store_be(&signature[6], filename_length, 4);
+	store_be(&signature[10], file_size, 8);
+
+	if (shard) {
+		signature[5] |= SIG_FLAG_SHARD;
+		store_be(&signature[18], shard->id, 8);
+		store_be(&signature[26], shard->index, 4);
+		store_be(&signature[30], shard->count, 4);
+		store_be(&signature[34], shard->offset, 8);
+		store_be(&signature[42], shard->total_size, 8);
+	}
+
+	// write file name
+	memcpy(&signature[header_size], filename, filename_length);
+
+	return sig_length;
+}
+
+// channels per pixel used by a region
+static size_t region_pixel_channels(const image_info* image, const payload_region* region) {
+	return region->all_channels ? image->pixel_channels : image->color_channels;
+}
+
+// first channel of a region that follows another, so that they don't share
+// any channel of the image
+static size_t region_following(const image_info* image, const payload_region* previous, int all_channels) {
+	size_t end = previous->first_channel + previous->channels;
+
+	if (previous->all_channels == all_channels) {
+		return end;
+	}
+
+	// round up to a whole pixel and number the channels as the next region does
+	size_t pixels = (end + region_pixel_channels(image, previous) - 1) / region_pixel_channels(image, previous);
+	return pixels * (all_channels ? image->pixel_channels : image->color_channels);
+}
+
+// number of channels needed to store size bytes at depth bits per channel
+static size_t channels_needed(size_t size, int depth) {
+	return (size * 8 + depth - 1) / depth;
+}
+
+// bytes of data that fit in an image after a signature of sig_size bytes,
+// at depth bits per channel, 0 if not even the signature fits
+static size_t data_capacity(const image_info* image, size_t sig_size, int depth, int all_channels) {
+	payload_region sig_region = {
+		.first_channel = 0,
+		.channels = channels_needed(sig_size, 2),
+		.depth = 2,
+		.all_channels = 0,
+	};
+
+	if (sig_region.channels > image->width * image->height * image->color_channels) {
+		return 0;
+	}
+
+	size_t first_channel = region_following(image, &sig_region, all_channels);
+	size_t max_channels = image->width * image->height * (all_channels ? image->pixel_channels : image->color_channels);
+
+	return first_channel < max_channels ? (max_channels - first_channel) * depth / 8 : 0;
+}
+
+// number of rows up to and including the last row a region touches, 0 if
+// it is empty
+static size_t region_end_row(const image_info* image, const payload_region* region) {
+	if (region->channels == 0) {
+		return 0;
+	}
+
+	size_t row_channels = image->width * region_pixel_channels(image, region);
+	return (region->first_channel + region->channels - 1) / row_channels + 1;
+}
+
+// range of the channels of a region that lie in row y, counted from the
+// start of the region. returns 0 if the region doesn't touch the row
+static int region_row_span(const image_info* image, const payload_region* region, size_t y, size_t* first, size_t* last) {
+	size_t row_channels = image->width * region_pixel_channels(image, region);
+	size_t row_start = y * row_channels;
+	size_t row_end = row_start + row_channels;
+	size_t region_end = region->first_channel + region->channels;
+
+	size_t start = region->first_channel > row_start ? region->first_channel : row_start;
+	size_t end = region_end < row_end ? region_end : row_end;
+
+	if (start >= end) {
+		return 0;
+	}
+
+	*first = start - region->first_channel;
+	*last = end - region->first_channel;
+	return 1;
+}
+
+// copy the color channels of a row with alpha into a contiguous buffer
+static void gather_color_channels(const image_info* image, uint8_t* channels, const uint8_t* row) {
+	size_t color_bytes = image->color_channels * image->sample_bytes;
+	size_t pixel_bytes = image->pixel_channels * image->sample_bytes;
+
+	if (image->color_type == PNG_COLOR_TYPE_RGBA && image->sample_bytes == 1) {
+		for (size_t x = 0; x < image->width; x++) {
+			channels[x * 3] = row[x * 4];
+			channels[x * 3 + 1] = row[x * 4 + 1];
+			channels[x * 3 + 2] = row[x * 4 + 2];
+		}
+	} else {
+		for (size_t x = 0; x < image->width; x++) {
+			memcpy(&channels[x * color_bytes], &row[x * pixel_bytes], color_bytes);
+		}
+	}
+}
+
+// copy contiguous color channels back into the color channels of a row with alpha
+static void scatter_color_channels(const image_info* image, png_bytep row, const uint8_t* channels) {
+	size_t color_bytes = image->color_channels * image->sample_bytes;
+	size_t pixel_bytes = image->pixel_channels * image->sample_bytes;
+
+	if (image->color_type == PNG_COLOR_TYPE_RGBA && image->sample_bytes == 1) {
+		for (size_t x = 0; x < image->width; x++) {
+			row[x * 4] = channels[x * 3];
+			row[x * 4 + 1] = channels[x * 3 + 1];
+			row[x * 4 + 2] = channels[x * 3 + 2];
+		}
+	} else {
+		for (size_t x = 0; x < image->width; x++) {
+			memcpy(&row[x * pixel_bytes], &channels[x * color_bytes], color_bytes);
+		}
+	}
+}
+
+//===========================================================================//
+// precooked carriers
+//===========================================================================//
+
+// color type of an image with 1 to 4 channels per pixel, as in a png
+static png_byte channels_color_type(size_t channels) {
+	static const png_byte color_types[] = { 0, PNG_COLOR_TYPE_GRAY, PNG_COLOR_TYPE_GRAY_ALPHA, PNG_COLOR_TYPE_RGB, PNG_COLOR_TYPE_RGBA };
+	return color_types[channels];
+}
+
+// write the rows of carrier to the file filename, after a header
+static void save_carrier(csteg_ctx* ctx, const csteg_carrier* carrier, const char* filename) {
+	const image_info* image = &carrier->image;
+
+	uint8_t header[RAW_DATA_OFFSET] = { 0 };
+	memcpy(header, RAW_MAGIC, RAW_MAGIC_SIZE);
+	store_be(&header[8], RAW_VERSION, 4);
+	store_be(&header[12], image->width, 4);
+	store_be(&header[16], image->height, 4);
+	header[20] = image->pixel_channels;
+	header[21] = image->bit_depth;
+	store_be(&header[22], carrier->stride, 4);
+
+	// written the same way as output pngs
+	memset(&ctx->writer, 0, sizeof(ctx->writer));
+	ctx->writer_open = 1;
+	open_output(ctx, filename, "wb");
+
+	// the rows are contiguous, stride apart
+	size_t size = carrier->stride * image->height;
+	const uint8_t* rows = carrier->arena.base;
+
+	if (fwrite(header, 1, RAW_DATA_OFFSET, ctx->writer.file_ptr) != RAW_DATA_OFFSET ||
+	    fwrite(rows, 1, size, ctx->writer.file_ptr) != size) {
+		fail(ctx, CSTEG_ERR_IO, "save_carrier() : error writing %s", filename);
+	}
+
+	close_output(ctx);
+	ctx->writer_open = 0;
+}
+
+// fill in the image, row size and stride of carrier from the header of a
+// precooked carrier file
+static void parse_raw_header(csteg_ctx* ctx, const uint8_t* header, const char* filename, csteg_carrier* carrier) {
+	image_info* image = &carrier->image;
+	image->width = load_be(&header[12], 4);
+	image->height = load_be(&header[16], 4);
+	image->bit_depth = header[21];
+	image->number_of_passes = 1;
+	carrier->stride = load_be(&header[22], 4);
+
+	size_t channels = header[20];
+
+	if (load_be(&header[8], 4) != RAW_VERSION || channels < 1 || channels > 4 || (image->bit_depth != 8 && image->bit_depth != 16) ||
+	    image->width == 0 || image->width > PNG_USER_WIDTH_MAX || image->height == 0 || image->height > PNG_USER_HEIGHT_MAX) {
+		fail(ctx, CSTEG_ERR_FORMAT, "parse_raw_header() : File %s is not a supported precooked carrier", filename);
+	}
+
+	image->color_type = channels_color_type(channels);
+	set_image_format(ctx, image, filename);
+	carrier->rowbytes = image->width * image->pixel_channels * image->sample_bytes;
+
+	if (carrier->stride < carrier->rowbytes) {
+		fail(ctx, CSTEG_ERR_FORMAT, "parse_raw_header() : File %s has rows overlapping each other", filename);
+	}
+}
+
+// fail unless every row of carrier lies within the size bytes of the
+// precooked carrier file filename
+static void check_raw_size(csteg_ctx* ctx, const csteg_carrier* carrier, uint64_t size, const char* filename) {
+	if (size < RAW_DATA_OFFSET || (size - RAW_DATA_OFFSET) / carrier->stride < carrier->image.height) {
+		fail(ctx, CSTEG_ERR_FORMAT, "check_raw_size() : File %s is truncated", filename);
+	}
+}
+
+// whether size bytes at header start a precooked carrier file
+static int is_raw_header(const uint8_t* header, size_t size) {
+	return size >= RAW_HEADER_SIZE && memcmp(header, RAW_MAGIC, RAW_MAGIC_SIZE) == 0;
+}
+
+// map the precooked carrier file filename into ctx->owned_carrier. returns
+// 0 without failing if the file isn't one, so it can be read as a png
+static int load_carrier(csteg_ctx* ctx, const char* filename) {
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return 0;
+	}
+
+	uint8_t header[RAW_HEADER_SIZE];
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || pread(fd, header, RAW_HEADER_SIZE, 0) != RAW_HEADER_SIZE ||
+	    !is_raw_header(header, RAW_HEADER_SIZE)) {
+		close(fd);
+		return 0;
+	}
+
+	csteg_carrier* carrier = (csteg_carrier*) calloc(1, sizeof(csteg_carrier));
+	void* mapping = carrier ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+
+	if (!carrier) {
+		fail(ctx, CSTEG_ERR_NOMEM, "load_carrier() : could not allocate carrier");
+	}
+	ctx->owned_carrier = carrier;
+
+	if (mapping == MAP_FAILED) {
+		fail(ctx, CSTEG_ERR_IO, "load_carrier() : File %s could not be mapped", filename);
+	}
+	carrier->mapping = (uint8_t*) mapping;
+	carrier->mapping_size = st.st_size;
+
+	parse_raw_header(ctx, carrier->mapping, filename, carrier);
+	check_raw_size(ctx, carrier, st.st_size, filename);
+
+	// rows are read once, front to back
+	madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+	carrier->arena.base = carrier->mapping + RAW_DATA_OFFSET;
+
+	return 1;
+}
+
+// point carrier at the rows of a precooked carrier file held in size bytes
+// of memory, which stay owned by the caller. returns 0 without failing if
+// they aren't one, so they can be read as a png
+static int view_carrier(csteg_ctx* ctx, const uint8_t* data, size_t size, csteg_carrier* carrier) {
+	if (!is_raw_header(data, size)) {
+		return 0;
+	}
+
+	memset(carrier, 0, sizeof(*carrier));
+	parse_raw_header(ctx, data, "(memory)", carrier);
+	check_raw_size(ctx, carrier, size, "(memory)");
+	carrier->arena.base = (uint8_t*) data + RAW_DATA_OFFSET;
+
+	return 1;
+}
+
+// copy the rows of a carrier held by the caller into a new carrier
+static csteg_carrier* copy_carrier(csteg_ctx* ctx, const csteg_carrier* source) {
+	size_t height = source->image.height;
+
+	csteg_carrier* carrier = (csteg_carrier*) alloc_or_fail(ctx, sizeof(csteg_carrier));
+	memset(carrier, 0, sizeof(*carrier));
+	ctx->owned_carrier = carrier;
+
+	carrier->image = source->image;
+	carrier->rowbytes = source->rowbytes;
+	carrier->stride = arena_row_stride(source->rowbytes);
+	alloc_pixel_arena(ctx, &carrier->arena, carrier->stride * height);
+
+	for (size_t y = 0; y < height; y++) {
+		memcpy(carrier->arena.base + y * carrier->stride, source->arena.base + y * source->stride, source->rowbytes);
+	}
+
+	ctx->owned_carrier = NULL;
+	return carrier;
+}
+
+// describe the precooked carrier whose header is at header into image
+static void probe_raw_header(csteg_ctx* ctx, const uint8_t* header, const char* filename, csteg_image* image) {
+	csteg_carrier carrier = { 0 };
+	parse_raw_header(ctx, header, filename, &carrier);
+
+	*image = (csteg_image) {
+		.width = carrier.image.width,
+		.height = carrier.image.height,
+		.color_type = carrier.image.color_type,
+		.bit_depth = carrier.image.bit_depth,
+		.interlaced = 0,
+	};
+}
+
+//===========================================================================//
+// uncompressed images
+//
+// binary PGM, PPM and PAM files, and 24 or 32-bit BMP files, hold their
+// pixels as they are, so only the rows holding the payload are ever read or
+// written. BMP pixels are stored BGR or BGRA, and their channels are taken in
+// that order, so data embedded into a BMP is only read back from a BMP
+//===========================================================================//
+
+// load size bytes in little endian byte order, as BMP headers are stored
+static uint64_t load_le(const uint8_t* bytes, size_t size) {
+	uint64_t value = 0;
+	for (size_t i = 0; i < size; i++) {
+		value |= (uint64_t) bytes[i] << (i * 8);
+	}
+
+	return value;
+}
+
+// read the decimal number at *pos of a PNM header, skipping whitespace and
+// comments before it. returns -1 if there is none, or it is too large
+static long pnm_number(const uint8_t* header, size_t size, size_t* pos) {
+	while (*pos < size && (isspace(header[*pos]) || header[*pos] == '#')) {
+		// comments run to the end of the line
+		if (header[*pos] == '#') {
+			while (*pos < size && header[*pos] != '\n') {
+				(*pos)++;
+			}
+		} else {
+			(*pos)++;
+		}
+	}
+
+	long value = -1;
+	while (*pos < size && isdigit(header[*pos])) {
+		value = (value < 0 ? 0 : value * 10) + (header[*pos] - '0');
+		if (value > PNG_USER_WIDTH_MAX) {
+			return -1;
+		}
+		(*pos)++;
+	}
+
+	return value;
+}
+
+// offset in the file of row y of the open uncompressed image
+static uint64_t raw_row_offset(const csteg_ctx* ctx, size_t y) {
+	size_t row = ctx->reader.raw_bottom_up ? ctx->image.height - 1 - y : y;
+	return ctx->reader.raw_offset + (uint64_t) row * ctx->reader.raw_stride;
+}
+
+// fill in ctx->image and the layout of the rows of the open uncompressed
+// image, failing if they don't all lie in the file
+static void set_raw_image(csteg_ctx* ctx, const char* filename, size_t width, size_t height, size_t channels,
+                          int bit_depth, uint64_t offset, size_t stride) {
+	png_reader* reader = &ctx->reader;
+	image_info* image = &ctx->image;
+
+	if (width > PNG_USER_WIDTH_MAX || height > PNG_USER_HEIGHT_MAX) {
+		fail(ctx, CSTEG_ERR_FORMAT, "set_raw_image() : File %s is too large", filename);
+	}
+
+	*image = (image_info) {
+		.width = width,
+		.height = height,
+		.color_type = channels_color_type(channels),
+		.bit_depth = bit_depth,
+		.number_of_passes = 1,
+	};
+	set_image_format(ctx, image, filename);
+
+	reader->rowbytes = width * image->pixel_channels * image->sample_bytes;
+	reader->raw_offset = offset;
+	reader->raw_stride = stride;
+
+	// every row has to be in the file
+	if (offset > reader->raw_size || reader->raw_size - offset < (uint64_t) stride * (height - 1) + reader->rowbytes) {
+		fail(ctx, CSTEG_ERR_FORMAT, "set_raw_image() : File %s is truncated", filename);
+	}
+}
+
+// bit depth of the samples of a PNM image, failing unless data can be
+// stored in their low bits without going past maxval
+static int pnm_bit_depth(csteg_ctx* ctx, long maxval, const char* filename) {
+	if (maxval != 255 && maxval != 65535) {
+		fail(ctx, CSTEG_ERR_FORMAT, "pnm_bit_depth() : File %s has a maximum value of %ld, only 255 and 65535 are supported", filename, maxval);
+	}
+
+	// 16-bit samples are big-endian, as in a png
+	return maxval == 255 ? 8 : 16;
+}
+
+// parse the header of a binary PGM (P5) or PPM (P6) image
+static void parse_pnm_header(csteg_ctx* ctx, const uint8_t* header, size_t size, const char* filename) {
+	size_t pos = 2;
+	long width = pnm_number(header, size, &pos);
+	long height = pnm_number(header, size, &pos);
+	long maxval = pnm_number(header, size, &pos);
+
+	// a single whitespace character ends the header
+	if (width <= 0 || height <= 0 || maxval <= 0 || pos >= size || !isspace(header[pos])) {
+		fail(ctx, CSTEG_ERR_FORMAT, "parse_pnm_header() : File %s has an invalid header", filename);
+	}
+
+	size_t channels = header[1] == '5' ? 1 : 3;
+	int bit_depth = pnm_bit_depth(ctx, maxval, filename);
+	set_raw_image(ctx, filename, width, height, channels, bit_depth, pos + 1, width * channels * (bit_depth / 8));
+}
+
+// parse the header of a PAM (P7) image. its tuple type is ignored, the
+// depth alone tells whether it is gray or RGB, and has alpha
+static void parse_pam_header(csteg_ctx* ctx, const uint8_t* header, size_t size, const char* filename) {
+	long width = -1, height = -1, depth = -1, maxval = -1;
+	size_t pos = 2;
+
+	for (;;) {
+		while (pos < size && isspace(header[pos])) {
+			pos++;
+		}
+
+		size_t length = 0;
+		while (pos + length < size && !isspace(header[pos + length])) {
+			length++;
+		}
+
+		if (length == 0) {
+			fail(ctx, CSTEG_ERR_FORMAT, "parse_pam_header() : File %s has no ENDHDR line", filename);
+		}
+
+		const char* keyword = (const char*) &header[pos];
+		pos += length;
+
+		// the pixels start on the line after ENDHDR
+		if (length == 6 && memcmp(keyword, "ENDHDR", 6) == 0) {
+			if (pos >= size || header[pos] != '\n') {
+				fail(ctx, CSTEG_ERR_FORMAT, "parse_pam_header() : File %s has an invalid header", filename);
+			}
+			pos++;
+			break;
+		}
+
+		long* field = NULL;
+		if (length == 5 && memcmp(keyword, "WIDTH", 5) == 0) {
+			field = &width;
+		} else if (length == 6 && memcmp(keyword, "HEIGHT", 6) == 0) {
+			field = &height;
+		} else if (length == 5 && memcmp(keyword, "DEPTH", 5) == 0) {
+			field = &depth;
+		} else if (length == 6 && memcmp(keyword, "MAXVAL", 6) == 0) {
+			field = &maxval;
+		}
+
+		if (field) {
+			*field = pnm_number(header, size, &pos);
+		} else {
+			// comments and tuple types run to the end of the line
+			while (pos < size && header[pos] != '\n') {
+				pos++;
+			}
+		}
+	}
+
+	if (width <= 0 || height <= 0 || depth < 1 || depth > 4 || maxval <= 0) {
+		fail(ctx, CSTEG_ERR_FORMAT, "parse_pam_header() : File %s has an invalid header", filename);
+	}
+
+	int bit_depth = pnm_bit_depth(ctx, maxval, filename);
+	set_raw_image(ctx, filename, width, height, depth, bit_depth, pos, width * depth * (bit_depth / 8));
+}
+
+// parse the header of a 24 or 32-bit BMP image, stored without compression.
+// rows are padded to a multiple of 4 bytes, and stored from the bottom up
+// unless the height is negative
+static void parse_bmp_header(csteg_ctx* ctx, const uint8_t* header, size_t size, const char* filename) {
+	if (size < BMP_HEADER_SIZE) {
+		fail(ctx, CSTEG_ERR_FORMAT, "parse_bmp_header() : File %s is truncated", filename);
+	}
+
+	uint64_t offset = load_le(&header[10], 4);
+	uint64_t info_size = load_le(&header[14], 4);
+	int32_t width = (int32_t) load_le(&header[18], 4);
+	int32_t height = (int32_t) load_le(&header[22], 4);
+	uint64_t planes = load_le(&header[26], 2);
+	uint64_t bits = load_le(&header[28], 2);
+	uint64_t compression = load_le(&header[30], 4);
+
+	int uncompressed = compression == BMP_RGB || (compression == BMP_BITFIELDS && bits == 32);
+	if (info_size < BMP_INFO_HEADER_SIZE || width <= 0 || height == 0 || height == INT32_MIN || planes != 1 ||
+	    (bits != 24 && bits != 32) || !uncompressed) {
+		fail(ctx, CSTEG_ERR_FORMAT, "parse_bmp_header() : File %s is not a 24 or 32-bit uncompressed BMP", filename);
+	}
+
+	// the masks follow a BITMAPINFOHEADER, and are part of the larger ones
+	uint64_t headers_size = BMP_FILE_HEADER_SIZE + info_size;
+	if (compression == BMP_BITFIELDS) {
+		if (info_size == BMP_INFO_HEADER_SIZE) {
+			headers_size += BMP_MASKS_SIZE;
+		}
+		if (size < BMP_HEADER_SIZE + BMP_MASKS_SIZE + (info_size >= BMP_V4_HEADER_SIZE ? 4 : 0)) {
+			fail(ctx, CSTEG_ERR_FORMAT, "parse_bmp_header() : File %s is truncated", filename);
+		}
+
+		// pixels are read blue, green, red and then alpha, or unused, bytes
+		uint64_t alpha = info_size >= BMP_V4_HEADER_SIZE ? load_le(&header[66], 4) : 0;
+		if (load_le(&header[54], 4) != 0x00FF0000 || load_le(&header[58], 4) != 0x0000FF00 ||
+		    load_le(&header[62], 4) != 0x000000FF || (alpha != 0 && alpha != 0xFF000000)) {
+			fail(ctx, CSTEG_ERR_FORMAT, "parse_bmp_header() : File %s has channel masks other than BGRA", filename);
+		}
+	}
+
+	// embedding would otherwise write over the headers
+	if (offset < headers_size) {
+		fail(ctx, CSTEG_ERR_FORMAT, "parse_bmp_header() : File %s has pixels overlapping its headers", filename);
+	}
+
+	size_t channels = bits / 8;
+	ctx->reader.raw_bottom_up = height > 0;
+	set_raw_image(ctx, filename, width, height > 0 ? height : -height, channels, 8, offset, (width * channels + 3) & ~(size_t) 3);
+}
+
+// open the uncompressed image filename, reading its header into ctx->image.
+// its rows are then returned by raw_row. returns 0 without failing if the
+// file isn't one, so it can be read as a png
+static int open_raw_image(csteg_ctx* ctx, const char* filename) {
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return 0;
+	}
+
+	uint8_t header[RAW_IMAGE_HEADER_MAX];
+	struct stat st;
+	ssize_t size = 0;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || (size = pread(fd, header, sizeof(header), 0)) < 0 ||
+	    !is_raw_image_header(header, size)) {
+		close(fd);
+		return 0;
+	}
+
+	png_reader* reader = &ctx->reader;
+	memset(reader, 0, sizeof(*reader));
+	ctx->reader_open = 1;
+	reader->raw = 1;
+	reader->raw_fd = fd;
+	reader->raw_size = st.st_size;
+
+	if (header[0] == 'B') {
+		parse_bmp_header(ctx, header, size, filename);
+	} else if (header[1] == '7') {
+		parse_pam_header(ctx, header, size, filename);
+	} else {
+		parse_pnm_header(ctx, header, size, filename);
+	}
+
+	return 1;
+}
+
+// returns the next row of the open uncompressed image, read into slot of the
+// band. only rows asked for are read
+static png_bytep raw_row(csteg_ctx* ctx, size_t slot) {
+	png_reader* reader = &ctx->reader;
+
+	// allocate band on first use
+	size_t stride = arena_row_stride(reader->rowbytes);
+	if (!reader->arena.base) {
+		alloc_pixel_arena(ctx, &reader->arena, stride * ctx->band_capacity);
+	}
+
+	png_bytep row = reader->arena.base + slot * stride;
+	size_t y = reader->next_row++;
+	uint64_t offset = raw_row_offset(ctx, y);
+
+	size_t done = 0;
+	while (done < reader->rowbytes) {
+		ssize_t count = pread(reader->raw_fd, row + done, reader->rowbytes - done, offset + done);
+		if (count <= 0) {
+			fail(ctx, CSTEG_ERR_IO, "raw_row() : error reading row %zu", y);
+		}
+
+		done += count;
+	}
+
+	return row;
+}
+
+// open the carrier of an embedding, a png, a precooked carrier file or an
+// uncompressed image
+static void open_input(csteg_ctx* ctx, const char* filename) {
+	if (load_carrier(ctx, filename)) {
+		open_carrier(ctx, ctx->owned_carrier);
+	} else if (!open_raw_image(ctx, filename)) {
+		open_png_reader(ctx, filename, NULL, 0);
+	}
+}
+
+//===========================================================================//
+// bands
+//===========================================================================//
+
+// allocate the band and the scratch rows of every thread for the open
+// image, starting the thread pool if more than one thread is used
+static void open_bands(csteg_ctx* ctx) {
+	image_info* image = &ctx->image;
+	size_t threads = ctx->threads;
+
+	// a single thread handles each row as soon as it is decoded
+	size_t rows = 1;
+	if (threads > 1) {
+		rows = BAND_BYTES / arena_row_stride(ctx->reader.rowbytes);
+		if (rows < threads) {
+			rows = threads;
+		}
+	}
+	if (rows > image->height) {
+		rows = image->height;
+	}
+
+	ctx->band_capacity = rows;
+	ctx->band_rows = (png_bytep*) alloc_or_fail(ctx, sizeof(png_bytep) * rows);
+	ctx->band_first = 0;
+	ctx->band_count = 0;
+
+	// each thread gathers color channels into its own scratch row
+	ctx->scratch_stride = arena_row_stride(image->width * image->color_channels * image->sample_bytes);
+	alloc_pixel_arena(ctx, &ctx->scratch, ctx->scratch_stride * threads);
+
+	// the pool is kept across operations, until the number of threads changes
+	if (threads > 1 && (!ctx->pool || pool_threads(ctx->pool) != threads)) {
+		pool_destroy(ctx->pool);
+		ctx->pool = pool_create(threads);
+
+		if (!ctx->pool) {
+			fail(ctx, CSTEG_ERR_NOMEM, "open_bands() : could not start %zu threads", threads);
+		}
+	}
+}
+
+// returns the next row of ctx->carrier. rows holding part of the signature
+// or data are copied into slot of the band, so the carrier is never written
+// to, the rest are encoded straight from the carrier
+static png_bytep carrier_row(csteg_ctx* ctx, size_t slot) {
+	png_reader* reader = &ctx->reader;
+	size_t y = reader->next_row++;
+	png_bytep pristine = ctx->carrier->arena.base + y * ctx->carrier->stride;
+
+	size_t first, last;
+	if (!region_row_span(&ctx->image, &ctx->sig_region, y, &first, &last) &&
+	    !region_row_span(&ctx->image, &ctx->data_region, y, &first, &last)) {
+		return pristine;
+	}
+
+	// allocate band on first use
+	size_t stride = arena_row_stride(reader->rowbytes);
+	if (!reader->arena.base) {
+		alloc_pixel_arena(ctx, &reader->arena, stride * ctx->band_capacity);
+	}
+
+	png_bytep row = reader->arena.base + slot * stride;
+	memcpy(row, pristine, reader->rowbytes);
+
+	return row;
+}
+
+// decode the next count rows into the band, read them from an uncompressed
+// image, or take them from the carrier
+static void read_band(csteg_ctx* ctx, size_t count) {
+	ctx->band_first = ctx->reader.next_row;
+	ctx->band_count = count;
+
+	for (size_t i = 0; i < count; i++) {
+		if (ctx->carrier) {
+			ctx->band_rows[i] = carrier_row(ctx, i);
+		} else {
+			ctx->band_rows[i] = ctx->reader.raw ? raw_row(ctx, i) : read_png_row(ctx, i);
+		}
+	}
+}
+
+// run task on every thread, each handling its share of the band. tasks run
+// outside of the jump buffer, so they must not fail
+static void run_band(csteg_ctx* ctx, pool_task task) {
+	if (ctx->threads > 1) {
+		pool_run(ctx->pool, task, ctx);
+	} else {
+		task(ctx, 0, 1);
+	}
+}
+
+//===========================================================================//
+// embedding
+//===========================================================================//
+
+// map a data file, returns 0 if it can't be mapped
+static int map_payload(payload_buffer* payload, int fd, size_t size) {
+	void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		return 0;
+	}
+
+	// the payload is consumed front to back exactly once
+	madvise(data, size, MADV_SEQUENTIAL);
+
+	payload->data = (const uint8_t*) data;
+	payload->mapped_size = size;
+	return 1;
+}
+
+// read a data file whole, in blocks
+static void read_payload(csteg_ctx* ctx, payload_buffer* payload, int fd, const char* filename) {
+	size_t capacity = PAYLOAD_BLOCK_SIZE;
+	uint8_t* data = (uint8_t*) alloc_or_fail(ctx, capacity);
+
+	payload->data = data;
+	payload->size = 0;
+	payload->owned = 1;
+
+	for (;;) {
+		// grow buffer so a whole block always fits
+		if (capacity - payload->size < PAYLOAD_BLOCK_SIZE) {
+			capacity *= 2;
+			data = (uint8_t*) realloc(data, capacity);
+
+			if (!data) {
+				fail(ctx, CSTEG_ERR_NOMEM, "read_payload() : File %s does not fit in memory", filename);
+			}
+			payload->data = data;
+		}
+
+		ssize_t count = read(fd, data + payload->size, PAYLOAD_BLOCK_SIZE);
+		if (count < 0) {
+			fail(ctx, CSTEG_ERR_IO, "read_payload() : error reading %s", filename);
+		}
+		if (count == 0) {
+			break;
+		}
+
+		payload->size += count;
+	}
+}
+
+// load a data file into ctx->payload
+static void open_payload(csteg_ctx* ctx, const char* filename) {
+	payload_buffer* payload = &ctx->payload;
+
+	memset(payload, 0, sizeof(*payload));
+	ctx->payload_open = 1;
+
+	payload->fd = open(filename, O_RDONLY);
+
+	// check that file exists
+	if (payload->fd < 0) {
+		fail(ctx, CSTEG_ERR_IO, "open_payload() : File %s could not be opened for reading", filename);
+	}
+
+	struct stat st;
+	if (fstat(payload->fd, &st) != 0) {
+		fail(ctx, CSTEG_ERR_IO, "open_payload() : could not stat %s", filename);
+	}
+
+	// empty files can't be mapped, and are read like pipes
+	payload->size = st.st_size;
+	if (!S_ISREG(st.st_mode) || st.st_size == 0 || !map_payload(payload, payload->fd, payload->size)) {
+		read_payload(ctx, payload, payload->fd, filename);
+	}
+
+	// the mapping stays valid without the file
+	close(payload->fd);
+	payload->fd = -1;
+}
+
+// release the payload loaded with open_payload, if any
+static void close_payload(csteg_ctx* ctx) {
+	payload_buffer* payload = &ctx->payload;
+
+	if (!ctx->payload_open) {
+		return;
+	}
+	ctx->payload_open = 0;
+
+	if (payload->fd >= 0) {
+		close(payload->fd);
+	}
+
+	if (payload->mapped_size) {
+		munmap((void*) (payload->data - payload->offset), payload->mapped_size);
+	} else if (payload->owned) {
+		free((void*) (payload->data - payload->offset));
+	}
+}
+
+// embed the depth bits of payload starting at bit into a channel byte.
+// bits past the end of the size byte payload are 0
+static void embed_chunk(uint8_t* channel, int depth, const uint8_t* payload, size_t size, size_t bit) {
+	// the bits may straddle two bytes
+	unsigned int window = payload[bit / 8] << 8;
+	if (bit / 8 + 1 < size) {
+		window |= payload[bit / 8 + 1];
+	}
+	uint8_t mask = (1 << depth) - 1;
+
+	// clear and set least significant bits of color channel
+	*channel = (*channel & ~mask) | ((window >> (16 - depth - bit % 8)) & mask);
+}
+
+// embed channels first to first + count of a region, counted from the start
+// of the region, into consecutive channels of sample_bytes bytes. payload
+// holds the size bytes of the region
+//
+// whole groups of 8 channels are handed to embed_kernel, only the channels
+// of groups split across rows are embedded one at a time
+static void embed_span(const image_info* image, uint8_t* channels, size_t first, size_t count, int depth,
+                       const uint8_t* payload, size_t size) {
+	size_t sample_bytes = image->sample_bytes;
+	size_t i = 0;
+
+	// the low byte of a sample is its last
+	uint8_t* low_bytes = channels + sample_bytes - 1;
+
+	// channels before the first group boundary
+	for (; i < count && (first + i) % 8 != 0; i++) {
+		embed_chunk(&low_bytes[i * sample_bytes], depth, payload, size, (first + i) * depth);
+	}
+
+	// whole groups
+	size_t groups = (count - i) / 8;
+	embed_kernel(depth, sample_bytes, &channels[i * sample_bytes], &payload[(first + i) * depth / 8], groups);
+	i += groups * 8;
+
+	// channels after the last group boundary
+	for (; i < count; i++) {
+		embed_chunk(&low_bytes[i * sample_bytes], depth, payload, size, (first + i) * depth);
+	}
+}
+
+// embed channels first to last of a region, which lie in row y. scratch
+// holds a row of color channels
+static void embed_region_span(csteg_ctx* ctx, png_bytep row, size_t y, uint8_t* scratch, const payload_region* region,
+                              size_t first, size_t last, const uint8_t* payload, size_t size) {
+	const image_info* image = &ctx->image;
+	size_t row_channels = image->width * region_pixel_channels(image, region);
+
+	// channels are contiguous if every one of them is used, otherwise the
+	// color channels are gathered into scratch and scattered back afterwards
+	int gathered = region_pixel_channels(image, region) != image->pixel_channels;
+	uint8_t* channels = row;
+
+	if (gathered) {
+		gather_color_channels(image, scratch, row);
+		channels = scratch;
+	}
+
+	uint8_t* span = &channels[(region->first_channel + first - y * row_channels) * image->sample_bytes];
+	embed_span(image, span, first, last - first, region->depth, payload, size);
+
+	if (gathered) {
+		scatter_color_channels(image, row, scratch);
+	}
+}
+
+// embed the signature and the part of the data that falls in row y
+static void embed_row(csteg_ctx* ctx, png_bytep row, size_t y, uint8_t* scratch) {
+	size_t first, last;
+
+	if (region_row_span(&ctx->image, &ctx->sig_region, y, &first, &last)) {
+		embed_region_span(ctx, row, y, scratch, &ctx->sig_region, first, last, ctx->signature, ctx->signature_size);
+	}
+
+	if (region_row_span(&ctx->image, &ctx->data_region, y, &first, &last)) {
+		embed_region_span(ctx, row, y, scratch, &ctx->data_region, first, last, ctx->payload.data, ctx->payload.size);
+	}
+}
+
+// embed a share of the rows of the band. rows are never split between
+// threads, so each thread writes to its own rows only
+static void embed_band_task(void* arg, size_t index, size_t count) {
+	csteg_ctx* ctx = (csteg_ctx*) arg;
+	uint8_t* scratch = ctx->scratch.base + index * ctx->scratch_stride;
+
+	size_t first = ctx->band_count * index / count;
+	size_t last = ctx->band_count * (index + 1) / count;
+
+	for (size_t i = first; i < last; i++) {
+		embed_row(ctx, ctx->band_rows[i], ctx->band_first + i, scratch);
+	}
+}
+
+// lay out the signature and data of ctx->payload, stored under name, in the
+// open image, failing if they don't fit
+static void prepare_embed(csteg_ctx* ctx, const char* name) {
+	image_info* image = &ctx->image;
+	int depth = ctx->depth;
+
+	size_t size = ctx->payload.size;
+
+	// alpha channels can only be used if the image has them
+	int all_channels = ctx->alpha && image->pixel_channels != image->color_channels;
+
+	uint8_t flags = (depth - 1) | (all_channels ? SIG_FLAG_ALPHA : 0);
+
+	// generate signature
+	ctx->signature_size = generate_signature(ctx, name, size, flags, ctx->embed_shard);
+
+	ctx->sig_region = (payload_region) {
+		.first_channel = 0,
+		.channels = channels_needed(ctx->signature_size, 2),
+		.depth = 2,
+		.all_channels = 0,
+	};
+
+	ctx->data_region = (payload_region) {
+		.first_channel = region_following(image, &ctx->sig_region, all_channels),
+		.channels = channels_needed(size, depth),
+		.depth = depth,
+		.all_channels = all_channels,
+	};
+
+	// check that data can fit in file
+	size_t max_channels = image->width * image->height * region_pixel_channels(image, &ctx->data_region);
+	size_t required_channels = ctx->data_region.first_channel + ctx->data_region.channels;
+
+	// if there is too much information
+	if (ctx->sig_region.channels > image->width * image->height * image->color_channels || required_channels > max_channels) {
+		size_t free_bytes = data_capacity(image, ctx->signature_size, depth, all_channels);
+		fail(ctx, CSTEG_ERR_TOO_SMALL, "prepare_embed() : PNG is too small to fit %s (%zu bytes required / %zu bytes free at %d bits per channel)",
+		     name, size, free_bytes, depth);
+	}
+}
+
+// decode, embed and encode a band at a time so only a single band is held
+// in memory, regardless of image size. decoding stays on the calling thread,
+// the rows of each band are embedded and encoded by every thread
+static void embed_rows(csteg_ctx* ctx) {
+	image_info* image = &ctx->image;
+
+	for (size_t y = 0; y < image->height; y += ctx->band_count) {
+		size_t count = image->height - y < ctx->band_capacity ? image->height - y : ctx->band_capacity;
+		read_band(ctx, count);
+
+		run_band(ctx, embed_band_task);
+
+		write_png_band(ctx);
+	}
+
+	close_png_writer(ctx);
+}
+
+// copy the size bytes of the file in_fd to the empty file out_fd. on
+// filesystems sharing extents between files the copy shares those of in_fd,
+// and only the pages embedded into are ever written. elsewhere it is copied
+// within the kernel
+static void copy_image(csteg_ctx* ctx, int in_fd, int out_fd, uint64_t size, const char* filename) {
+#ifdef FICLONE
+	if (ioctl(out_fd, FICLONE, in_fd) == 0) {
+		return;
+	}
+#endif
+
+	// copy_file_range also shares extents where it can, but isn't supported
+	// across every pair of filesystems
+	loff_t in_offset = 0, out_offset = 0;
+	while ((uint64_t) in_offset < size) {
+		ssize_t count = copy_file_range(in_fd, &in_offset, out_fd, &out_offset, size - in_offset, 0);
+		if (count <= 0) {
+			if (count < 0 && in_offset == 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+				break;
+			}
+			fail(ctx, CSTEG_ERR_IO, "copy_image() : error writing %s", filename);
+		}
+	}
+
+	off_t offset = in_offset;
+	while ((uint64_t) offset < size) {
+		if (sendfile(out_fd, in_fd, &offset, size - offset) <= 0) {
+			fail(ctx, CSTEG_ERR_IO, "copy_image() : error writing %s", filename);
+		}
+	}
+}
+
+// copy the open uncompressed image to filename and embed into the copy in
+// place. only the rows up to the last one holding the signature or data are
+// mapped, and only the channels holding them are written to, so nothing but
+// the copy itself grows with the size of the image
+static void embed_in_place(csteg_ctx* ctx, const char* filename) {
+	png_reader* reader = &ctx->reader;
+	png_writer* writer = &ctx->writer;
+	image_info* image = &ctx->image;
+
+	// the copy has to be mapped, so it can't be a device or pipe
+	struct stat st;
+	if (stat(filename, &st) == 0 && !S_ISREG(st.st_mode)) {
+		fail(ctx, CSTEG_ERR_IO, "embed_in_place() : File %s is not a regular file", filename);
+	}
+
+	// written next to the output and renamed over it, as output pngs are,
+	// so the image being copied may be the output itself
+	memset(writer, 0, sizeof(*writer));
+	ctx->writer_open = 1;
+	open_output(ctx, filename, "w+b");
+
+	int fd = fileno(writer->file_ptr);
+	copy_image(ctx, reader->raw_fd, fd, reader->raw_size, filename);
+
+	size_t rows = region_end_row(image, &ctx->sig_region);
+	size_t data_rows = region_end_row(image, &ctx->data_region);
+	if (data_rows > rows) {
+		rows = data_rows;
+	}
+
+	// the rows are stored next to each other, at the start of the pixels or
+	// at their end if the image is stored from the bottom up
+	uint64_t first = raw_row_offset(ctx, reader->raw_bottom_up ? rows - 1 : 0);
+	uint64_t start = first - first % (uint64_t) sysconf(_SC_PAGESIZE);
+	size_t length = first - start + (uint64_t) reader->raw_stride * (rows - 1) + reader->rowbytes;
+
+	void* mapping = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, start);
+	if (mapping == MAP_FAILED) {
+		fail(ctx, CSTEG_ERR_IO, "embed_in_place() : File %s could not be mapped", filename);
+	}
+
+	// rows are embedded into where they lie, a band at a time
+	for (size_t y = 0; y < rows; y += ctx->band_count) {
+		ctx->band_first = y;
+		ctx->band_count = rows - y < ctx->band_capacity ? rows - y : ctx->band_capacity;
+
+		for (size_t i = 0; i < ctx->band_count; i++) {
+			ctx->band_rows[i] = (uint8_t*) mapping + (raw_row_offset(ctx, y + i) - start);
+		}
+
+		run_band(ctx, embed_band_task);
+	}
+
+	munmap(mapping, length);
+
+	close_output(ctx);
+	ctx->writer_open = 0;
+}
+
+// embed into the open image, writing png_out. uncompressed images are
+// embedded into in place, and written in the format they were read in
+static void embed_output(csteg_ctx* ctx, const char* png_out) {
+	open_bands(ctx);
+
+	if (ctx->reader.raw) {
+		embed_in_place(ctx, png_out);
+	} else {
+		open_png_writer(ctx, png_out);
+		embed_rows(ctx);
+	}
+}
+
+//===========================================================================//
+// extracting
+//===========================================================================//
+
+// extract the depth bits held by a channel byte into the payload bytes at
+// bit, dropping any bits past the end of the size byte buffer
+static void extract_chunk(const uint8_t* channel, int depth, uint8_t* buffer, size_t size, size_t bit) {
+	// the bits may straddle two bytes
+	unsigned int window = (*channel & ((1 << depth) - 1)) << (16 - depth - bit % 8);
+
+	buffer[bit / 8] |= window >> 8;
+
+	// the second byte is only touched if the bits do straddle it, as it may
+	// belong to another thread
+	if (bit % 8 + depth > 8 && bit / 8 + 1 < size) {
+		buffer[bit / 8 + 1] |= window & 0xFF;
+	}
+}
+
+// mirrors embed_span, extracting into size bytes of buffer which hold the
+// bytes of the region from bit buffer_bit on
+static void extract_span(const image_info* image, const uint8_t* channels, size_t first, size_t count, int depth,
+                         uint8_t* buffer, size_t size, size_t buffer_bit) {
+	size_t sample_bytes = image->sample_bytes;
+	size_t i = 0;
+
+	// the low byte of a sample is its last
+	const uint8_t* low_bytes = channels + sample_bytes - 1;
+
+	// channels before the first group boundary
+	for (; i < count && (first + i) % 8 != 0; i++) {
+		extract_chunk(&low_bytes[i * sample_bytes], depth, buffer, size, (first + i) * depth - buffer_bit);
+	}
+
+	// whole groups
+	size_t groups = (count - i) / 8;
+	extract_kernel(depth, sample_bytes, &channels[i * sample_bytes], &buffer[((first + i) * depth - buffer_bit) / 8], groups);
+	i += groups * 8;
+
+	// channels after the last group boundary
+	for (; i < count; i++) {
+		extract_chunk(&low_bytes[i * sample_bytes], depth, buffer, size, (first + i) * depth - buffer_bit);
+	}
+}
+
+// first channel of ctx->job extracted by thread index. threads other than
+// the first start a whole number of groups of 8 channels into the region,
+// which is always on a byte boundary, so no two threads write the same byte
+static size_t extract_split(const extract_job* job, size_t index, size_t count) {
+	if (index == 0) {
+		return job->first;
+	}
+	if (index == count) {
+		return job->last;
+	}
+
+	size_t split = (job->first + (job->last - job->first) * index / count) & ~(size_t) 7;
+	return split > job->first ? split : job->first;
+}
+
+// extract a share of the channels of ctx->job from the band
+static void extract_band_task(void* arg, size_t index, size_t count) {
+	csteg_ctx* ctx = (csteg_ctx*) arg;
+	const image_info* image = &ctx->image;
+	const extract_job* job = &ctx->job;
+	const payload_region* region = job->region;
+	size_t row_channels = image->width * region_pixel_channels(image, region);
+	int gathered = region_pixel_channels(image, region) != image->pixel_channels;
+	uint8_t* scratch = ctx->scratch.base + index * ctx->scratch_stride;
+
+	size_t first = extract_split(job, index, count);
+	size_t last = extract_split(job, index + 1, count);
+
+	while (first < last) {
+		size_t y = (region->first_channel + first) / row_channels;
+
+		// stop at the end of the row or the last channel of the share
+		size_t end = (y + 1) * row_channels - region->first_channel;
+		if (end > last) {
+			end = last;
+		}
+
+		// channels of the row, in the order the region uses them
+		const uint8_t* channels = ctx->band_rows[y - ctx->band_first];
+		if (gathered) {
+			gather_color_channels(image, scratch, channels);
+			channels = scratch;
+		}
+
+		size_t offset = (region->first_channel + first - y * row_channels) * image->sample_bytes;
+		extract_span(image, &channels[offset], first, end - first, region->depth, job->buffer, job->size, job->start_bit);
+
+		first = end;
+	}
+}
+
+// extract the next size bytes of a region into buffer. extraction has to
+// start on a channel boundary, so reads from a region other than its last
+// one have to be multiples of depth bytes
+static void extract_bytes(csteg_ctx* ctx, payload_region* region, uint8_t* buffer, size_t size) {
+	const image_info* image = &ctx->image;
+	size_t row_channels = image->width * region_pixel_channels(image, region);
+	int depth = region->depth;
+	size_t start_bit = region->bit_pos;
+	size_t end_bit = start_bit + size * 8;
+	size_t end_channel = (end_bit + depth - 1) / depth; // past the last channel holding the bytes
+
+	memset(buffer, 0, size);
+
+	while (region->bit_pos < end_bit) {
+		size_t first = region->bit_pos / depth; // first channel to extract from
+		size_t y = (region->first_channel + first) / row_channels;
+
+		// decode bands up to the one holding the next channel, never past the
+		// row holding the last channel wanted
+		while (ctx->band_first + ctx->band_count <= y) {
+			size_t last_row = (region->first_channel + end_channel - 1) / row_channels;
+			size_t count = last_row + 1 - ctx->reader.next_row;
+			read_band(ctx, count < ctx->band_capacity ? count : ctx->band_capacity);
+		}
+
+		// stop at the end of the band or the last channel holding the bytes
+		size_t last = (ctx->band_first + ctx->band_count) * row_channels - region->first_channel;
+		if (last > end_channel) {
+			last = end_channel;
+		}
+
+		ctx->job = (extract_job) {
+			.region = region,
+			.buffer = buffer,
+			.size = size,
+			.start_bit = start_bit,
+			.first = first,
+			.last = last,
+		};
+		run_band(ctx, extract_band_task);
+
+		region->bit_pos = last * depth < end_bit ? last * depth : end_bit;
+	}
+}
+
+// read the signature of the open image, leaving the data ready to be read
+static void read_signature(csteg_ctx* ctx, const char* filename) {
+	image_info* image = &ctx->image;
+
+	open_bands(ctx);
+
+	ctx->sig_region = (payload_region) {
+		.first_channel = 0,
+		.depth = 2,
+		.all_channels = 0,
+		.bit_pos = 0,
+	};
+
+	// the signature must fit in the image
+	size_t sig_capacity = image->width * image->height * image->color_channels * 2 / 8;
+	if (sig_capacity < SIG_LEGACY_HEADER_SIZE) {
+		fail(ctx, CSTEG_ERR_NO_PAYLOAD, "read_signature() : File %s is too small to contain data", filename);
+	}
+
+	// both headers are at least as long as a legacy one
+	uint8_t header[SIG_HEADER_SIZE];
+	extract_bytes(ctx, &ctx->sig_region, header, SIG_LEGACY_HEADER_SIZE);
+
+	size_t header_size;
+	uint64_t data_filename_length, data_file_size;
+	uint8_t flags;
+	uint8_t allowed_flags = SIG_FLAG_DEPTH | SIG_FLAG_ALPHA;
+
+	if (memcmp(header, SIG_MAGIC, SIG_MAGIC_SIZE) == 0) {
+		if (sig_capacity < SIG_HEADER_SIZE) {
+			fail(ctx, CSTEG_ERR_NO_PAYLOAD, "read_signature() : File %s does not contain a valid signature", filename);
+		}
+
+		// read in the rest of the header
+		extract_bytes(ctx, &ctx->sig_region, &header[SIG_LEGACY_HEADER_SIZE], SIG_HEADER_SIZE - SIG_LEGACY_HEADER_SIZE);
+
+		if (header[4] != SIG_VERSION) {
+			fail(ctx, CSTEG_ERR_FORMAT, "read_signature() : File %s has a signature of unsupported version %d", filename, header[4]);
+		}
+
+		header_size = SIG_HEADER_SIZE;
+		flags = header[5];
+		data_filename_length = load_be(&header[6], 4);
+		data_file_size = load_be(&header[10], 8);
+
+		if (flags & SIG_FLAG_COMPRESSION) {
+			fail(ctx, CSTEG_ERR_FORMAT, "read_signature() : File %s holds data compressed with unsupported method %d",
+			     filename, (flags & SIG_FLAG_COMPRESSION) >> 3);
+		}
+
+		// the shard fields come before the filename
+		if (flags & SIG_FLAG_SHARD) {
+			uint8_t shard[SIG_SHARD_SIZE];
+			if (sig_capacity < SIG_HEADER_SIZE + SIG_SHARD_SIZE) {
+				fail(ctx, CSTEG_ERR_NO_PAYLOAD, "read_signature() : File %s does not contain a valid signature", filename);
+			}
+			extract_bytes(ctx, &ctx->sig_region, shard, SIG_SHARD_SIZE);
+
+			header_size += SIG_SHARD_SIZE;
+			allowed_flags |= SIG_FLAG_SHARD;
+			ctx->sharded = 1;
+			ctx->shard = (csteg_shard) {
+				.id = load_be(shard, 8),
+				.index = load_be(&shard[8], 4),
+				.count = load_be(&shard[12], 4),
+				.offset = load_be(&shard[16], 8),
+				.size = data_file_size,
+				.total_size = load_be(&shard[24], 8),
+			};
+
+			// the shard must lie within the payload
+			csteg_shard* info = &ctx->shard;
+			if (info->index >= info->count || info->offset > info->total_size || info->size > info->total_size - info->offset) {
+				fail(ctx, CSTEG_ERR_NO_PAYLOAD, "read_signature() : File %s does not contain a valid signature", filename);
+			}
+		}
+	} else {
+		// legacy header, flags are in the top byte of the filename length
+		header_size = SIG_LEGACY_HEADER_SIZE;
+		data_filename_length = load_be(header, SIG_LEGACY_SIZE_BITS / 8);
+		data_file_size = load_be(&header[SIG_LEGACY_SIZE_BITS / 8], SIG_LEGACY_SIZE_BITS / 8);
+
+		// images without flags store everything at 2 bits per channel
+		flags = 2 - 1;
+		if (header[0] & SIG_FLAG_PRESENT) {
+			flags = header[0] & ~SIG_FLAG_PRESENT;
+			data_filename_length &= 0xFFFFFF;
+		}
+	}
+
+	int depth = (flags & SIG_FLAG_DEPTH) + 1;
+	int all_channels = (flags & SIG_FLAG_ALPHA) != 0;
+
+	int valid_flags = !(flags & ~allowed_flags) && (!all_channels || image->pixel_channels != image->color_channels);
+
+	// check that the signature describes data that fits in the image
+	if (!valid_flags || data_filename_length == 0 || data_filename_length > sig_capacity - header_size) {
+		fail(ctx, CSTEG_ERR_NO_PAYLOAD, "read_signature() : File %s does not contain a valid signature", filename);
+	}
+
+	ctx->sig_region.channels = channels_needed(header_size + data_filename_length, 2);
+
+	ctx->data_region = (payload_region) {
+		.first_channel = region_following(image, &ctx->sig_region, all_channels),
+		.depth = depth,
+		.all_channels = all_channels,
+		.bit_pos = 0,
+	};
+
+	// compared in bytes, as the size may be anything up to 2^64 - 1
+	size_t max_channels = image->width * image->height * region_pixel_channels(image, &ctx->data_region);
+	size_t first_channel = ctx->data_region.first_channel;
+	size_t free_bytes = first_channel < max_channels ? (max_channels - first_channel) * depth / 8 : 0;
+
+	if (data_file_size > free_bytes) {
+		fail(ctx, CSTEG_ERR_NO_PAYLOAD, "read_signature() : File %s does not contain a valid signature", filename);
+	}
+	ctx->data_region.channels = channels_needed(data_file_size, depth);
+
+	// read in file name
+	ctx->data_filename = (char*) alloc_or_fail(ctx, data_filename_length + 1);
+	extract_bytes(ctx, &ctx->sig_region, (uint8_t*) ctx->data_filename, data_filename_length);
+	ctx->data_filename[data_filename_length] = '\0';
+
+	ctx->data_size = data_file_size;
+	ctx->data_remaining = data_file_size;
+	ctx->block_pos = 0;
+	ctx->block_length = 0;
+}
+
+//===========================================================================//
+// probing
+//===========================================================================//
+
+// read the whole header of a file into buffer, returning the number of bytes
+// read, which is less than PROBE_SIZE only if the file is shorter
+static size_t read_probe(csteg_ctx* ctx, const char* filename, uint8_t* buffer) {
+	int fd = open(filename, O_RDONLY);
+
+	// check that file exists
+	if (fd < 0) {
+		fail(ctx, CSTEG_ERR_IO, "read_probe() : File %s could not be opened for reading", filename);
+	}
+
+	size_t size = 0;
+	while (size < PROBE_SIZE) {
+		ssize_t count = read(fd, buffer + size, PROBE_SIZE - size);
+		if (count < 0) {
+			close(fd);
+			fail(ctx, CSTEG_ERR_IO, "read_probe() : error reading %s", filename);
+		}
+		if (count == 0) {
+			break;
+		}
+
+		size += count;
+	}
+
+	close(fd);
+	return size;
+}
+
+// parse the signature and IHDR chunk at the start of size bytes of png into
+// image and ctx->image, without handing the png to libpng
+static void parse_probe(csteg_ctx* ctx, const uint8_t* png, size_t size, const char* filename, csteg_image* image) {
+	if (is_raw_image_header(png, size)) {
+		fail(ctx, CSTEG_ERR_FORMAT, "parse_probe() : uncompressed images can only be read from a file, not from memory");
+	}
+
+	if (size < PNG_SIG_SIZE || png_sig_cmp(png, 0, PNG_SIG_SIZE)) {
+		fail(ctx, CSTEG_ERR_NOT_PNG, "parse_probe() : File %s is not recognized as a PNG file", filename);
+	}
+
+	// IHDR must be the first chunk
+	const uint8_t* chunk = png + PNG_SIG_SIZE;
+	if (size < PROBE_SIZE || load_be(chunk, 4) != IHDR_DATA_SIZE || memcmp(&chunk[4], "IHDR", 4) != 0) {
+		fail(ctx, CSTEG_ERR_PNG, "parse_probe() : File %s does not start with an IHDR chunk", filename);
+	}
+
+	// the crc covers the type and the data
+	const uint8_t* data = &chunk[8];
+	if (crc32(crc32(0, NULL, 0), &chunk[4], 4 + IHDR_DATA_SIZE) != load_be(&data[IHDR_DATA_SIZE], 4)) {
+		fail(ctx, CSTEG_ERR_PNG, "parse_probe() : File %s has a corrupt IHDR chunk", filename);
+	}
+
+	image->width = load_be(data, 4);
+	image->height = load_be(&data[4], 4);
+	image->bit_depth = data[8];
+	image->color_type = data[9];
+	image->interlaced = data[12] == PNG_INTERLACE_ADAM7;
+	image->uncompressed = 0;
+
+	// images libpng would refuse to decode are refused here as well
+	int valid_depth = image->bit_depth == 1 || image->bit_depth == 2 || image->bit_depth == 4 ||
+	                  image->bit_depth == 8 || image->bit_depth == 16;
+	if (image->width == 0 || image->width > PNG_USER_WIDTH_MAX || image->height == 0 || image->height > PNG_USER_HEIGHT_MAX ||
+	    !valid_depth || data[10] != PNG_COMPRESSION_TYPE_BASE || data[11] != PNG_FILTER_TYPE_BASE || data[12] > PNG_INTERLACE_ADAM7) {
+		fail(ctx, CSTEG_ERR_PNG, "parse_probe() : File %s has an invalid IHDR chunk", filename);
+	}
+
+	ctx->image = (image_info) {
+		.width = image->width,
+		.height = image->height,
+		.color_type = image->color_type,
+		.bit_depth = image->bit_depth,
+	};
+	set_image_format(ctx, &ctx->image, filename);
+}
+
+//===========================================================================//
+// contexts
+//===========================================================================//
+
+// release everything held by the running operation
+static void reset_ctx(csteg_ctx* ctx) {
+	discard_png_writer(ctx);
+	close_png_reader(ctx);
+	close_payload(ctx);
+	free_pixel_arena(&ctx->scratch);
+
+	free(ctx->band_rows);
+	ctx->band_rows = NULL;
+
+	free(ctx->signature);
+	ctx->signature = NULL;
+
+	free(ctx->data_filename);
+	ctx->data_filename = NULL;
+
+	csteg_carrier_free(ctx->owned_carrier);
+	ctx->owned_carrier = NULL;
+
+	ctx->embed_shard = NULL;
+	ctx->carrier = NULL;
+	ctx->extracting = 0;
+	ctx->sharded = 0;
+}
+
+// start an operation, clearing the last error
+static csteg_status begin_operation(csteg_ctx* ctx) {
+	if (ctx->extracting) {
+		return refuse(ctx, CSTEG_ERR_STATE, "an image is open for extraction, call csteg_close first");
+	}
+
+	ctx->status = CSTEG_OK;
+	ctx->error[0] = '\0';
+	return CSTEG_OK;
+}
+
+csteg_ctx* csteg_ctx_new(void) {
+	csteg_ctx* ctx = (csteg_ctx*) calloc(1, sizeof(csteg_ctx));
+
+	if (ctx) {
+		ctx->depth = 2;
+		ctx->alpha = 0;
+		ctx->threads = 1;
+		ctx->compression = CSTEG_COMPRESS_DEFAULT;
+	}
+
+	return ctx;
+}
+
+void csteg_ctx_free(csteg_ctx* ctx) {
+	if (ctx) {
+		reset_ctx(ctx);
+		pool_destroy(ctx->pool);
+		free(ctx);
+	}
+}
+
+const char* csteg_ctx_error(const csteg_ctx* ctx) {
+	return ctx->error;
+}
+
+const char* csteg_strerror(csteg_status status) {
+	switch (status) {
+		case CSTEG_OK: return "success";
+		case CSTEG_ERR_ARGUMENT: return "invalid argument";
+		case CSTEG_ERR_NOMEM: return "out of memory";
+		case CSTEG_ERR_IO: return "input/output error";
+		case CSTEG_ERR_NOT_PNG: return "not a PNG";
+		case CSTEG_ERR_PNG: return "PNG could not be decoded or encoded";
+		case CSTEG_ERR_FORMAT: return "unsupported color type or bit depth";
+		case CSTEG_ERR_TOO_SMALL: return "image is too small for the data";
+		case CSTEG_ERR_TOO_LARGE: return "data is too large";
+		case CSTEG_ERR_NO_PAYLOAD: return "image does not contain data";
+		case CSTEG_ERR_STATE: return "function called out of order";
+	}
+
+	return "unknown error";
+}
+
+csteg_status csteg_set_depth(csteg_ctx* ctx, int depth) {
+	if (depth < CSTEG_MIN_DEPTH || depth > CSTEG_MAX_DEPTH) {
+		return refuse(ctx, CSTEG_ERR_ARGUMENT, "depth %d is not between %d and %d", depth, CSTEG_MIN_DEPTH, CSTEG_MAX_DEPTH);
+	}
+
+	ctx->depth = depth;
+	return CSTEG_OK;
+}
+
+csteg_status csteg_set_alpha(csteg_ctx* ctx, int alpha) {
+	ctx->alpha = alpha != 0;
+	return CSTEG_OK;
+}
+
+csteg_status csteg_set_compression(csteg_ctx* ctx, csteg_compression compression) {
+	if (compression < CSTEG_COMPRESS_DEFAULT || compression > CSTEG_COMPRESS_STORE) {
+		return refuse(ctx, CSTEG_ERR_ARGUMENT, "compression %d is unknown", (int) compression);
+	}
+
+	ctx->compression = compression;
+	return CSTEG_OK;
+}
+
+csteg_status csteg_set_threads(csteg_ctx* ctx, int threads) {
+	if (threads < 1 || threads > CSTEG_MAX_THREADS) {
+		return refuse(ctx, CSTEG_ERR_ARGUMENT, "thread count %d is not between 1 and %d", threads, CSTEG_MAX_THREADS);
+	}
+
+	// an open extraction keeps the band it was opened with
+	if (ctx->extracting) {
+		return refuse(ctx, CSTEG_ERR_STATE, "an image is open for extraction, call csteg_close first");
+	}
+
+	ctx->threads = threads;
+	return CSTEG_OK;
+}
+
+//===========================================================================//
+// public operations
+//===========================================================================//
+
+csteg_status csteg_embed_file(csteg_ctx* ctx, const char* png_in, const char* data_filename, const char* png_out) {
+	if (begin_operation(ctx) != CSTEG_OK) {
+		return ctx->status;
+	}
+
+	if (setjmp(ctx->jmp)) {
+		reset_ctx(ctx);
+		return ctx->status;
+	}
+
+	// read png header, pixel data is decoded row by row. precooked carriers
+	// are mapped instead, and never decoded, uncompressed images are copied
+	// and embedded into in place
+	open_input(ctx, png_in);
+
+	open_payload(ctx, data_filename);
+	prepare_embed(ctx, data_filename);
+
+	// create output png only once the data is known to fit
+	embed_output(ctx, png_out);
+
+	reset_ctx(ctx);
+	return CSTEG_OK;
+}
+
+csteg_status csteg_embed_shard_file(csteg_ctx* ctx, const char* png_in, const char* data_filename,
+                                   const csteg_shard* shard, const char* png_out) {
+	if (begin_operation(ctx) != CSTEG_OK) {
+		return ctx->status;
+	}
+
+	if (shard->count == 0 || shard->index >= shard->count) {
+		return refuse(ctx, CSTEG_ERR_ARGUMENT, "shard %u of %u is out of range", shard->index, shard->count);
+	}
+
+	if (setjmp(ctx->jmp)) {
+		reset_ctx(ctx);
+		return ctx->status;
+	}
+
+	open_input(ctx, png_in);
+	open_payload(ctx, data_filename);
+
+	// the shard must lie within the file, which must be the whole payload
+	payload_buffer* payload = &ctx->payload;
+	if (shard->total_size != payload->size || shard->offset > payload->size || shard->size > payload->size - shard->offset) {
+		fail(ctx, CSTEG_ERR_ARGUMENT, "csteg_embed_shard_file() : shard does not lie within %s", data_filename);
+	}
+
+	// only the bytes of the shard are embedded, the rest of the mapping is
+	// never touched
+	payload->data += shard->offset;
+	payload->offset = shard->offset;
+	payload->size = shard->size;
+
+	ctx->embed_shard = shard;
+	prepare_embed(ctx, data_filename);
+
+	embed_output(ctx, png_out);
+
+	reset_ctx(ctx);
+	return CSTEG_OK;
+}
+
+csteg_status csteg_embed_memory(csteg_ctx* ctx, const void* png, size_t png_size, const char* name,
+                                const void* data, size_t data_size, void** png_out, size_t* png_out_size) {
+	if (begin_operation(ctx) != CSTEG_OK) {
+		return ctx->status;
+	}
+
+	if (setjmp(ctx->jmp)) {
+		reset_ctx(ctx);
+		return ctx->status;
+	}
+
+	// precooked carriers are used where they are, without being copied
+	csteg_carrier precooked;
+	if (view_carrier(ctx, (const uint8_t*) png, png_size, &precooked)) {
+		open_carrier(ctx, &precooked);
+	} else {
+		open_png_reader(ctx, NULL, png, png_size);
+	}
+
+	// data is used in place
+	ctx->payload = (payload_buffer) {
+		.data = (const uint8_t*) data,
+		.size = data_size,
+		.mapped_size = 0,
+		.owned = 0,
+		.fd = -1,
+	};
+	ctx->payload_open = 1;
+	prepare_embed(ctx, name);
+
+	open_bands(ctx);
+	open_png_writer(ctx, NULL);
+	embed_rows(ctx);
+
+	// hand the encoded png over to the caller
+	*png_out = ctx->writer.sink.data;
+	*png_out_size = ctx->writer.sink.size;
+	ctx->writer.sink.data = NULL;
+
+	reset_ctx(ctx);
+	return CSTEG_OK;
+}
+
+csteg_status csteg_decode_file(csteg_ctx* ctx, const char* png_in, csteg_carrier** carrier) {
+	if (begin_operation(ctx) != CSTEG_OK) {
+		return ctx->status;
+	}
+
+	if (setjmp(ctx->jmp)) {
+		reset_ctx(ctx);
+		return ctx->status;
+	}
+
+	// precooked carriers are already decoded, and only mapped
+	if (load_carrier(ctx, png_in)) {
+		*carrier = ctx->owned_carrier;
+		ctx->owned_carrier = NULL;
+	} else {
+		open_png_reader(ctx, png_in, NULL, 0);
+		*carrier = decode_carrier(ctx);
+	}
+
+	reset_ctx(ctx);
+	return CSTEG_OK;
+}
+
+csteg_status csteg_decode_memory(csteg_ctx* ctx, const void* png, size_t png_size, csteg_carrier** carrier) {
+	if (begin_operation(ctx) != CSTEG_OK) {
+		return ctx->status;
+	}
+
+	if (setjmp(ctx->jmp)) {
+		reset_ctx(ctx);
+		return ctx->status;
+	}
+
+	// the rows of precooked carriers are copied, as png is the caller's
+	csteg_carrier precooked;
+	if (view_carrier(ctx, (const uint8_t*) png, png_size, &precooked)) {
+		*carrier = copy_carrier(ctx, &precooked);
+	} else {
+		open_png_reader(ctx, NULL, png, png_size);
+		*carrier = decode_carrier(ctx);
+	}
+
+	reset_ctx(ctx);
+	return CSTEG_OK;
+}
+
+size_t csteg_carrier_size(const csteg_carrier* carrier) {
+	size_t pixels = carrier->mapping ? carrier->mapping_size :
+	                carrier->arena.mapped_size ? carrier->arena.mapped_size : carrier->stride * carrier->image.height;
+	return sizeof(csteg_carrier) + pixels;
+}
+
+void csteg_carrier_free(csteg_carrier* carrier) {
+	if (carrier) {
+		if (carrier->mapping) {
+			munmap(carrier->mapping, carrier->mapping_size);
+		} else {
+			free_pixel_arena(&carrier->arena);
+		}
+		free(carrier);
+	}
+}
+
+csteg_status csteg_carrier_save(csteg_ctx* ctx, const csteg_carrier* carrier, const char* filename) {
+	if (begin_operation(ctx) != CSTEG_OK) {
+		return ctx->status;
+	}
+
+	if (setjmp(ctx->jmp)) {
+		reset_ctx(ctx);
+		return ctx->status;
+	}
+
+	save_carrier(ctx, carrier, filename);
+
+	reset_ctx(ctx);
+	return CSTEG_OK;
+}
+
+csteg_status csteg_embed_carrier_file(csteg_ctx* ctx, const csteg_carrier* carrier, const char* data_filename,
+                                      const char* png_out) {
+	if (begin_operation(ctx) != CSTEG_OK) {
+		return ctx->status;
+	}
+
+	if (setjmp(ctx->jmp)) {
+		reset_ctx(ctx);
+		return ctx->status;
+	}
+
+	open_carrier(ctx, carrier);
+
+	open_payload(ctx, data_filename);
+	prepare_embed(ctx, data_filename);
+
+	open_bands(ctx);
+	open_png_writer(ctx, png_out);
+	embed_rows(ctx);
+
+	reset_ctx(ctx);
+	return CSTEG_OK;
+}
+
+csteg_status csteg_embed_carrier_memory(csteg_ctx* ctx, const csteg_carrier* carrier, const char* name,
+                                        const void* data, size_t data_size, void** png_out, size_t* png_out_size) {
+	if (begin_operation(ctx) != CSTEG_OK) {
+		return ctx->status;
+	}
+
+	if (setjmp(ctx->jmp)) {
+		reset_ctx(ctx);
+		return ctx->status;
+	}
+
+	open_carrier(ctx, carrier);
+
+	// data is used in place
+	ctx->payload = (payload_buffer) {
+		.data = (const uint8_t*) data,
+		.size = data_size,
+		.mapped_size = 0,
+		.owned = 0,
+		.fd = -1,
+	};
+	ctx->payload_open = 1;
+	prepare_embed(ctx, name);
+
+	open_bands(ctx);
+	open_png_writer(ctx, NULL);
+	embed_rows(ctx);
+
+	*png_out = ctx->writer.sink.data;
+	*png_out_size = ctx->writer.sink.size;
+	ctx->writer.sink.data = NULL;
+
+	reset_ctx(ctx);
+	return CSTEG_OK;
+}
+
+csteg_status csteg_open_file(csteg_ctx* ctx, const char* png_in) {
+	if (begin_operation(ctx) != CSTEG_OK) {
+		return ctx->status;
+	}
+
+	if (setjmp(ctx->jmp)) {
+		reset_ctx(ctx);
+		return ctx->status;
+	}
+
+	// uncompressed images are read a row at a time, only up to the end of
+	// the payload
+	if (!open_raw_image(ctx, png_in)) {
+		open_png_reader(ctx, png_in, NULL, 0);
+	}
+	read_signature(ctx, png_in);
+
+	ctx->extracting = 1;
+	return CSTEG_OK;
+}
+
+csteg_status csteg_open_memory(csteg_ctx* ctx, const void* png, size_t png_size) {
+	if (begin_operation(ctx) != CSTEG_OK) {
+		return ctx->status;
+	}
+
+	if (setjmp(ctx->jmp)) {
+		reset_ctx(ctx);
+		return ctx->status;
+	}
+
+	open_png_reader(ctx, NULL, png, png_size);
+	read_signature(ctx, "(memory)");
+
+	ctx->extracting = 1;
+	return CSTEG_OK;
+}
+
+const char* csteg_payload_name(const csteg_ctx* ctx) {
+	return ctx->extracting ? ctx->data_filename : NULL;
+}
+
+size_t csteg_payload_size(const csteg_ctx* ctx) {
+	return ctx->extracting ? ctx->data_size : 0;
+}
+
+int csteg_payload_shard(const csteg_ctx* ctx, csteg_shard* shard) {
+	if (!ctx->extracting || !ctx->sharded) {
+		return 0;
+	}
+
+	*shard = ctx->shard;
+	return 1;
+}
+
+csteg_status csteg_read(csteg_ctx* ctx, void* buffer, size_t size, size_t* length) {
+	*length = 0;
+
+	if (!ctx->extracting) {
+		return refuse(ctx, CSTEG_ERR_STATE, "no image is open for extraction");
+	}
+
+	if (setjmp(ctx->jmp)) {
+		reset_ctx(ctx);
+		return ctx->status;
+	}
+
+	uint8_t* out = (uint8_t*) buffer;
+	size_t depth = ctx->data_region.depth;
+
+	while (*length < size) {
+		// bytes left over from the last read come first
+		if (ctx->block_pos < ctx->block_length) {
+			size_t count = ctx->block_length - ctx->block_pos;
+			if (count > size - *length) {
+				count = size - *length;
+			}
+
+			memcpy(out + *length, ctx->block + ctx->block_pos, count);
+			ctx->block_pos += count;
+			*length += count;
+			continue;
+		}
+
+		if (ctx->data_remaining == 0) {
+			break;
+		}
+
+		// extract straight into buffer as long as whole chunks of depth
+		// bytes are wanted, or the rest of the data
+		size_t wanted = size - *length;
+		size_t direct = wanted >= ctx->data_remaining ? ctx->data_remaining : wanted - wanted % depth;
+
+		if (direct > 0) {
+			extract_bytes(ctx, &ctx->data_region, out + *length, direct);
+			ctx->data_remaining -= direct;
+			*length += direct;
+			continue;
+		}
+
+		// fewer than depth bytes are wanted, extract a whole chunk ahead
+		ctx->block_length = ctx->data_remaining < depth ? ctx->data_remaining : depth;
+		ctx->block_pos = 0;
+		extract_bytes(ctx, &ctx->data_region, ctx->block, ctx->block_length);
+		ctx->data_remaining -= ctx->block_length;
+	}
+
+	return CSTEG_OK;
+}
+
+void csteg_close(csteg_ctx* ctx) {
+	// any rows past the end of the payload are never inflated
+	reset_ctx(ctx);
+}
+
+csteg_status csteg_extract_memory(csteg_ctx* ctx, const void* png, size_t png_size,
+                                  char** name, void** data, size_t* data_size) {
+	csteg_status status = csteg_open_memory(ctx, png, png_size);
+	if (status != CSTEG_OK) {
+		return status;
+	}
+
+	// allocated before reading, so they are released on failure below
+	size_t size = csteg_payload_size(ctx);
+	uint8_t* buffer = (uint8_t*) malloc(size ? size : 1);
+	char* filename = strdup(csteg_payload_name(ctx));
+
+	if (!buffer || !filename) {
+		free(buffer);
+		free(filename);
+		csteg_close(ctx);
+		return refuse(ctx, CSTEG_ERR_NOMEM, "could not allocate %zu bytes", size);
+	}
+
+	size_t length;
+	status = csteg_read(ctx, buffer, size, &length);
+	csteg_close(ctx);
+
+	if (status != CSTEG_OK) {
+		free(buffer);
+		free(filename);
+		return status;
+	}
+
+	*name = filename;
+	*data = buffer;
+	*data_size = length;
+	return CSTEG_OK;
+}
+
+csteg_status csteg_probe_file(csteg_ctx* ctx, const char* png_in, csteg_image* image) {
+	if (begin_operation(ctx) != CSTEG_OK) {
+		return ctx->status;
+	}
+
+	if (setjmp(ctx->jmp)) {
+		reset_ctx(ctx);
+		return ctx->status;
+	}
+
+	// only the header is read, the rest of the file is never touched
+	uint8_t header[PROBE_SIZE];
+	size_t size = read_probe(ctx, png_in, header);
+
+	// uncompressed images may have longer headers, read by opening them
+	if (is_raw_image_header(header, size) && open_raw_image(ctx, png_in)) {
+		*image = (csteg_image) {
+			.width = ctx->image.width,
+			.height = ctx->image.height,
+			.color_type = ctx->image.color_type,
+			.bit_depth = ctx->image.bit_depth,
+			.interlaced = 0,
+			.uncompressed = 1,
+		};
+
+		reset_ctx(ctx);
+		return CSTEG_OK;
+	}
+
+	if (is_raw_header(header, size)) {
+		probe_raw_header(ctx, header, png_in, image);
+		return CSTEG_OK;
+	}
+
+	parse_probe(ctx, header, size, png_in, image);
+
+	return CSTEG_OK;
+}
+
+csteg_status csteg_probe_memory(csteg_ctx* ctx, const void* png, size_t png_size, csteg_image* image) {
+	if (begin_operation(ctx) != CSTEG_OK) {
+		return ctx->status;
+	}
+
+	if (setjmp(ctx->jmp)) {
+		return ctx->status;
+	}
+
+	if (is_raw_header((const uint8_t*) png, png_size)) {
+		probe_raw_header(ctx, (const uint8_t*) png, "(memory)", image);
+		return CSTEG_OK;
+	}
+
+	parse_probe(ctx, (const uint8_t*) png, png_size, "(memory)", image);
+
+	return CSTEG_OK;
+}
+
+size_t csteg_capacity(const csteg_image* image, int depth, int alpha, size_t name_length) {
+	image_info info = {
+		.width = image->width,
+		.height = image->height,
+	};
+
+	if (depth < CSTEG_MIN_DEPTH || depth > CSTEG_MAX_DEPTH ||
+	    image->bit_depth < 8 || !format_channels(image->color_type, &info.pixel_channels, &info.color_channels)) {
+		return 0;
+	}
+
+	// alpha channels can only be used if the image has them, as when embedding
+	int all_channels = alpha && info.pixel_channels != info.color_channels;
+
+	return data_capacity(&info, SIG_HEADER_SIZE + name_length, depth, all_channels);
+}
+
+csteg_status csteg_select_kernel(const char* name) {
+	return select_kernel(name) == 0 ? CSTEG_OK : CSTEG_ERR_ARGUMENT;
+}
+
+const char* csteg_kernel_name(size_t index) {
+	return kernel_name(index);
+}
@@ -0,0 +1,245 @@
+//===================== Copyright 2020, Jake Grossman =======================//
+//
+// Purpose: libcsteg, embedding files in PNG images and extracting them
+//
+// All state lives in a csteg_ctx, so any number of contexts can be used at
+// once from different threads. A context runs one operation at a time.
+// Functions return CSTEG_OK or an error code, and csteg_ctx_error()
+// describes the last error of a context.
+//
+// This file is subject to the terms and conditions defined in the
+// file 'LICENSE.txt', which is part of this source code package
+//
+//===========================================================================//
+#ifndef CSTEG_H
+#define CSTEG_H
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint32_t, uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// the least and most bits stored in each channel
+#define CSTEG_MIN_DEPTH 1
+#define CSTEG_MAX_DEPTH 4
+
+// the most threads a context embeds or extracts with
+#define CSTEG_MAX_THREADS 256
+
+// bytes a shard adds to the signature of an image, on top of its name
+#define CSTEG_SHARD_HEADER_SIZE 32
+
+typedef enum {
+	CSTEG_OK = 0,
+	CSTEG_ERR_ARGUMENT, // invalid argument or option
+	CSTEG_ERR_NOMEM, // out of memory
+	CSTEG_ERR_IO, // a file could not be opened, read or written
+	CSTEG_ERR_NOT_PNG, // input is not a PNG
+	CSTEG_ERR_PNG, // libpng failed to decode or encode the image
+	CSTEG_ERR_FORMAT, // color type or bit depth can't hold data
+	CSTEG_ERR_TOO_SMALL, // image is too small for the data
+	CSTEG_ERR_TOO_LARGE, // data file or name is too large for the signature
+	CSTEG_ERR_NO_PAYLOAD, // image does not contain a valid signature
+	CSTEG_ERR_STATE, // function called out of order
+} csteg_status;
+
+// how output images are compressed
+typedef enum {
+	CSTEG_COMPRESS_DEFAULT = 0, // libpng defaults, adaptive filters
+	CSTEG_COMPRESS_FAST, // fastest zlib level on rows filtered with Up
+	CSTEG_COMPRESS_MAX, // slowest and smallest, adaptive filters
+	CSTEG_COMPRESS_STORE, // unfiltered rows in stored blocks
+} csteg_compression;
+
+// part of a payload split across several images
+typedef struct {
+	uint64_t id; // the same for every shard of a payload
+	uint32_t index; // position of the shard, 0 to count - 1
+	uint32_t count; // number of shards the payload is split into
+	uint64_t offset; // offset of the shard in the payload
+	uint64_t size; // bytes held by the shard
+	uint64_t total_size; // size of the whole payload
+} csteg_shard;
+
+typedef struct csteg_ctx csteg_ctx;
+
+// create a context with the default options, NULL if out of memory
+csteg_ctx* csteg_ctx_new(void);
+
+// release a context and anything left open in it
+void csteg_ctx_free(csteg_ctx* ctx);
+
+// message describing the last error of a context, empty if there was none
+const char* csteg_ctx_error(const csteg_ctx* ctx);
+
+// short description of a status code
+const char* csteg_strerror(csteg_status status);
+
+// bits stored in each channel when embedding, CSTEG_MIN_DEPTH to
+// CSTEG_MAX_DEPTH (default 2). the depth is recorded in the image
+csteg_status csteg_set_depth(csteg_ctx* ctx, int depth);
+
+// also store data in the alpha channel of images that have one (default 0).
+// this is recorded in the image
+csteg_status csteg_set_alpha(csteg_ctx* ctx, int alpha);
+
+// compression of images written when embedding (default
+// CSTEG_COMPRESS_DEFAULT). it doesn't change the pixels written
+csteg_status csteg_set_compression(csteg_ctx* ctx, csteg_compression compression);
+
+// threads embedding, extracting and encoding each band of rows, 1 to
+// CSTEG_MAX_THREADS (default 1). rows are still decoded by the calling
+// thread. can't be changed while an image is open for extraction
+csteg_status csteg_set_threads(csteg_ctx* ctx, int threads);
+
+//===========================================================================//
+// embedding
+//===========================================================================//
+
+// embed the file data_filename into the png png_in, writing png_out. the
+// data is stored under the name data_filename. png_out is written to a
+// new file renamed over it once complete, so it may be png_in, and is left
+// as it was if embedding fails. png_in may also be a precooked carrier
+// file, written by csteg_carrier_save, or an uncompressed image: a binary
+// PGM, PPM or PAM file, or a 24 or 32-bit BMP file. those are copied to
+// png_out, in the same format, and only the bytes holding the payload are
+// rewritten
+csteg_status csteg_embed_file(csteg_ctx* ctx, const char* png_in, const char* data_filename, const char* png_out);
+
+// embed the bytes of the file data_filename described by shard into the png
+// png_in, writing png_out. the file must be the whole payload, of
+// shard->total_size bytes. the shard takes CSTEG_SHARD_HEADER_SIZE more
+// bytes of the image than a whole payload would
+csteg_status csteg_embed_shard_file(csteg_ctx* ctx, const char* png_in, const char* data_filename,
+                                   const csteg_shard* shard, const char* png_out);
+
+// embed data_size bytes of data stored under name into the png held in
+// png, returning a png in *png_out that the caller releases with free().
+// png may also hold a precooked carrier file, whose rows are used in place
+csteg_status csteg_embed_memory(csteg_ctx* ctx, const void* png, size_t png_size, const char* name,
+                                const void* data, size_t data_size, void** png_out, size_t* png_out_size);
+
+//===========================================================================//
+// decoded carriers
+//
+// a carrier decoded once can be embedded into any number of times without
+// being decoded again. it is only read while embedding, so contexts on
+// several threads can share it
+//===========================================================================//
+
+typedef struct csteg_carrier csteg_carrier;
+
+// decode every pixel of a png file into *carrier, released with
+// csteg_carrier_free. a precooked carrier file is mapped instead
+csteg_status csteg_decode_file(csteg_ctx* ctx, const char* png_in, csteg_carrier** carrier);
+
+// decode every pixel of a png held in memory into *carrier. the rows of a
+// precooked carrier file held in memory are copied instead
+csteg_status csteg_decode_memory(csteg_ctx* ctx, const void* png, size_t png_size, csteg_carrier** carrier);
+
+// bytes of memory held by a carrier
+size_t csteg_carrier_size(const csteg_carrier* carrier);
+
+// release a carrier, NULL is ignored
+void csteg_carrier_free(csteg_carrier* carrier);
+
+// write the pixels of carrier to a precooked carrier file, which every
+// function taking a png file to embed into, probe or decode accepts in its
+// place and maps instead of decoding. rows start on a page boundary after a
+// header holding the width, height, channels per pixel, bits per channel
+// and distance between rows
+csteg_status csteg_carrier_save(csteg_ctx* ctx, const csteg_carrier* carrier, const char* filename);
+
+// as csteg_embed_file, taking the pixels of carrier instead of decoding a png
+csteg_status csteg_embed_carrier_file(csteg_ctx* ctx, const csteg_carrier* carrier, const char* data_filename,
+                                      const char* png_out);
+
+// as csteg_embed_memory, taking the pixels of carrier instead of decoding a png
+csteg_status csteg_embed_carrier_memory(csteg_ctx* ctx, const csteg_carrier* carrier, const char* name,
+                                        const void* data, size_t data_size, void** png_out, size_t* png_out_size);
+
+//===========================================================================//
+// extracting
+//
+// csteg_open_* reads the signature of an image, after which the payload is
+// read in order with csteg_read. only the rows holding the requested bytes
+// are decoded. csteg_close ends the operation
+//===========================================================================//
+
+// open a png file, or an uncompressed image, and read its signature. the
+// rows of uncompressed images are read straight from the file
+csteg_status csteg_open_file(csteg_ctx* ctx, const char* png_in);
+
+// open a png held in memory and read its signature. png must stay valid
+// until csteg_close
+csteg_status csteg_open_memory(csteg_ctx* ctx, const void* png, size_t png_size);
+
+// name and size of the payload of the open image
+const char* csteg_payload_name(const csteg_ctx* ctx);
+size_t csteg_payload_size(const csteg_ctx* ctx);
+
+// if the open image holds a shard of a payload, fill in shard and return 1.
+// csteg_payload_size is then the size of the shard alone
+int csteg_payload_shard(const csteg_ctx* ctx, csteg_shard* shard);
+
+// read up to size bytes of the payload into buffer, storing the number of
+// bytes read in *length. *length is less than size only at the end
+csteg_status csteg_read(csteg_ctx* ctx, void* buffer, size_t size, size_t* length);
+
+// end extraction from the open image
+void csteg_close(csteg_ctx* ctx);
+
+// extract the whole payload of the png held in png. *name and *data are
+// released by the caller with free()
+csteg_status csteg_extract_memory(csteg_ctx* ctx, const void* png, size_t png_size,
+                                  char** name, void** data, size_t* data_size);
+
+//===========================================================================//
+// probing
+//
+// csteg_probe_* reads only the signature and IHDR chunk of an image, so the
+// capacity of a carrier is known without decoding any of it
+//===========================================================================//
+
+// header of a png, filled in by csteg_probe_*
+typedef struct {
+	size_t width, height;
+	int color_type; // png color type, 0 gray, 2 RGB, 4 gray with alpha or 6 RGBA
+	int bit_depth; // bits per channel
+	int interlaced; // whether the image is Adam7 interlaced
+	int uncompressed; // whether the image is a BMP, PGM, PPM or PAM file, embedded into in place
+} csteg_image;
+
+// read the header of a png file, of a precooked carrier file or of an
+// uncompressed image. fails with CSTEG_ERR_FORMAT if the image can't hold
+// data
+csteg_status csteg_probe_file(csteg_ctx* ctx, const char* png_in, csteg_image* image);
+
+// read the header of a png, or of a precooked carrier file, held in memory,
+// of which only the first 33 bytes are needed
+csteg_status csteg_probe_memory(csteg_ctx* ctx, const void* png, size_t png_size, csteg_image* image);
+
+// bytes of data that can be embedded at depth bits per channel into an
+// image with the header image, under a name of name_length bytes. alpha
+// channels are counted if alpha is set and the image has them
+size_t csteg_capacity(const csteg_image* image, int depth, int alpha, size_t name_length);
+
+//===========================================================================//
+// kernels
+//===========================================================================//
+
+// select the kernel variant used by every context. with a NULL name, the
+// fastest variant supported by the cpu is used, which is also the default.
+// call before any context is in use
+csteg_status csteg_select_kernel(const char* name);
+
+// name of the variant at index, fastest first, NULL past the last one
+const char* csteg_kernel_name(size_t index);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
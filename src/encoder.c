@@ -0,0 +1,507 @@
+//===================== Copyright 2020, Jake Grossman =======================//
+//
+// Purpose: png encoder filtering and deflating bands of rows on several threads
+//
+// Each band of rows is split into one segment per thread. Threads first
+// filter the rows of their segment, then deflate them as a raw deflate
+// stream primed with the 32 KB of filtered data preceding the segment, so
+// matches can reach back across segments as they would in a single stream.
+// Every segment but the last ends with a sync flush, which leaves it on a
+// byte boundary without ending the stream, so the segments are simply
+// written one after another. The zlib header and the Adler-32 of the whole
+// stream, combined from the checksum of each segment, are added around them.
+//
+// This file is subject to the terms and conditions defined in the
+// file 'LICENSE.txt', which is part of this source code package
+//
+//===========================================================================//
+#include <stdlib.h> // malloc
+#include <string.h> // memcpy
+#include <zlib.h>
+#include "encoder.h"
+
+// the most history deflate can use, which primes each segment
+#define DICTIONARY_SIZE 32768
+
+// IDAT chunks are kept well below the 2^31 - 1 bytes a chunk can hold
+#define IDAT_MAX_SIZE (1 << 30)
+
+// png filter types
+#define FILTER_NONE 0
+#define FILTER_SUB 1
+#define FILTER_UP 2
+#define FILTER_AVERAGE 3
+#define FILTER_PAETH 4
+#define FILTER_TYPES 5
+
+// rows of a band filtered and deflated by one thread
+typedef struct {
+	z_stream stream;
+	int stream_ready; // whether stream was initialized
+	size_t first_row, rows; // rows of the band in the segment
+	uint8_t* out; // deflated segment
+	size_t out_size, out_capacity;
+	uLong adler; // Adler-32 of the filtered rows
+	uint8_t* trial; // row being filtered, then the best filtered row so far
+	uint8_t* best;
+	encoder_status status;
+} encoder_segment;
+
+struct png_encoder {
+	size_t width, height;
+	int bit_depth, color_type;
+	size_t rowbytes; // size of a row, without its filter type byte
+	size_t bpp; // bytes per pixel, the distance filters look back
+	size_t threads;
+	encoder_profile profile;
+
+	encoder_output output;
+	void* io;
+
+	// DICTIONARY_SIZE bytes of history followed by the filtered rows of the
+	// band. history bytes before the band are valid
+	uint8_t* filtered;
+	size_t history;
+
+	uint8_t* previous_row; // last row of the previous band, or zeros
+	uint8_t* const* rows; // band being written
+	size_t band_rows;
+	int last_band; // whether the band ends the image
+	size_t rows_written;
+	uLong adler; // Adler-32 of the filtered rows written so far
+
+	encoder_segment* segments;
+};
+
+//===========================================================================//
+// output
+//===========================================================================//
+
+// store a 32-bit value in network byte order
+static void store_be32(uint8_t* bytes, uint32_t value) {
+	bytes[0] = value >> 24;
+	bytes[1] = value >> 16;
+	bytes[2] = value >> 8;
+	bytes[3] = value;
+}
+
+// write a chunk of type holding size bytes of data
+static void write_chunk(png_encoder* encoder, const char* type, const uint8_t* data, size_t size) {
+	uint8_t header[8];
+	store_be32(header, size);
+	memcpy(header + 4, type, 4);
+
+	// crc32 returns its initial value when given no data, so empty chunks skip it
+	uLong checksum = crc32(0, header + 4, 4);
+	if (size > 0) {
+		checksum = crc32(checksum, data, size);
+	}
+
+	uint8_t crc[4];
+	store_be32(crc, checksum);
+
+	encoder->output(encoder->io, header, sizeof(header));
+	if (size > 0) {
+		encoder->output(encoder->io, data, size);
+	}
+	encoder->output(encoder->io, crc, sizeof(crc));
+}
+
+void encoder_write_header(png_encoder* encoder) {
+	static const uint8_t signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+	encoder->output(encoder->io, signature, sizeof(signature));
+
+	// always written without interlacing
+	uint8_t ihdr[13];
+	store_be32(ihdr, encoder->width);
+	store_be32(ihdr + 4, encoder->height);
+	ihdr[8] = encoder->bit_depth;
+	ihdr[9] = encoder->color_type;
+	ihdr[10] = 0; // deflate
+	ihdr[11] = 0; // adaptive filtering
+	ihdr[12] = 0; // no interlacing
+
+	write_chunk(encoder, "IHDR", ihdr, sizeof(ihdr));
+}
+
+void encoder_finish(png_encoder* encoder) {
+	write_chunk(encoder, "IEND", NULL, 0);
+}
+
+//===========================================================================//
+// filtering
+//===========================================================================//
+
+// paeth predictor, as defined by the png specification
+static uint8_t paeth(uint8_t a, uint8_t b, uint8_t c) {
+	int p = a + b - c;
+	int pa = abs(p - a);
+	int pb = abs(p - b);
+	int pc = abs(p - c);
+
+	if (pa <= pb && pa <= pc) {
+		return a;
+	}
+	return pb <= pc ? b : c;
+}
+
+// filter a row with one filter type
+static void filter_row(int type, uint8_t* out, const uint8_t* row, const uint8_t* previous, size_t rowbytes, size_t bpp) {
+	size_t i;
+
+	switch (type) {
+		case FILTER_NONE:
+			memcpy(out, row, rowbytes);
+			break;
+		case FILTER_SUB:
+			for (i = 0; i < bpp; i++) {
+				out[i] = row[i];
+			}
+			for (; i < rowbytes; i++) {
+				out[i] = row[i] - row[i - bpp];
+			}
+			break;
+		case FILTER_UP:
+			for (i = 0; i < rowbytes; i++) {
+				out[i] = row[i] - previous[i];
+			}
+			break;
+		case FILTER_AVERAGE:
+			for (i = 0; i < bpp; i++) {
+				out[i] = row[i] - (previous[i] >> 1);
+			}
+			for (; i < rowbytes; i++) {
+				out[i] = row[i] - ((row[i - bpp] + previous[i]) >> 1);
+			}
+			break;
+		case FILTER_PAETH:
+			for (i = 0; i < bpp; i++) {
+				out[i] = row[i] - previous[i];
+			}
+			for (; i < rowbytes; i++) {
+				out[i] = row[i] - paeth(row[i - bpp], previous[i], previous[i - bpp]);
+			}
+			break;
+	}
+}
+
+// sum of the bytes of a filtered row taken as signed values, the heuristic
+// libpng chooses filters with
+static size_t filter_cost(const uint8_t* filtered, size_t rowbytes) {
+	size_t sum = 0;
+	for (size_t i = 0; i < rowbytes; i++) {
+		sum += abs((int8_t) filtered[i]);
+	}
+
+	return sum;
+}
+
+// filter the rows of a segment into the filtered buffer, each preceded by
+// the type of the filter of the profile with the smallest cost
+static void filter_task(void* arg, size_t index, size_t count) {
+	png_encoder* encoder = (png_encoder*) arg;
+	encoder_segment* segment = &encoder->segments[index];
+	size_t rowbytes = encoder->rowbytes;
+	int filters = encoder->profile.filters;
+	(void) count;
+
+	// a single filter is applied straight to the output
+	int only_type = -1;
+	for (int type = FILTER_NONE; type < FILTER_TYPES; type++) {
+		if (filters == 1 << type) {
+			only_type = type;
+		}
+	}
+
+	for (size_t i = segment->first_row; i < segment->first_row + segment->rows; i++) {
+		const uint8_t* row = encoder->rows[i];
+		const uint8_t* previous = i > 0 ? encoder->rows[i - 1] : encoder->previous_row;
+		uint8_t* out = encoder->filtered + DICTIONARY_SIZE + i * (rowbytes + 1);
+
+		if (only_type >= 0) {
+			out[0] = only_type;
+			filter_row(only_type, out + 1, row, previous, rowbytes, encoder->bpp);
+			continue;
+		}
+
+		int best_type = -1;
+		size_t best_sum = 0;
+
+		for (int type = FILTER_NONE; type < FILTER_TYPES; type++) {
+			if (!(filters & (1 << type))) {
+				continue;
+			}
+
+			filter_row(type, segment->trial, row, previous, rowbytes, encoder->bpp);
+			size_t sum = filter_cost(segment->trial, rowbytes);
+
+			// keep the best row by swapping buffers
+			if (best_type < 0 || sum < best_sum) {
+				uint8_t* best = segment->trial;
+				segment->trial = segment->best;
+				segment->best = best;
+				best_sum = sum;
+				best_type = type;
+			}
+		}
+
+		out[0] = best_type;
+		memcpy(out + 1, segment->best, rowbytes);
+	}
+}
+
+//===========================================================================//
+// deflating
+//===========================================================================//
+
+// deflate the filtered rows of a segment into segment->out
+static void deflate_task(void* arg, size_t index, size_t count) {
+	png_encoder* encoder = (png_encoder*) arg;
+	encoder_segment* segment = &encoder->segments[index];
+	z_stream* stream = &segment->stream;
+
+	segment->out_size = 0;
+	segment->status = ENCODER_OK;
+
+	if (segment->rows == 0) {
+		segment->adler = adler32(0, Z_NULL, 0);
+		return;
+	}
+
+	size_t offset = segment->first_row * (encoder->rowbytes + 1);
+	uint8_t* in = encoder->filtered + DICTIONARY_SIZE + offset;
+	size_t in_size = segment->rows * (encoder->rowbytes + 1);
+
+	segment->adler = adler32(adler32(0, Z_NULL, 0), in, in_size);
+
+	// the very first segment leaves room for the zlib header, and the last
+	// one for the Adler-32 of the whole stream. bands with fewer rows than
+	// threads leave the leading segments empty, so the first is the one
+	// holding the first row
+	int first = encoder->rows_written == 0 && segment->first_row == 0;
+	int last = encoder->last_band && index == count - 1;
+	size_t reserved = (first ? 2 : 0) + (last ? 4 : 0);
+
+	if (deflateReset(stream) != Z_OK) {
+		segment->status = ENCODER_ERR_ZLIB;
+		return;
+	}
+
+	// prime with the data preceding the segment, in this band or the last,
+	// as far back as the window reaches
+	size_t window = (size_t) 1 << encoder->profile.window_bits;
+	size_t history = offset + encoder->history;
+	size_t dictionary_size = history < window ? history : window;
+	if (dictionary_size > 0 && deflateSetDictionary(stream, in - dictionary_size, dictionary_size) != Z_OK) {
+		segment->status = ENCODER_ERR_ZLIB;
+		return;
+	}
+
+	// a sync flush adds at most a few bytes to the bound
+	size_t capacity = deflateBound(stream, in_size) + reserved + 16;
+	if (capacity > segment->out_capacity) {
+		free(segment->out);
+		segment->out = (uint8_t*) malloc(capacity);
+		segment->out_capacity = segment->out ? capacity : 0;
+
+		if (!segment->out) {
+			segment->status = ENCODER_ERR_NOMEM;
+			return;
+		}
+	}
+
+	stream->next_in = in;
+	stream->avail_in = in_size;
+	segment->out_size = first ? 2 : 0;
+
+	int flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+	for (;;) {
+		// grow the output if the bound was not enough after all
+		if (segment->out_capacity - segment->out_size <= (last ? 4 : 0)) {
+			uint8_t* out = (uint8_t*) realloc(segment->out, segment->out_capacity * 2);
+			if (!out) {
+				segment->status = ENCODER_ERR_NOMEM;
+				return;
+			}
+			segment->out = out;
+			segment->out_capacity *= 2;
+		}
+
+		size_t available = segment->out_capacity - segment->out_size - (last ? 4 : 0);
+		stream->next_out = segment->out + segment->out_size;
+		stream->avail_out = available;
+
+		int ret = deflate(stream, flush);
+		segment->out_size += available - stream->avail_out;
+
+		if (ret == Z_STREAM_ERROR) {
+			segment->status = ENCODER_ERR_ZLIB;
+			return;
+		}
+
+		// done once the stream ends, or everything is flushed with room to spare
+		if (last ? ret == Z_STREAM_END : stream->avail_in == 0 && stream->avail_out > 0) {
+			break;
+		}
+	}
+}
+
+//===========================================================================//
+// encoder
+//===========================================================================//
+
+png_encoder* encoder_create(size_t width, size_t height, int bit_depth, int color_type, size_t channels,
+                            size_t band_capacity, size_t threads, const encoder_profile* profile,
+                            encoder_output output, void* io) {
+	png_encoder* encoder = (png_encoder*) calloc(1, sizeof(png_encoder));
+	if (!encoder) {
+		return NULL;
+	}
+
+	encoder->width = width;
+	encoder->height = height;
+	encoder->bit_depth = bit_depth;
+	encoder->color_type = color_type;
+	encoder->bpp = channels * bit_depth / 8;
+	encoder->rowbytes = width * encoder->bpp;
+	encoder->threads = threads ? threads : 1;
+	encoder->profile = *profile;
+	encoder->output = output;
+	encoder->io = io;
+	encoder->adler = adler32(0, Z_NULL, 0);
+
+	encoder->filtered = (uint8_t*) malloc(DICTIONARY_SIZE + band_capacity * (encoder->rowbytes + 1));
+	encoder->previous_row = (uint8_t*) calloc(1, encoder->rowbytes);
+	encoder->segments = (encoder_segment*) calloc(encoder->threads, sizeof(encoder_segment));
+
+	if (!encoder->filtered || !encoder->previous_row || !encoder->segments) {
+		encoder_free(encoder);
+		return NULL;
+	}
+
+	for (size_t i = 0; i < encoder->threads; i++) {
+		encoder_segment* segment = &encoder->segments[i];
+
+		segment->trial = (uint8_t*) malloc(encoder->rowbytes);
+		segment->best = (uint8_t*) malloc(encoder->rowbytes);
+		if (!segment->trial || !segment->best) {
+			encoder_free(encoder);
+			return NULL;
+		}
+
+		// raw deflate, the zlib header and checksum are written around the segments
+		if (deflateInit2(&segment->stream, profile->level, Z_DEFLATED, -profile->window_bits, profile->mem_level,
+		                 profile->strategy) != Z_OK) {
+			encoder_free(encoder);
+			return NULL;
+		}
+		segment->stream_ready = 1;
+	}
+
+	return encoder;
+}
+
+// write the deflated segments of a band as IDAT chunks
+static void write_segments(png_encoder* encoder) {
+	for (size_t i = 0; i < encoder->threads; i++) {
+		encoder_segment* segment = &encoder->segments[i];
+
+		if (segment->rows == 0) {
+			continue;
+		}
+
+		size_t in_size = segment->rows * (encoder->rowbytes + 1);
+		encoder->adler = adler32_combine(encoder->adler, segment->adler, in_size);
+
+		// zlib header, with the window size and the level hint zlib would write
+		if (encoder->rows_written == 0 && segment->first_row == 0) {
+			const encoder_profile* profile = &encoder->profile;
+			int level = profile->level == Z_DEFAULT_COMPRESSION ? 6 : profile->level;
+			int hint = profile->strategy >= Z_HUFFMAN_ONLY || level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+			unsigned int header = ((((profile->window_bits - 8) << 4) | Z_DEFLATED) << 8) | (hint << 6);
+			header += 31 - header % 31;
+
+			segment->out[0] = header >> 8;
+			segment->out[1] = header & 0xFF;
+		}
+
+		if (encoder->last_band && i == encoder->threads - 1) {
+			store_be32(segment->out + segment->out_size, encoder->adler);
+			segment->out_size += 4;
+		}
+
+		for (size_t pos = 0; pos < segment->out_size; pos += IDAT_MAX_SIZE) {
+			size_t size = segment->out_size - pos < IDAT_MAX_SIZE ? segment->out_size - pos : IDAT_MAX_SIZE;
+			write_chunk(encoder, "IDAT", segment->out + pos, size);
+		}
+	}
+}
+
+encoder_status encoder_write_band(png_encoder* encoder, thread_pool* pool, uint8_t* const* rows, size_t count) {
+	size_t threads = encoder->threads;
+
+	encoder->rows = rows;
+	encoder->band_rows = count;
+	encoder->last_band = encoder->rows_written + count == encoder->height;
+
+	// the last segment always has rows, so it can end the stream
+	for (size_t i = 0; i < threads; i++) {
+		encoder->segments[i].first_row = count * i / threads;
+		encoder->segments[i].rows = count * (i + 1) / threads - count * i / threads;
+	}
+
+	// every row has to be filtered before any segment can be primed with it
+	if (pool) {
+		pool_run(pool, filter_task, encoder);
+		pool_run(pool, deflate_task, encoder);
+	} else {
+		filter_task(encoder, 0, 1);
+		deflate_task(encoder, 0, 1);
+	}
+
+	for (size_t i = 0; i < threads; i++) {
+		if (encoder->segments[i].status != ENCODER_OK) {
+			return encoder->segments[i].status;
+		}
+	}
+
+	write_segments(encoder);
+
+	// keep the end of the band as history for the next one
+	size_t band_size = count * (encoder->rowbytes + 1);
+	size_t history = encoder->history + band_size < DICTIONARY_SIZE ? encoder->history + band_size : DICTIONARY_SIZE;
+	memmove(encoder->filtered + DICTIONARY_SIZE - history, encoder->filtered + DICTIONARY_SIZE + band_size - history, history);
+	encoder->history = history;
+
+	// rows of the next band are filtered against the last row of this one
+	if (count > 0) {
+		memcpy(encoder->previous_row, rows[count - 1], encoder->rowbytes);
+	}
+	encoder->rows_written += count;
+
+	return ENCODER_OK;
+}
+
+void encoder_free(png_encoder* encoder) {
+	if (!encoder) {
+		return;
+	}
+
+	if (encoder->segments) {
+		for (size_t i = 0; i < encoder->threads; i++) {
+			encoder_segment* segment = &encoder->segments[i];
+
+			if (segment->stream_ready) {
+				deflateEnd(&segment->stream);
+			}
+			free(segment->out);
+			free(segment->trial);
+			free(segment->best);
+		}
+	}
+
+	free(encoder->segments);
+	free(encoder->previous_row);
+	free(encoder->filtered);
+	free(encoder);
+}
@@ -0,0 +1,66 @@
+//===================== Copyright 2020, Jake Grossman =======================//
+//
+// Purpose: png encoder filtering and deflating bands of rows on several threads
+//
+// This file is subject to the terms and conditions defined in the
+// file 'LICENSE.txt', which is part of this source code package
+//
+//===========================================================================//
+#ifndef CSTEG_ENCODER_H
+#define CSTEG_ENCODER_H
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint8_t
+#include "pool.h"
+
+typedef enum {
+	ENCODER_OK = 0,
+	ENCODER_ERR_NOMEM,
+	ENCODER_ERR_ZLIB,
+} encoder_status;
+
+// png filters the filter of each row is chosen from, one bit per filter type
+#define ENCODER_FILTER_NONE 0x01
+#define ENCODER_FILTER_SUB 0x02
+#define ENCODER_FILTER_UP 0x04
+#define ENCODER_FILTER_AVERAGE 0x08
+#define ENCODER_FILTER_PAETH 0x10
+#define ENCODER_FILTER_ALL 0x1F
+
+// how rows are filtered and compressed
+typedef struct {
+	int level; // zlib compression level
+	int strategy; // zlib strategy
+	int mem_level; // zlib memory level
+	int window_bits; // log2 of the deflate window, 9 to 15
+	int filters; // ENCODER_FILTER_* rows are filtered with
+} encoder_profile;
+
+// receives the encoded png in order. it may longjmp out of the encoder, which
+// can still be freed afterwards
+typedef void (*encoder_output)(void* io, const uint8_t* data, size_t size);
+
+typedef struct png_encoder png_encoder;
+
+// create an encoder for a non-interlaced image of 8 or 16 bits per channel,
+// written in bands of at most band_capacity rows by threads threads.
+// returns NULL if out of memory
+png_encoder* encoder_create(size_t width, size_t height, int bit_depth, int color_type, size_t channels,
+                            size_t band_capacity, size_t threads, const encoder_profile* profile,
+                            encoder_output output, void* io);
+
+// write the png signature and header
+void encoder_write_header(png_encoder* encoder);
+
+// write the next count rows of the image. pool runs one segment of the band
+// on each of its threads, and must have as many threads as the encoder. it
+// may be NULL for an encoder with a single thread
+encoder_status encoder_write_band(png_encoder* encoder, thread_pool* pool, uint8_t* const* rows, size_t count);
+
+// write the end of the png, once every row has been written
+void encoder_finish(png_encoder* encoder);
+
+// release an encoder, NULL is ignored
+void encoder_free(png_encoder* encoder);
+
+#endif
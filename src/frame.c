@@ -0,0 +1,270 @@
+//===================== Copyright 2020, Jake Grossman =======================//
+//
+// Purpose: framed messages exchanged by the server and its clients
+//
+// This file is subject to the terms and conditions defined in the
+// file 'LICENSE.txt', which is part of this source code package
+//
+//===========================================================================//
+#include <stdio.h>
+#include <stdlib.h> // realloc
+#include <stdint.h> // uint8_t
+#include <string.h> // memcpy
+#include <errno.h> // errno, EINTR
+#include <unistd.h> // read, close
+#include <sys/socket.h> // send, sendmsg, recvmsg, MSG_NOSIGNAL
+#include "frame.h"
+
+void frame_store(uint8_t* bytes, uint64_t value, size_t size) {
+	for (size_t i = 0; i < size; i++) {
+		bytes[i] = (value >> ((size - 1 - i) * 8)) & 0xFF;
+	}
+}
+
+uint64_t frame_load(const uint8_t* bytes, size_t size) {
+	uint64_t value = 0;
+	for (size_t i = 0; i < size; i++) {
+		value = (value << 8) | bytes[i];
+	}
+
+	return value;
+}
+
+// send size bytes, a peer that went away is an error rather than a signal
+static int send_all(int fd, const void* data, size_t size) {
+	const uint8_t* bytes = (const uint8_t*) data;
+
+	while (size > 0) {
+		ssize_t count = send(fd, bytes, size, MSG_NOSIGNAL);
+		if (count < 0 && errno == EINTR) {
+			continue;
+		}
+		if (count <= 0) {
+			return -1;
+		}
+
+		bytes += count;
+		size -= count;
+	}
+
+	return 0;
+}
+
+int frame_write(int fd, uint8_t type, const void* data, size_t size) {
+	uint8_t header[FRAME_HEADER_SIZE];
+	header[0] = type;
+	frame_store(&header[1], size, 4);
+
+	if (send_all(fd, header, FRAME_HEADER_SIZE) != 0) {
+		return -1;
+	}
+
+	return size ? send_all(fd, data, size) : 0;
+}
+
+int frame_read_body(int fd, void* data, size_t size) {
+	uint8_t* bytes = (uint8_t*) data;
+
+	while (size > 0) {
+		ssize_t count = read(fd, bytes, size);
+		if (count < 0 && errno == EINTR) {
+			continue;
+		}
+		if (count <= 0) {
+			return -1;
+		}
+
+		bytes += count;
+		size -= count;
+	}
+
+	return 0;
+}
+
+int frame_read_header(int fd, uint8_t* type, uint32_t* size) {
+	uint8_t header[FRAME_HEADER_SIZE];
+
+	if (frame_read_body(fd, header, FRAME_HEADER_SIZE) != 0) {
+		return -1;
+	}
+
+	*type = header[0];
+	*size = frame_load(&header[1], 4);
+	return *size <= FRAME_MAX_SIZE ? 0 : -1;
+}
+
+int frame_read_stream(int fd, uint8_t type, frame_buffer* buffer, size_t limit) {
+	buffer->size = 0;
+
+	for (;;) {
+		uint8_t frame_type;
+		uint32_t size;
+
+		if (frame_read_header(fd, &frame_type, &size) != 0 || frame_type != type) {
+			return -1;
+		}
+
+		if (size == 0) {
+			return 0;
+		}
+
+		// the rest of the stream is left unread
+		if (size > limit - buffer->size) {
+			return 1;
+		}
+
+		// grow geometrically so reading stays linear, but never past limit
+		if (size > buffer->capacity - buffer->size) {
+			size_t capacity = buffer->capacity ? buffer->capacity : FRAME_MAX_SIZE;
+			while (size > capacity - buffer->size) {
+				capacity *= 2;
+			}
+			if (capacity > limit) {
+				capacity = limit;
+			}
+
+			uint8_t* data = (uint8_t*) realloc(buffer->data, capacity);
+			if (!data) {
+				return -1;
+			}
+
+			buffer->data = data;
+			buffer->capacity = capacity;
+		}
+
+		if (frame_read_body(fd, buffer->data + buffer->size, size) != 0) {
+			return -1;
+		}
+		buffer->size += size;
+	}
+}
+
+int frame_write_file(int fd, uint8_t type, FILE* file_ptr, size_t limit, uint8_t* block) {
+	while (limit > 0) {
+		size_t count = fread(block, 1, limit < FRAME_MAX_SIZE ? limit : FRAME_MAX_SIZE, file_ptr);
+		if (count == 0) {
+			break;
+		}
+
+		if (frame_write(fd, type, block, count) != 0) {
+			return -1;
+		}
+		limit -= count;
+	}
+
+	if (ferror(file_ptr)) {
+		return -1;
+	}
+
+	// an empty frame ends the stream
+	return frame_write(fd, type, NULL, 0);
+}
+
+int frame_write_file_fd(int fd, uint8_t type, int file_fd) {
+	if (file_fd < 0) {
+		return frame_write(fd, FRAME_FILE, NULL, 0);
+	}
+
+	uint8_t header[FRAME_HEADER_SIZE];
+	header[0] = FRAME_FILE;
+	frame_store(&header[1], 1, 4);
+
+	if (send_all(fd, header, FRAME_HEADER_SIZE) != 0) {
+		return -1;
+	}
+
+	// the descriptor travels with the byte of the frame, sent on its own so
+	// the header before it can be read without dropping it
+	union {
+		struct cmsghdr header;
+		char space[CMSG_SPACE(sizeof(int))];
+	} control = { 0 };
+
+	struct iovec iov = { .iov_base = &type, .iov_len = 1 };
+	struct msghdr message = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.space,
+		.msg_controllen = sizeof(control.space),
+	};
+
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &file_fd, sizeof(int));
+
+	ssize_t count;
+	do {
+		count = sendmsg(fd, &message, MSG_NOSIGNAL);
+	} while (count < 0 && errno == EINTR);
+
+	return count == 1 ? 0 : -1;
+}
+
+int frame_read_file_fd(int fd, uint8_t type, int* file_fd) {
+	uint8_t frame_type;
+	uint32_t size;
+
+	*file_fd = -1;
+
+	if (frame_read_header(fd, &frame_type, &size) != 0 || frame_type != FRAME_FILE || size > 1) {
+		return -1;
+	}
+
+	if (size == 0) {
+		return 0;
+	}
+
+	// room for more descriptors than expected, so extra ones can be closed
+	union {
+		struct cmsghdr header;
+		char space[CMSG_SPACE(4 * sizeof(int))];
+	} control;
+
+	uint8_t stream;
+	struct iovec iov = { .iov_base = &stream, .iov_len = 1 };
+	struct msghdr message = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.space,
+		.msg_controllen = sizeof(control.space),
+	};
+
+	ssize_t count;
+	do {
+		count = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+	} while (count < 0 && errno == EINTR);
+
+	if (count != 1) {
+		return -1;
+	}
+
+	for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+
+		size_t fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (size_t i = 0; i < fds; i++) {
+			int received;
+			memcpy(&received, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+
+			if (*file_fd < 0) {
+				*file_fd = received;
+			} else {
+				close(received);
+			}
+		}
+	}
+
+	if (*file_fd < 0 || stream != type || (message.msg_flags & MSG_CTRUNC)) {
+		if (*file_fd >= 0) {
+			close(*file_fd);
+			*file_fd = -1;
+		}
+		return -1;
+	}
+
+	return 0;
+}
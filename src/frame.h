@@ -0,0 +1,110 @@
+//===================== Copyright 2020, Jake Grossman =======================//
+//
+// Purpose: framed messages exchanged by the server and its clients
+//
+// Every message is a frame: a type byte, a 32-bit big-endian length and
+// that many bytes. A request starts with a FRAME_REQUEST frame, followed by
+// the streams the operation takes, each a run of frames of one type ended by
+// an empty frame of that type. The answer ends with a FRAME_STATUS frame,
+// after which the next request may be sent on the same connection.
+//
+//   embed    C... C  D... D   ->  O...  S
+//   extract  C... C           ->  N D...  S
+//   probe    C... C           ->  I  S
+//   stats                     ->  I  S
+//
+// Files on the same host may instead be passed as descriptors, in a
+// FRAME_FILE frame whose single byte is the type of the stream it replaces.
+// The server maps them instead of having their bytes copied through the
+// socket, and extracts straight into the file given for the payload:
+//
+//   embed    F(C) F(D) F(O)   ->  S
+//   extract  F(C)             ->  N  F(D)  ->  S
+//
+// An empty FRAME_FILE frame in place of F(D) cancels an extraction.
+//
+// This file is subject to the terms and conditions defined in the
+// file 'LICENSE.txt', which is part of this source code package
+//
+//===========================================================================//
+#ifndef CSTEG_FRAME_H
+#define CSTEG_FRAME_H
+
+#include <stdio.h> // FILE
+#include <stddef.h> // size_t
+#include <stdint.h> // uint8_t, uint32_t, uint64_t
+
+#define FRAME_HEADER_SIZE 5
+
+// most bytes a frame holds, streams are split into frames of this size
+#define FRAME_MAX_SIZE (1 << 20)
+
+// frame types
+#define FRAME_REQUEST 'Q' // operation, depth, alpha and compression bytes, then the payload name
+#define FRAME_CARRIER 'C' // bytes of the png the operation reads
+#define FRAME_DATA 'D' // bytes of the payload, embedded or extracted
+#define FRAME_NAME 'N' // name of the payload extracted
+#define FRAME_OUTPUT 'O' // bytes of the png written
+#define FRAME_INFO 'I' // result of a probe or of stats
+#define FRAME_STATUS 'S' // csteg_status byte, 64-bit microseconds spent on the server, then the error message
+#define FRAME_FILE 'F' // type of the stream replaced, sent with a file descriptor
+
+// operations of a request
+#define FRAME_OP_EMBED 'w'
+#define FRAME_OP_EXTRACT 'r'
+#define FRAME_OP_PROBE 'c'
+#define FRAME_OP_STATS 's'
+#define FRAME_OP_EMBED_FILES 'W' // embed with files passed as descriptors
+#define FRAME_OP_EXTRACT_FILES 'R' // extract with files passed as descriptors
+
+// sizes of the fixed parts of frames
+#define FRAME_REQUEST_SIZE 4 // before the payload name
+#define FRAME_STATUS_SIZE 9 // before the error message
+#define FRAME_PROBE_SIZE 11 // width, height, color type, bit depth and interlaced
+
+// bytes of a stream read into memory
+typedef struct {
+	uint8_t* data;
+	size_t size;
+	size_t capacity;
+} frame_buffer;
+
+// store and load size bytes of value in network byte order
+void frame_store(uint8_t* bytes, uint64_t value, size_t size);
+uint64_t frame_load(const uint8_t* bytes, size_t size);
+
+// write a frame of type holding size bytes of data. returns 0, or -1 if
+// the connection failed
+int frame_write(int fd, uint8_t type, const void* data, size_t size);
+
+// read the header of the next frame. returns 0, or -1 at the end of the
+// stream, if the connection failed or if the frame is larger than
+// FRAME_MAX_SIZE
+int frame_read_header(int fd, uint8_t* type, uint32_t* size);
+
+// read exactly size bytes of the frame whose header was read. returns 0,
+// or -1 if the connection failed
+int frame_read_body(int fd, void* data, size_t size);
+
+// read a stream of frames of type into buffer, replacing what it held,
+// until the empty frame ending it. returns 0, 1 if the stream holds more
+// than limit bytes, the frames past it being left unread, or -1 if the
+// connection failed, a frame of another type was sent or the buffer
+// couldn't grow
+int frame_read_stream(int fd, uint8_t type, frame_buffer* buffer, size_t limit);
+
+// write the contents of the file file_ptr as a stream of frames of type,
+// stopping after limit bytes. block holds FRAME_MAX_SIZE bytes. returns 0,
+// or -1 if the file couldn't be read or the connection failed
+int frame_write_file(int fd, uint8_t type, FILE* file_ptr, size_t limit, uint8_t* block);
+
+// pass the descriptor file_fd in place of the stream of type, or cancel
+// the stream if file_fd is -1. returns 0, or -1 if the connection failed
+int frame_write_file_fd(int fd, uint8_t type, int file_fd);
+
+// receive a descriptor passed in place of the stream of type, storing it in
+// *file_fd, or -1 if the stream was cancelled. returns 0, or -1 if the
+// connection failed or another frame was sent
+int frame_read_file_fd(int fd, uint8_t type, int* file_fd);
+
+#endif
@@ -0,0 +1,681 @@
+//===================== Copyright 2020, Jake Grossman =======================//
+//
+// Purpose: kernels moving payload bits in and out of color channels
+//
+// Every kernel is built for several instruction sets using function target
+// attributes, so one binary runs on any x86-64 cpu and picks the fastest
+// variant the cpu supports at startup. Each variant is written once for
+// any depth and instantiated for depths 1-4, so the compiler unrolls and
+// folds the shifts and masks of every depth into its own kernel.
+//
+// Kernels work on groups of 8 channels, which hold depth payload bytes.
+// Bits are stored most significant first, so the first channel of a group
+// holds the top bits of the first payload byte. Channels are either single
+// bytes or 16-bit big-endian samples, whose low (second) byte holds the
+// bits. Both sample sizes get their own kernels, so 16-bit samples are
+// never copied out of or back into the row.
+//
+// This file is subject to the terms and conditions defined in the
+// file 'LICENSE.txt', which is part of this source code package
+//
+//===========================================================================//
+#include <string.h> // memcpy, strcmp
+#include "kernel.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h> // SSE4.1, AVX2, AVX-512BW, BMI2
+#endif
+
+// helpers are always inlined into the depth-specific kernels below
+#define KERNEL_INLINE static inline __attribute__((always_inline))
+
+// word with the low depth bits of every byte set
+KERNEL_INLINE uint64_t lsb_mask(int depth) {
+	return ((1ULL << depth) - 1) * 0x0101010101010101ULL;
+}
+
+// spread the 8 * depth bits of a group over the low depth bits of 8 channel
+// bytes, first channel in the most significant byte
+KERNEL_INLINE uint64_t spread_bits(uint64_t x, int depth) {
+	x = (x | (x << (32 - 4 * depth))) & (((1ULL << (4 * depth)) - 1) * 0x0000000100000001ULL);
+	x = (x | (x << (16 - 2 * depth))) & (((1ULL << (2 * depth)) - 1) * 0x0001000100010001ULL);
+	x = (x | (x << (8 - depth))) & lsb_mask(depth);
+	return x;
+}
+
+// gather the low depth bits of 8 channel bytes into the 8 * depth bits of
+// a group, first channel in the most significant byte
+KERNEL_INLINE uint64_t gather_bits(uint64_t x, int depth) {
+	x &= lsb_mask(depth);
+	x = (x | (x >> (8 - depth))) & (((1ULL << (2 * depth)) - 1) * 0x0001000100010001ULL);
+	x = (x | (x >> (16 - 2 * depth))) & (((1ULL << (4 * depth)) - 1) * 0x0000000100000001ULL);
+	x = (x | (x >> (32 - 4 * depth))) & ((1ULL << (8 * depth)) - 1);
+	return x;
+}
+
+// load 8 channel bytes with the first channel in the most significant byte
+KERNEL_INLINE uint64_t load_be64(const uint8_t* ptr) {
+	uint64_t x;
+	memcpy(&x, ptr, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	x = __builtin_bswap64(x);
+#endif
+	return x;
+}
+
+// store 8 channel bytes with the first channel in the most significant byte
+KERNEL_INLINE void store_be64(uint8_t* ptr, uint64_t x) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	x = __builtin_bswap64(x);
+#endif
+	memcpy(ptr, &x, 8);
+}
+
+// mask of the low byte of every 16-bit big-endian sample in a word
+#define SAMPLE_LOW_BYTES 0x00FF00FF00FF00FFULL
+
+// spread 4 channel bytes over the low bytes of 4 16-bit samples
+KERNEL_INLINE uint64_t widen_channels(uint64_t x) {
+	x = (x | (x << 16)) & 0x0000FFFF0000FFFFULL;
+	x = (x | (x << 8)) & SAMPLE_LOW_BYTES;
+	return x;
+}
+
+// pack the low bytes of 4 16-bit samples into 4 channel bytes
+KERNEL_INLINE uint64_t narrow_channels(uint64_t x) {
+	x &= SAMPLE_LOW_BYTES;
+	x = (x | (x >> 8)) & 0x0000FFFF0000FFFFULL;
+	x = (x | (x >> 16)) & 0x00000000FFFFFFFFULL;
+	return x;
+}
+
+// replace the bits of mask in the 8 bytes at ptr with bits
+KERNEL_INLINE void merge_be64(uint8_t* ptr, uint64_t bits, uint64_t mask) {
+	store_be64(ptr, (load_be64(ptr) & ~mask) | bits);
+}
+
+// load the 8 channels of a group of samples of stride bytes, first channel
+// in the most significant byte
+KERNEL_INLINE uint64_t load_channels(const uint8_t* ptr, int stride) {
+	if (stride == 1) {
+		return load_be64(ptr);
+	}
+
+	return (narrow_channels(load_be64(ptr)) << 32) | narrow_channels(load_be64(ptr + 8));
+}
+
+// replace the low depth bits of the 8 channels of a group of samples of
+// stride bytes with chunks, first channel in the most significant byte
+KERNEL_INLINE void merge_channels(uint8_t* ptr, uint64_t chunks, int depth, int stride) {
+	if (stride == 1) {
+		merge_be64(ptr, chunks, lsb_mask(depth));
+		return;
+	}
+
+	merge_be64(ptr, widen_channels(chunks >> 32), lsb_mask(depth) & SAMPLE_LOW_BYTES);
+	merge_be64(ptr + 8, widen_channels(chunks & 0xFFFFFFFF), lsb_mask(depth) & SAMPLE_LOW_BYTES);
+}
+
+// load the depth payload bytes of a group, first byte most significant
+KERNEL_INLINE uint64_t load_group(const uint8_t* payload, int depth) {
+	uint64_t x = 0;
+	for (int j = 0; j < depth; j++) {
+		x = (x << 8) | payload[j];
+	}
+	return x;
+}
+
+// store the depth payload bytes of a group, first byte most significant
+KERNEL_INLINE void store_group(uint8_t* payload, uint64_t x, int depth) {
+	for (int j = depth - 1; j >= 0; j--) {
+		payload[j] = x;
+		x >>= 8;
+	}
+}
+
+//===========================================================================//
+// SWAR, portable and used for whatever the vector loops leave over
+//===========================================================================//
+
+KERNEL_INLINE void embed_swar(uint8_t* channels, const uint8_t* payload, size_t groups, int depth, int stride) {
+	for (size_t i = 0; i < groups; i++) {
+		uint64_t chunks = spread_bits(load_group(&payload[i * depth], depth), depth);
+		merge_channels(&channels[i * 8 * stride], chunks, depth, stride);
+	}
+}
+
+KERNEL_INLINE void extract_swar(const uint8_t* channels, uint8_t* payload, size_t groups, int depth, int stride) {
+	for (size_t i = 0; i < groups; i++) {
+		store_group(&payload[i * depth], gather_bits(load_channels(&channels[i * 8 * stride], stride), depth), depth);
+	}
+}
+
+// instantiate the embed and extract kernels of a variant for every sample
+// size and depth
+#define DEPTH_KERNELS(variant, attributes) \
+	SAMPLE_KERNELS(variant, attributes, 1) \
+	SAMPLE_KERNELS(variant, attributes, 2)
+
+#define SAMPLE_KERNELS(variant, attributes, bytes) \
+	DEPTH_KERNEL(variant, attributes, bytes, 1) \
+	DEPTH_KERNEL(variant, attributes, bytes, 2) \
+	DEPTH_KERNEL(variant, attributes, bytes, 3) \
+	DEPTH_KERNEL(variant, attributes, bytes, 4)
+
+#define DEPTH_KERNEL(variant, attributes, bytes, depth) \
+	attributes static void embed_##variant##_##bytes##_##depth(uint8_t* channels, const uint8_t* payload, size_t groups) { \
+		embed_##variant(channels, payload, groups, depth, bytes); \
+	} \
+	attributes static void extract_##variant##_##bytes##_##depth(const uint8_t* channels, uint8_t* payload, size_t groups) { \
+		extract_##variant(channels, payload, groups, depth, bytes); \
+	}
+
+// table entries for the kernels instantiated by DEPTH_KERNELS
+#define DEPTH_TABLE(variant) \
+	{ SAMPLE_TABLE(embed_##variant##_1), SAMPLE_TABLE(embed_##variant##_2) }, \
+	{ SAMPLE_TABLE(extract_##variant##_1), SAMPLE_TABLE(extract_##variant##_2) }
+
+#define SAMPLE_TABLE(kernel) { kernel##_1, kernel##_2, kernel##_3, kernel##_4 }
+
+DEPTH_KERNELS(swar, )
+
+#if defined(__x86_64__)
+
+//===========================================================================//
+// BMI2, PDEP/PEXT move the bits of a whole group in one instruction
+//===========================================================================//
+
+// 16-bit samples deposit each half of a group straight into the low bytes
+// of 4 samples
+
+__attribute__((target("bmi2")))
+KERNEL_INLINE void embed_bmi2(uint8_t* channels, const uint8_t* payload, size_t groups, int depth, int stride) {
+	for (size_t i = 0; i < groups; i++) {
+		uint64_t group = load_group(&payload[i * depth], depth);
+		uint8_t* channel = &channels[i * 8 * stride];
+
+		if (stride == 1) {
+			merge_be64(channel, _pdep_u64(group, lsb_mask(depth)), lsb_mask(depth));
+		} else {
+			uint64_t mask = lsb_mask(depth) & SAMPLE_LOW_BYTES;
+			merge_be64(channel, _pdep_u64(group >> (4 * depth), mask), mask);
+			merge_be64(channel + 8, _pdep_u64(group, mask), mask);
+		}
+	}
+}
+
+__attribute__((target("bmi2")))
+KERNEL_INLINE void extract_bmi2(const uint8_t* channels, uint8_t* payload, size_t groups, int depth, int stride) {
+	for (size_t i = 0; i < groups; i++) {
+		const uint8_t* channel = &channels[i * 8 * stride];
+		uint64_t group;
+
+		if (stride == 1) {
+			group = _pext_u64(load_be64(channel), lsb_mask(depth));
+		} else {
+			uint64_t mask = lsb_mask(depth) & SAMPLE_LOW_BYTES;
+			group = (_pext_u64(load_be64(channel), mask) << (4 * depth)) | _pext_u64(load_be64(channel + 8), mask);
+		}
+
+		store_group(&payload[i * depth], group, depth);
+	}
+}
+
+DEPTH_KERNELS(bmi2, __attribute__((target("bmi2"))))
+
+//===========================================================================//
+// vector kernels
+//
+// embedding repeats every payload byte once per channel it is spread over
+// (8 / depth times) with pshufb, then shifts each copy so its bits land at
+// the bottom of the byte. 16-bit shifts are fine since only bits from
+// within the same byte are kept.
+//
+// extraction masks the chunks and combines neighbours with multiply-adds
+// until every lane holds a payload byte, then narrows the lanes. depth 1
+// uses movemask instead, after reversing each group of 8 channels so the
+// first channel lands in the most significant bit.
+//
+// depth 3 groups don't line up with vector lanes and use BMI2 (or SWAR for
+// SSE4.1, which doesn't imply BMI2) instead.
+//
+// 16-bit samples are packed into channel bytes by shifting the low byte of
+// every sample down and narrowing, and widened back by zero extending
+// channel bytes and shifting them into the low byte of each sample. the
+// rest of the kernel is the same as for 8-bit channels.
+//===========================================================================//
+
+// pshufb indices repeating byte offset + (first + j) / copies for j = 0-7
+KERNEL_INLINE int64_t repeat_indices(int first, int copies, int offset) {
+	uint64_t x = 0;
+	for (int j = 0; j < 8; j++) {
+		x |= (uint64_t) (offset + (first + j) / copies) << (j * 8);
+	}
+	return (int64_t) x;
+}
+
+// word with the low depth bits of every byte holding copy k set
+KERNEL_INLINE int64_t copy_mask(int k, int depth) {
+	uint64_t x = 0;
+	for (int j = 0; j < 8; j++) {
+		if (j % (8 / depth) == k) {
+			x |= ((1ULL << depth) - 1) << (j * 8);
+		}
+	}
+	return (int64_t) x;
+}
+
+// pshufb indices reversing every group of 8 bytes
+#define REVERSE_GROUPS 0x08090A0B0C0D0E0FLL, 0x0001020304050607LL
+
+// multipliers combining neighbouring chunks of depth 1, 2 and 4
+#define PAIR_WEIGHTS(depth) ((1 << (depth)) | 0x0100)
+#define NIBBLE_WEIGHTS 0x00010010
+
+//===========================================================================//
+// SSE4.1, 16 channel bytes per vector
+//===========================================================================//
+
+__attribute__((target("sse4.1")))
+KERNEL_INLINE __m128i chunks_sse41(__m128i repeated, int depth) {
+	__m128i chunks = _mm_setzero_si128();
+	for (int k = 0; k < 8 / depth; k++) {
+		__m128i shifted = _mm_srli_epi16(repeated, (8 / depth - 1 - k) * depth);
+		chunks = _mm_or_si128(chunks, _mm_and_si128(shifted, _mm_set1_epi64x(copy_mask(k, depth))));
+	}
+	return chunks;
+}
+
+// load the 16 channels at ptr
+__attribute__((target("sse4.1")))
+KERNEL_INLINE __m128i load_channels_sse41(const uint8_t* ptr, int stride) {
+	if (stride == 1) {
+		return _mm_loadu_si128((const __m128i*) ptr);
+	}
+
+	__m128i low = _mm_srli_epi16(_mm_loadu_si128((const __m128i*) ptr), 8);
+	__m128i high = _mm_srli_epi16(_mm_loadu_si128((const __m128i*) (ptr + 16)), 8);
+	return _mm_packus_epi16(low, high);
+}
+
+// replace the low depth bits of the 16 channels at ptr with chunks
+__attribute__((target("sse4.1")))
+KERNEL_INLINE void merge_channels_sse41(uint8_t* ptr, __m128i chunks, int depth, int stride) {
+	__m128i* dst = (__m128i*) ptr;
+
+	if (stride == 1) {
+		__m128i keep = _mm_set1_epi64x(~lsb_mask(depth));
+		_mm_storeu_si128(dst, _mm_or_si128(_mm_and_si128(_mm_loadu_si128(dst), keep), chunks));
+		return;
+	}
+
+	__m128i keep = _mm_set1_epi16(~(((1 << depth) - 1) << 8));
+	__m128i low = _mm_slli_epi16(_mm_cvtepu8_epi16(chunks), 8);
+	__m128i high = _mm_slli_epi16(_mm_cvtepu8_epi16(_mm_srli_si128(chunks, 8)), 8);
+	_mm_storeu_si128(dst, _mm_or_si128(_mm_and_si128(_mm_loadu_si128(dst), keep), low));
+	_mm_storeu_si128(dst + 1, _mm_or_si128(_mm_and_si128(_mm_loadu_si128(dst + 1), keep), high));
+}
+
+__attribute__((target("sse4.1")))
+KERNEL_INLINE void embed_sse41(uint8_t* channels, const uint8_t* payload, size_t groups, int depth, int stride) {
+	size_t i = 0;
+
+	if (depth != 3) {
+		const __m128i repeat = _mm_set_epi64x(repeat_indices(8, 8 / depth, 0), repeat_indices(0, 8 / depth, 0));
+
+		// 2 groups per iteration
+		for (; i + 2 <= groups; i += 2) {
+			uint64_t bytes = 0;
+			memcpy(&bytes, &payload[i * depth], 2 * depth);
+
+			__m128i chunks = chunks_sse41(_mm_shuffle_epi8(_mm_cvtsi64_si128(bytes), repeat), depth);
+			merge_channels_sse41(&channels[i * 8 * stride], chunks, depth, stride);
+		}
+	}
+
+	embed_swar(&channels[i * 8 * stride], &payload[i * depth], groups - i, depth, stride);
+}
+
+__attribute__((target("sse4.1")))
+KERNEL_INLINE void extract_sse41(const uint8_t* channels, uint8_t* payload, size_t groups, int depth, int stride) {
+	size_t i = 0;
+
+	if (depth != 3) {
+		// 2 groups per iteration
+		for (; i + 2 <= groups; i += 2) {
+			__m128i channel = load_channels_sse41(&channels[i * 8 * stride], stride);
+			uint64_t bytes;
+
+			if (depth == 1) {
+				__m128i reversed = _mm_shuffle_epi8(channel, _mm_set_epi64x(REVERSE_GROUPS));
+				bytes = (uint64_t) _mm_movemask_epi8(_mm_slli_epi16(reversed, 7));
+			} else {
+				__m128i chunks = _mm_and_si128(channel, _mm_set1_epi8((1 << depth) - 1));
+				__m128i lanes = _mm_maddubs_epi16(chunks, _mm_set1_epi16(PAIR_WEIGHTS(depth)));
+
+				// depth 4 holds a byte in every 16-bit lane, depth 2 needs another step
+				__m128i narrow = _mm_set_epi64x(-1, 0x0E0C0A0806040200LL);
+				if (depth == 2) {
+					lanes = _mm_madd_epi16(lanes, _mm_set1_epi32(NIBBLE_WEIGHTS));
+					narrow = _mm_set_epi64x(-1, 0xFFFFFFFF0C080400LL);
+				}
+
+				bytes = (uint64_t) _mm_cvtsi128_si64(_mm_shuffle_epi8(lanes, narrow));
+			}
+
+			memcpy(&payload[i * depth], &bytes, 2 * depth);
+		}
+	}
+
+	extract_swar(&channels[i * 8 * stride], &payload[i * depth], groups - i, depth, stride);
+}
+
+DEPTH_KERNELS(sse41, __attribute__((target("sse4.1"))))
+
+//===========================================================================//
+// AVX2, 32 channel bytes per vector
+//===========================================================================//
+
+__attribute__((target("avx2,bmi2")))
+KERNEL_INLINE __m256i chunks_avx2(__m256i repeated, int depth) {
+	__m256i chunks = _mm256_setzero_si256();
+	for (int k = 0; k < 8 / depth; k++) {
+		__m256i shifted = _mm256_srli_epi16(repeated, (8 / depth - 1 - k) * depth);
+		chunks = _mm256_or_si256(chunks, _mm256_and_si256(shifted, _mm256_set1_epi64x(copy_mask(k, depth))));
+	}
+	return chunks;
+}
+
+// load the 32 channels at ptr
+__attribute__((target("avx2,bmi2")))
+KERNEL_INLINE __m256i load_channels_avx2(const uint8_t* ptr, int stride) {
+	if (stride == 1) {
+		return _mm256_loadu_si256((const __m256i*) ptr);
+	}
+
+	// packing works within 128-bit lanes, so the qwords end up interleaved
+	__m256i low = _mm256_srli_epi16(_mm256_loadu_si256((const __m256i*) ptr), 8);
+	__m256i high = _mm256_srli_epi16(_mm256_loadu_si256((const __m256i*) (ptr + 32)), 8);
+	return _mm256_permute4x64_epi64(_mm256_packus_epi16(low, high), 0xD8);
+}
+
+// replace the low depth bits of the 32 channels at ptr with chunks
+__attribute__((target("avx2,bmi2")))
+KERNEL_INLINE void merge_channels_avx2(uint8_t* ptr, __m256i chunks, int depth, int stride) {
+	__m256i* dst = (__m256i*) ptr;
+
+	if (stride == 1) {
+		__m256i keep = _mm256_set1_epi64x(~lsb_mask(depth));
+		_mm256_storeu_si256(dst, _mm256_or_si256(_mm256_and_si256(_mm256_loadu_si256(dst), keep), chunks));
+		return;
+	}
+
+	__m256i keep = _mm256_set1_epi16(~(((1 << depth) - 1) << 8));
+	__m256i low = _mm256_slli_epi16(_mm256_cvtepu8_epi16(_mm256_castsi256_si128(chunks)), 8);
+	__m256i high = _mm256_slli_epi16(_mm256_cvtepu8_epi16(_mm256_extracti128_si256(chunks, 1)), 8);
+	_mm256_storeu_si256(dst, _mm256_or_si256(_mm256_and_si256(_mm256_loadu_si256(dst), keep), low));
+	_mm256_storeu_si256(dst + 1, _mm256_or_si256(_mm256_and_si256(_mm256_loadu_si256(dst + 1), keep), high));
+}
+
+__attribute__((target("avx2,bmi2")))
+KERNEL_INLINE void embed_avx2(uint8_t* channels, const uint8_t* payload, size_t groups, int depth, int stride) {
+	size_t i = 0;
+
+	if (depth != 3) {
+		// both lanes get all payload bytes, the high lane repeats the second half
+		const __m256i repeat = _mm256_setr_epi64x(
+			repeat_indices(0, 8 / depth, 0), repeat_indices(8, 8 / depth, 0),
+			repeat_indices(16, 8 / depth, 0), repeat_indices(24, 8 / depth, 0));
+
+		// 4 groups per iteration
+		for (; i + 4 <= groups; i += 4) {
+			__m128i bytes = _mm_setzero_si128();
+			memcpy(&bytes, &payload[i * depth], 4 * depth);
+
+			__m256i repeated = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(bytes), repeat);
+			merge_channels_avx2(&channels[i * 8 * stride], chunks_avx2(repeated, depth), depth, stride);
+		}
+	}
+
+	embed_bmi2(&channels[i * 8 * stride], &payload[i * depth], groups - i, depth, stride);
+}
+
+__attribute__((target("avx2,bmi2")))
+KERNEL_INLINE void extract_avx2(const uint8_t* channels, uint8_t* payload, size_t groups, int depth, int stride) {
+	size_t i = 0;
+
+	if (depth != 3) {
+		// 4 groups per iteration
+		for (; i + 4 <= groups; i += 4) {
+			__m256i channel = load_channels_avx2(&channels[i * 8 * stride], stride);
+			__m128i bytes;
+
+			if (depth == 1) {
+				__m256i reversed = _mm256_shuffle_epi8(channel, _mm256_set_epi64x(REVERSE_GROUPS, REVERSE_GROUPS));
+				bytes = _mm_cvtsi32_si128(_mm256_movemask_epi8(_mm256_slli_epi16(reversed, 7)));
+			} else {
+				__m256i chunks = _mm256_and_si256(channel, _mm256_set1_epi8((1 << depth) - 1));
+				__m256i lanes = _mm256_maddubs_epi16(chunks, _mm256_set1_epi16(PAIR_WEIGHTS(depth)));
+
+				// narrow within each 128-bit lane, then join the lanes
+				__m256i narrow = _mm256_set_epi64x(-1, 0x0E0C0A0806040200LL, -1, 0x0E0C0A0806040200LL);
+				__m256i join = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+				if (depth == 2) {
+					lanes = _mm256_madd_epi16(lanes, _mm256_set1_epi32(NIBBLE_WEIGHTS));
+					narrow = _mm256_set_epi64x(-1, 0xFFFFFFFF0C080400LL, -1, 0xFFFFFFFF0C080400LL);
+					join = _mm256_setr_epi32(0, 4, 1, 2, 3, 5, 6, 7);
+				}
+
+				__m256i packed = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(lanes, narrow), join);
+				bytes = _mm256_castsi256_si128(packed);
+			}
+
+			memcpy(&payload[i * depth], &bytes, 4 * depth);
+		}
+	}
+
+	extract_bmi2(&channels[i * 8 * stride], &payload[i * depth], groups - i, depth, stride);
+}
+
+DEPTH_KERNELS(avx2, __attribute__((target("avx2,bmi2"))))
+
+//===========================================================================//
+// AVX-512BW, 64 channel bytes per vector
+//===========================================================================//
+
+// load the 64 channels at ptr
+__attribute__((target("avx512f,avx512bw,bmi2")))
+KERNEL_INLINE __m512i load_channels_avx512bw(const uint8_t* ptr, int stride) {
+	if (stride == 1) {
+		return _mm512_loadu_si512(ptr);
+	}
+
+	__m256i low = _mm512_cvtepi16_epi8(_mm512_srli_epi16(_mm512_loadu_si512(ptr), 8));
+	__m256i high = _mm512_cvtepi16_epi8(_mm512_srli_epi16(_mm512_loadu_si512(ptr + 64), 8));
+	return _mm512_inserti64x4(_mm512_castsi256_si512(low), high, 1);
+}
+
+// replace the low depth bits of the 64 channels at ptr with chunks
+__attribute__((target("avx512f,avx512bw,bmi2")))
+KERNEL_INLINE void merge_channels_avx512bw(uint8_t* ptr, __m512i chunks, int depth, int stride) {
+	if (stride == 1) {
+		__m512i keep = _mm512_set1_epi64(~lsb_mask(depth));
+		_mm512_storeu_si512(ptr, _mm512_or_si512(_mm512_and_si512(_mm512_loadu_si512(ptr), keep), chunks));
+		return;
+	}
+
+	__m512i keep = _mm512_set1_epi16(~(((1 << depth) - 1) << 8));
+	__m512i low = _mm512_slli_epi16(_mm512_cvtepu8_epi16(_mm512_castsi512_si256(chunks)), 8);
+	__m512i high = _mm512_slli_epi16(_mm512_cvtepu8_epi16(_mm512_extracti64x4_epi64(chunks, 1)), 8);
+	_mm512_storeu_si512(ptr, _mm512_or_si512(_mm512_and_si512(_mm512_loadu_si512(ptr), keep), low));
+	_mm512_storeu_si512(ptr + 64, _mm512_or_si512(_mm512_and_si512(_mm512_loadu_si512(ptr + 64), keep), high));
+}
+
+__attribute__((target("avx512f,avx512bw,bmi2")))
+KERNEL_INLINE void embed_avx512bw(uint8_t* channels, const uint8_t* payload, size_t groups, int depth, int stride) {
+	size_t i = 0;
+
+	if (depth != 3) {
+		// 128-bit lane l covers payload bytes from 2 * depth * l on, so it
+		// gets the two qwords starting at the one holding that byte
+		const __m512i qwords = _mm512_setr_epi64(
+			0, 1, 2 * depth / 8, 2 * depth / 8 + 1,
+			4 * depth / 8, 4 * depth / 8 + 1, 6 * depth / 8, 6 * depth / 8 + 1);
+		const __m512i repeat = _mm512_setr_epi64(
+			repeat_indices(0, 8 / depth, 0), repeat_indices(8, 8 / depth, 0),
+			repeat_indices(0, 8 / depth, 2 * depth % 8), repeat_indices(8, 8 / depth, 2 * depth % 8),
+			repeat_indices(0, 8 / depth, 4 * depth % 8), repeat_indices(8, 8 / depth, 4 * depth % 8),
+			repeat_indices(0, 8 / depth, 6 * depth % 8), repeat_indices(8, 8 / depth, 6 * depth % 8));
+		const __mmask64 load_mask = (1ULL << (8 * depth)) - 1;
+
+		// 8 groups per iteration
+		for (; i + 8 <= groups; i += 8) {
+			__m512i bytes = _mm512_maskz_loadu_epi8(load_mask, &payload[i * depth]);
+			__m512i repeated = _mm512_shuffle_epi8(_mm512_permutexvar_epi64(qwords, bytes), repeat);
+
+			__m512i chunks = _mm512_setzero_si512();
+			for (int k = 0; k < 8 / depth; k++) {
+				__m512i shifted = _mm512_srli_epi16(repeated, (8 / depth - 1 - k) * depth);
+				chunks = _mm512_or_si512(chunks, _mm512_and_si512(shifted, _mm512_set1_epi64(copy_mask(k, depth))));
+			}
+
+			merge_channels_avx512bw(&channels[i * 8 * stride], chunks, depth, stride);
+		}
+	}
+
+	embed_bmi2(&channels[i * 8 * stride], &payload[i * depth], groups - i, depth, stride);
+}
+
+__attribute__((target("avx512f,avx512bw,bmi2")))
+KERNEL_INLINE void extract_avx512bw(const uint8_t* channels, uint8_t* payload, size_t groups, int depth, int stride) {
+	size_t i = 0;
+
+	if (depth != 3) {
+		// 8 groups per iteration
+		for (; i + 8 <= groups; i += 8) {
+			__m512i channel = load_channels_avx512bw(&channels[i * 8 * stride], stride);
+
+			if (depth == 1) {
+				__m512i reversed = _mm512_shuffle_epi8(channel, _mm512_set_epi64(REVERSE_GROUPS, REVERSE_GROUPS, REVERSE_GROUPS, REVERSE_GROUPS));
+				uint64_t bytes = _mm512_test_epi8_mask(reversed, _mm512_set1_epi8(1));
+				memcpy(&payload[i * depth], &bytes, 8);
+				continue;
+			}
+
+			__m512i chunks = _mm512_and_si512(channel, _mm512_set1_epi8((1 << depth) - 1));
+			__m512i lanes = _mm512_maddubs_epi16(chunks, _mm512_set1_epi16(PAIR_WEIGHTS(depth)));
+
+			// narrow every lane to its low byte
+			if (depth == 2) {
+				lanes = _mm512_madd_epi16(lanes, _mm512_set1_epi32(NIBBLE_WEIGHTS));
+				_mm_storeu_si128((__m128i*) &payload[i * depth], _mm512_cvtepi32_epi8(lanes));
+			} else {
+				_mm256_storeu_si256((__m256i*) &payload[i * depth], _mm512_cvtepi16_epi8(lanes));
+			}
+		}
+	}
+
+	extract_bmi2(&channels[i * 8 * stride], &payload[i * depth], groups - i, depth, stride);
+}
+
+DEPTH_KERNELS(avx512bw, __attribute__((target("avx512f,avx512bw,bmi2"))))
+
+// __builtin_cpu_supports only takes string literals, so every variant gets
+// its own check
+static int supports_bmi2(void) {
+	return __builtin_cpu_supports("bmi2");
+}
+
+static int supports_sse41(void) {
+	return __builtin_cpu_supports("sse4.1");
+}
+
+static int supports_avx2(void) {
+	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2");
+}
+
+static int supports_avx512bw(void) {
+	return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+	       __builtin_cpu_supports("bmi2");
+}
+
+#endif
+
+//===========================================================================//
+// dispatch
+//===========================================================================//
+
+// a set of kernels built for one instruction set, indexed by bytes per
+// sample - 1 and depth - 1
+typedef struct {
+	const char* name; // name accepted by select_kernel
+	int (*supported)(void); // whether the cpu can run the kernels, NULL if always
+	void (*embed[2][4])(uint8_t* channels, const uint8_t* payload, size_t groups);
+	void (*extract[2][4])(const uint8_t* channels, uint8_t* payload, size_t groups);
+} kernel_variant;
+
+// available variants, fastest first
+static const kernel_variant variants[] = {
+#if defined(__x86_64__)
+	{ "avx512bw", supports_avx512bw, DEPTH_TABLE(avx512bw) },
+	{ "avx2", supports_avx2, DEPTH_TABLE(avx2) },
+	{ "sse4.1", supports_sse41, DEPTH_TABLE(sse41) },
+	{ "bmi2", supports_bmi2, DEPTH_TABLE(bmi2) },
+#endif
+	{ "swar", NULL, DEPTH_TABLE(swar) },
+};
+
+#define VARIANT_COUNT (sizeof(variants) / sizeof(variants[0]))
+
+// variant in use, set by select_kernel. accessed atomically since kernels
+// run from any thread, and the first one to run may pick the default
+static const kernel_variant* current_variant = NULL;
+
+int select_kernel(const char* name) {
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+#endif
+
+	for (size_t i = 0; i < VARIANT_COUNT; i++) {
+		// without a name, take the first (fastest) supported variant
+		if (name && strcmp(name, variants[i].name) != 0) {
+			continue;
+		}
+
+		if (variants[i].supported && !variants[i].supported()) {
+			if (name) {
+				return -1;
+			}
+			continue;
+		}
+
+		__atomic_store_n(&current_variant, &variants[i], __ATOMIC_RELEASE);
+		return 0;
+	}
+
+	return -1;
+}
+
+const char* kernel_name(size_t index) {
+	return index < VARIANT_COUNT ? variants[index].name : NULL;
+}
+
+// variant in use, selecting the default on first use
+static const kernel_variant* active_variant(void) {
+	const kernel_variant* variant = __atomic_load_n(&current_variant, __ATOMIC_ACQUIRE);
+
+	if (!variant) {
+		select_kernel(NULL);
+		variant = __atomic_load_n(&current_variant, __ATOMIC_ACQUIRE);
+	}
+
+	return variant;
+}
+
+void embed_kernel(int depth, int sample_bytes, uint8_t* channels, const uint8_t* payload, size_t groups) {
+	active_variant()->embed[sample_bytes - 1][depth - 1](channels, payload, groups);
+}
+
+void extract_kernel(int depth, int sample_bytes, const uint8_t* channels, uint8_t* payload, size_t groups) {
+	active_variant()->extract[sample_bytes - 1][depth - 1](channels, payload, groups);
+}
@@ -0,0 +1,39 @@
+//===================== Copyright 2020, Jake Grossman =======================//
+//
+// Purpose: kernels moving payload bits in and out of color channels
+//
+// This file is subject to the terms and conditions defined in the
+// file 'LICENSE.txt', which is part of this source code package
+//
+//===========================================================================//
+#ifndef CSTEG_KERNEL_H
+#define CSTEG_KERNEL_H
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint8_t
+#include "csteg.h" // CSTEG_MIN_DEPTH, CSTEG_MAX_DEPTH
+
+// the least and most bits stored in each channel
+#define MIN_DEPTH CSTEG_MIN_DEPTH
+#define MAX_DEPTH CSTEG_MAX_DEPTH
+
+// embed groups * depth bytes of payload into the depth least significant
+// bits of 8 * groups consecutive channels, most significant bits first.
+// channels are 1 byte or 16-bit big-endian samples of 2 bytes
+void embed_kernel(int depth, int sample_bytes, uint8_t* channels, const uint8_t* payload, size_t groups);
+
+// extract groups * depth bytes of payload from the depth least significant
+// bits of 8 * groups consecutive channels, most significant bits first.
+// channels are 1 byte or 16-bit big-endian samples of 2 bytes
+void extract_kernel(int depth, int sample_bytes, const uint8_t* channels, uint8_t* payload, size_t groups);
+
+// select the kernel variant called by embed_kernel and extract_kernel.
+// with a NULL name, the fastest variant supported by the cpu is used.
+// returns -1 if the variant does not exist or the cpu can't run it. the
+// selection is shared by every thread
+int select_kernel(const char* name);
+
+// name of the variant at index, fastest first, NULL past the last one
+const char* kernel_name(size_t index);
+
+#endif
@@ -10,528 +10,456 @@
 #include <stdarg.h> // va_list, va_start, va_end
 #include <stdlib.h> // malloc
 #include <stdint.h> // uint8_t
-#include <string.h> // strlen
-#include <unistd.h> // getopt, access
-#include <png.h> // libpng
-
-// the number of bits used to store sizes in the signature
-#define SIG_SIZE_BITS 32
-
-// print message to stderr and abort
-void abort_msg(const char* fmt, ...) {
+#include <string.h> // strcmp
+#include <unistd.h> // access
+#include <sys/stat.h> // stat
+#include <getopt.h> // getopt_long
+#include "csteg.h"
+#include "pool.h"
+#include "batch.h"
+#include "shard.h"
+#include "carriers.h"
+#include "server.h"
+#include "client.h"
+#include "cache.h"
+
+// size of the blocks extracted data is written in
+#define EXTRACT_BLOCK_SIZE (1 << 20)
+
+// payload found in a png by list_task
+typedef struct {
+	char* name; // name of the payload, NULL if the png could not be read
+	size_t size; // size of the payload in bytes
+	int sharded; // whether the png holds a shard of the payload
+	csteg_shard shard;
+	char* error; // why the png could not be read, NULL if it was
+} list_entry;
+
+// pngs listed by every thread of a pool
+typedef struct {
+	char** filenames;
+	list_entry* entries;
+	size_t count;
+	size_t next; // index of the next png to be listed, taken atomically
+} list_job;
+
+// names of the compression profiles, in csteg_compression order
+const char* compression_names[] = { "default", "fast", "max", "store" };
+
+// names of the color types data can be stored in, indexed by png color type
+const char* color_type_names[] = { "gray", NULL, "rgb", NULL, "gray_alpha", NULL, "rgba" };
+
+// print message to stderr and exit with a failure status
+void exit_msg(const char* fmt, ...) {
 	va_list args;
 	va_start(args, fmt);
 	vfprintf(stderr, fmt, args);
 	fprintf(stderr,	"\n");
 	va_end(args);
-	abort();
+	exit(1);
 }
 
 void print_usage() {
-	printf("Usage: csteg [-f] -w -i png_in -d data_file_in -o png_out\n");
-	printf("       csteg [-f] -r -i png_in\n");
+	printf("Usage: csteg [-f] [-j threads] [--kernel=name] -w [-a] [-b bits] [--compress=profile] -i png_in -d data_file_in -o png_out\n");
+	printf("       csteg [-f] [-j threads] [--kernel=name] -r -i png_in\n");
+	printf("       csteg [-f] [-j threads] [--kernel=name] -w [-a] [-b bits] [--compress=profile] -d data_file_in -o png_out png_in...\n");
+	printf("       csteg [-f] [-j threads] [--kernel=name] -r png_in...\n");
+	printf("       csteg [-f] [-j threads] [--kernel=name] -w [-a] [-b bits] [--compress=profile] --carrier-pool=dir -d data_file_in -o png_out\n");
+	printf("       csteg [-j threads] --index=dir\n");
+	printf("       csteg [-f] --precook png_in raw_out\n");
+	printf("       csteg -c [-d data_file] -i png_in\n");
+	printf("       csteg -c [-d data_file] png_in...\n");
+	printf("       csteg [-f] [-j threads] [-a] [-b bits] [--compress=profile] [--cache=MiB] --batch=manifest\n");
+	printf("       csteg -l -i png_in\n");
+	printf("       csteg [-j threads] -l png_in...\n");
+	printf("       csteg [-j threads] [--cache=MiB] --serve=socket\n");
+	printf("       csteg [-f] [-a] [-b bits] [--compress=profile] --client=socket -w -i png_in -d data_file_in -o png_out\n");
+	printf("       csteg [-f] --client=socket -r -i png_in\n");
+	printf("       csteg --client=socket -c [-d data_file] -i png_in\n");
+	printf("       csteg --client=socket --stats\n");
+
+	// list kernel variants, fastest first
+	printf("Kernels:");
+	for (size_t i = 0; csteg_kernel_name(i); i++) {
+		printf(" %s", csteg_kernel_name(i));
+	}
+	printf("\n");
+
+	// list compression profiles
+	printf("Compression profiles:");
+	for (size_t i = 0; i < sizeof(compression_names) / sizeof(compression_names[0]); i++) {
+		printf(" %s", compression_names[i]);
+	}
+	printf("\n");
 }
 
-// global image variables
-size_t width, height; // width and height of png
-png_byte color_type; // color type of png
-png_byte bit_depth; // bit depth of png
-int number_of_passes;
-
-png_bytep* row_pointers; // raw pixel info
-
-// returns row_pointers of specified png file
-void read_png_file(char* filename) {
-	// open file
-	FILE *file_ptr = fopen(filename, "rb");
-
-	// check that file_ptr exists
-	if (!file_ptr) {
-		abort_msg("read_png_file() : File %s could not be opened for reading", filename);
-	}
-
-	// test that file is png
-	unsigned char header[8];
+void confirm_file_overwrite(const char* filename) {
+	char response;
+	do {
+		printf("File %s already exists. Would you like to overwrite it (y/N)? ", filename);
+		scanf("%c", &response);
+		printf("\n");
 
-	// copy first 8 bytes of file
-	fread(header, 1 , 8, file_ptr);
+		// flush rest of input to avoid multiple responses
+		fflush(stdin);
+	} while (response != 'y' && response != 'Y' && response != 'n' && response != 'N' && response != EOF);
 
-	// validate
-	int is_png = !png_sig_cmp(header, 0, 8);
-	if (!is_png) {
-		abort_msg("read_png_file() : File %s is not recognized as a PNG file", filename);
+	if (response == 'N' || response == 'n') {
+		exit_msg("user exit");
 	}
+}
 
-	// png and info pointers
-	png_structp png_ptr; // png struct
-	png_infop info_ptr; // png info struct
-
-	// initialize variables
-	png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-
-	// check that png_ptr was created successfully
-	if (!png_ptr) {
-		abort_msg("read_png_file() : png_create_read_struct failed");
+void write_data(csteg_ctx* ctx, char* png_filename_in, char* png_filename_out, char* data_filename, int force_flag) {
+	// check if output file exists
+	if (access(png_filename_out, F_OK) != -1) {
+		// if exists and force flag isn't set, check that the user wants to override it
+		if (!force_flag) {
+			confirm_file_overwrite(png_filename_out);
+		}
 	}
 
-	info_ptr = png_create_info_struct(png_ptr);
-
-	// check that info_ptr was created successfully
-	if (!info_ptr) {
-		abort_msg("read_png_file() : png_create_info_struct failed");
+	if (csteg_embed_file(ctx, png_filename_in, data_filename, png_filename_out) != CSTEG_OK) {
+		exit_msg("%s", csteg_ctx_error(ctx));
 	}
+}
 
-	// set jump buffer for png_init_io to fail back to
-	if (setjmp(png_jmpbuf(png_ptr))) {
-		abort_msg("read_png_file() : png_init_io failed");
+void read_data(csteg_ctx* ctx, char* filename, int force_flag) {
+	// read signature, pixel data is decoded as the data is read
+	if (csteg_open_file(ctx, filename) != CSTEG_OK) {
+		exit_msg("%s", csteg_ctx_error(ctx));
 	}
 
-	png_init_io(png_ptr, file_ptr);
-	png_set_sig_bytes(png_ptr, 8);
-
-	// read information from png
-	png_read_info(png_ptr, info_ptr);
-
-	// set global image variables
-	width = png_get_image_width(png_ptr, info_ptr);
-	height = png_get_image_height(png_ptr, info_ptr);
-	color_type = png_get_color_type(png_ptr, info_ptr);
-	bit_depth = png_get_bit_depth(png_ptr, info_ptr);
-
-	number_of_passes = png_set_interlace_handling(png_ptr);
-	png_read_update_info(png_ptr, info_ptr);
+	const char* data_filename = csteg_payload_name(ctx);
 
-	// set jump buffer for png_read_image to fail back to
-	if (setjmp(png_jmpbuf(png_ptr))) {
-		abort_msg("read_png_file() : error during png_read_image");
+	// a shard alone is only part of the data
+	csteg_shard shard;
+	if (csteg_payload_shard(ctx, &shard)) {
+		exit_msg("read_data() : File %s holds shard %u of %u of %s, pass every shard with -r png_in...",
+		          filename, shard.index + 1, shard.count, data_filename);
 	}
 
-	// allocate memory for row_pointers
-	row_pointers = (png_bytep*) malloc(sizeof(png_bytep) * height);
-	for (size_t y = 0; y < height; y++) {
-		row_pointers[y] = (png_byte*) malloc(png_get_rowbytes(png_ptr, info_ptr));
-	}
-
-	// read pixel data
-	png_read_image(png_ptr, row_pointers);
-
-	// abort if color type is not RGB or RGBA
-	if (color_type != PNG_COLOR_TYPE_RGB && color_type != PNG_COLOR_TYPE_RGBA) {
-		abort_msg("read_png_file() : File %s is not RGB or RGBA", filename);
+	// check if output file exists
+	if (access(data_filename, F_OK) != -1) {
+		// if exists and force flag isn't set, check that the user wants to override it
+		if (!force_flag) {
+			confirm_file_overwrite(data_filename);
+		}
 	}
 
-	// close file
-	fclose(file_ptr);
-}
-
-void write_png_file(char* filename) {
 	// create file
-	FILE *file_ptr = fopen(filename, "wb");
+	FILE *file_ptr = fopen(data_filename, "wb");
 
 	// check that file_ptr exists
 	if (!file_ptr) {
-		abort_msg("write_png_file() : File %s could not be opened for writing", filename);
-	}
-
-	// png and info pointers
-	png_structp png_ptr; // png struct
-	png_infop info_ptr; // png info struct
-
-	// initialize variables
-	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-
-	// check that png_ptr was created successfully
-	if (!png_ptr) {
-		abort_msg("write_png_file() : png_create_write_struct failed");
+		exit_msg("read_data() : could not open %s for writing", data_filename);
 	}
 
-	info_ptr = png_create_info_struct(png_ptr);
-
-	// check that info_ptr was created successfully
-	if (!info_ptr) {
-		abort_msg("write_png_file() : png_create_info_struct failed");
-	}
-
-	// set jump buffer for png_init_io to fail back to
-	if (setjmp(png_jmpbuf(png_ptr))) {
-		abort_msg("write_png_file() : png_init_io failed");
-	}
-
-	png_init_io(png_ptr, file_ptr);
-
-	// set jump buffer for png_set_IHDR to fail back to
-	if (setjmp(png_jmpbuf(png_ptr))) {
-		abort_msg("write_png_file() : png_set_IHDR failed");
-	}
+	// read in data and write it out in blocks, so only the rows holding the
+	// payload are ever decoded
+	uint8_t* data = (uint8_t*) malloc(EXTRACT_BLOCK_SIZE);
+	size_t size;
 
-	// write header
-	png_set_IHDR(png_ptr, info_ptr, width, height, bit_depth, color_type,
-                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+	do {
+		if (csteg_read(ctx, data, EXTRACT_BLOCK_SIZE, &size) != CSTEG_OK) {
+			exit_msg("%s", csteg_ctx_error(ctx));
+		}
 
-	// write info to info_ptr
-	png_write_info(png_ptr, info_ptr);
+		// write data
+		if (fwrite(data, 1, size, file_ptr) != size) {
+			exit_msg("read_data() : error writing to %s", data_filename);
+		}
+	} while (size == EXTRACT_BLOCK_SIZE);
 
-	// set jump buffer for png_write_image to fail back to
-	if (setjmp(png_jmpbuf(png_ptr))) {
-		abort_msg("write_png_file() : error writing bytes");
+	// close file
+	if (fclose(file_ptr) != 0) {
+		exit_msg("read_data() : error writing to %s", data_filename);
 	}
 
-	// write bytes
-	png_write_image(png_ptr, row_pointers);
-
-	// set jump buffer for png_write_end to fail back to
-	if (setjmp(png_jmpbuf(png_ptr))) {
-		abort_msg("write_png_file() : error during end of write");
-	}
-	
-	// end write
-	png_write_end(png_ptr, NULL);
+	// stop decoding, any rows past the end of the payload are never inflated
+	csteg_close(ctx);
 
 	// cleanup allocated memory
-	for (size_t y = 0; y < height; y++) {
-		free(row_pointers[y]);
-	}
-	free(row_pointers);
-
-	fclose(file_ptr);
+	free(data);
 }
 
-size_t generate_signature(uint8_t** signature, char* filename, uint32_t file_size) {
-	// calculate size of signature in bytes 
-	size_t filename_length = strlen(filename);	
-	size_t sig_length = (SIG_SIZE_BITS / 8) * 2 + filename_length;
-
-	// allocate memory for signature
-	*signature = (uint8_t*) malloc(sig_length);
-	size_t signature_pos = 0;
-
-	// initialize variables for loops
-	size_t i;
-	uint8_t byte_buffer;
-
-	// write filename_length
-	for (i = (SIG_SIZE_BITS / 8) - 1; i < (SIG_SIZE_BITS / 8); i--) {
-		// get correct byte
-		byte_buffer = (filename_length & (0xFF << (i * 8))) >> (i * 8);
-
-		// assign byte in signature
-		(*signature)[signature_pos] = byte_buffer;
-
-		// increment position
-		signature_pos++;
+// decode png_in once and for all into the precooked carrier file raw_out
+void precook_carrier(csteg_ctx* ctx, char* png_filename_in, char* raw_filename_out, int force_flag) {
+	// check if output file exists
+	if (access(raw_filename_out, F_OK) != -1) {
+		// if exists and force flag isn't set, check that the user wants to override it
+		if (!force_flag) {
+			confirm_file_overwrite(raw_filename_out);
+		}
 	}
 
-	// write file_length
-	for (i = (SIG_SIZE_BITS / 8) - 1; i < (SIG_SIZE_BITS / 8); i--) {
-		// get correct byte
-		byte_buffer = (file_size & (0xFF << (i * 8))) >> (i * 8);
-
-		// assign byte in signature
-		(*signature)[signature_pos] = byte_buffer;
-
-		//increment position
-		signature_pos++;
+	csteg_carrier* carrier;
+	if (csteg_decode_file(ctx, png_filename_in, &carrier) != CSTEG_OK) {
+		exit_msg("%s", csteg_ctx_error(ctx));
 	}
 
-	// write file name
-	for (i = 0; i < filename_length; i++) {
-		// write byte to signature
-		(*signature)[signature_pos] = filename[i];	
-
-		// increment position
-		signature_pos++;
+	if (csteg_carrier_save(ctx, carrier, raw_filename_out) != CSTEG_OK) {
+		exit_msg("%s", csteg_ctx_error(ctx));
 	}
 
-	return sig_length;
+	csteg_carrier_free(carrier);
 }
 
-void confirm_file_overwrite(char* filename) {
-	char response;
-	do {
-		printf("File %s already exists. Would you like to overwrite it (y/N)? ", filename);
-		scanf("%c", &response);
-		printf("\n");
-
-		// flush rest of input to avoid multiple responses
-		fflush(stdin);
-	} while (response != 'y' && response != 'Y' && response != 'n' && response != 'N' && response != EOF);
-
-	if (response == 'N' || response == 'n') {
-		abort_msg("user exit");
+// print s as a json string
+void print_json_string(const char* s) {
+	putchar('"');
+	for (; *s; s++) {
+		unsigned char c = *s;
+		if (c == '"' || c == '\\') {
+			printf("\\%c", c);
+		} else if (c < 0x20) {
+			printf("\\u%04x", c);
+		} else {
+			putchar(c);
+		}
 	}
+	putchar('"');
 }
 
-void write_data(char* png_filename_in, char* png_filename_out, char* data_filename, int force_flag) {
-	// check if output file exists
-	if (access(png_filename_out, F_OK) != -1) {
-		// if exists and force flag isn't set, check that the user wants to override it
-		if (!force_flag) {
-			confirm_file_overwrite(png_filename_out);
+// print the header and capacity of a single png
+void print_probe(const csteg_image* image, size_t name_length) {
+	int has_alpha = image->color_type == 4 || image->color_type == 6;
+
+	printf("width: %zu\n", image->width);
+	printf("height: %zu\n", image->height);
+	printf("color type: %s\n", color_type_names[image->color_type]);
+	printf("bit depth: %d\n", image->bit_depth);
+	printf("interlaced: %s\n", image->interlaced ? "yes" : "no");
+	printf("uncompressed: %s\n", image->uncompressed ? "yes" : "no");
+
+	// bytes free for data in each mode
+	for (int depth = CSTEG_MIN_DEPTH; depth <= CSTEG_MAX_DEPTH; depth++) {
+		printf("capacity at %d bits per channel: %zu bytes", depth, csteg_capacity(image, depth, 0, name_length));
+		if (has_alpha) {
+			printf(", %zu bytes with -a", csteg_capacity(image, depth, 1, name_length));
 		}
+		printf("\n");
 	}
+}
 
-	// read png
-	read_png_file(png_filename_in);
-
-	// open data file
-	FILE* file_ptr = fopen(data_filename, "rb");
-
-	// check that file_ptr exists
-	if (!file_ptr) {
-		abort_msg("write_data() : File %s could not be opened for reading");
-	}
-
-	// get size of file
-	fseek(file_ptr, 0L, SEEK_END);
-	uint32_t size = ftell(file_ptr);
-
-	// go back to beginning of file
-	rewind(file_ptr);
-
-	// generate signature
-	uint8_t* signature;
-	size_t sig_size = generate_signature(&signature, data_filename, size);
-
-	// check that data can fit in file
-	size_t max_data_bits = width * height * 6;
-	size_t required_data_bits = sig_size * 8 + size * 8;
-
-	// if there is too much information
-	if ( required_data_bits > max_data_bits) {
-		abort_msg("write_data() : PNG is too small to fit %s (%zu bytes required / %zu bytes free)", data_filename, required_data_bits / 8, max_data_bits / 8);
+// print the header and capacity of a single png read locally
+void probe_data(csteg_ctx* ctx, char* filename, size_t name_length) {
+	csteg_image image;
+	if (csteg_probe_file(ctx, filename, &image) != CSTEG_OK) {
+		exit_msg("%s", csteg_ctx_error(ctx));
 	}
 
-	// declare variables for writing data
-	size_t byte_offset; // current byte of PNG
-	size_t color_offset; // current color channel of PNG
-	size_t bit_offset; // current bit of data byte
-	size_t x, y; // x, y coordinates of current pixel
-	png_byte* pixel; // current pixel
-
-	uint8_t data_byte; // current byte of data
-	uint8_t data_chunk; // current chunk of data to write
-
-	size_t i = 0;
-
-	// write signature
-	for (i = 0; i < sig_size * 8; i += 2) {
-
-		byte_offset = i / 6;
-		bit_offset = 6 - (i % 8);
-		color_offset = (i / 2) % 3;
-		x = byte_offset % width;
-		y = byte_offset / width;
-		data_byte = signature[i/8];
-
-		data_chunk = (data_byte & (0x3 << bit_offset)) >> bit_offset;
+	print_probe(&image, name_length);
+}
 
-		// 3 values per pixel for RGB, 4 values for RGBA
-		if (color_type == PNG_COLOR_TYPE_RGBA) {
-			pixel =	&(row_pointers[y][x*4]);
-		} else if (color_type == PNG_COLOR_TYPE_RGB) {
-			pixel =	&(row_pointers[y][x*3]);
+// print the header and capacity of every png as a json array, returning the
+// number of files that could not be probed
+int probe_data_json(csteg_ctx* ctx, char** filenames, int count, size_t name_length) {
+	int failed = 0;
+
+	printf("[\n");
+	for (int i = 0; i < count; i++) {
+		csteg_image image;
+
+		printf("  {\"file\": ");
+		print_json_string(filenames[i]);
+
+		if (csteg_probe_file(ctx, filenames[i], &image) != CSTEG_OK) {
+			// keep going, so a bad file doesn't hide the rest
+			printf(", \"error\": ");
+			print_json_string(csteg_ctx_error(ctx));
+			failed++;
+		} else {
+			int has_alpha = image.color_type == 4 || image.color_type == 6;
+
+			// uncompressed images are BMP or PNM files, which --client refuses
+			printf(", \"width\": %zu, \"height\": %zu, \"color_type\": \"%s\", \"bit_depth\": %d, \"interlaced\": %s, \"uncompressed\": %s",
+			       image.width, image.height, color_type_names[image.color_type], image.bit_depth,
+			       image.interlaced ? "true" : "false", image.uncompressed ? "true" : "false");
+
+			// capacities are indexed by bits per channel minus one
+			printf(", \"capacity\": [");
+			for (int depth = CSTEG_MIN_DEPTH; depth <= CSTEG_MAX_DEPTH; depth++) {
+				printf("%s%zu", depth > CSTEG_MIN_DEPTH ? ", " : "", csteg_capacity(&image, depth, 0, name_length));
+			}
+			printf("], \"alpha_capacity\": ");
+			if (has_alpha) {
+				printf("[");
+				for (int depth = CSTEG_MIN_DEPTH; depth <= CSTEG_MAX_DEPTH; depth++) {
+					printf("%s%zu", depth > CSTEG_MIN_DEPTH ? ", " : "", csteg_capacity(&image, depth, 1, name_length));
+				}
+				printf("]");
+			} else {
+				printf("null");
+			}
 		}
 
-
-		// clear two least significant bits of color channel
-		pixel[color_offset] &= 0xFC;
-		
-		// set two least significant bits of color channel
-		pixel[color_offset] |= data_chunk;
+		printf("}%s\n", i + 1 < count ? "," : "");
 	}
+	printf("]\n");
 
-	// write data
-	fread(&data_byte, 1, 1, file_ptr);
-	while (i < required_data_bits) {
-		byte_offset = i / 6;
-		bit_offset = 6 - (i % 8);
-		color_offset = (i / 2) % 3;
-		x = byte_offset % width;
-		y = byte_offset / width;
-
-		data_chunk = (data_byte & (0x3 << bit_offset)) >> bit_offset;
-
-		// 3 values per pixel for RGB, 4 values for RGBA
-		if (color_type == PNG_COLOR_TYPE_RGBA) {
-			pixel =	&(row_pointers[y][x*4]);
-		} else if (color_type == PNG_COLOR_TYPE_RGB) {
-			pixel =	&(row_pointers[y][x*3]);
-		}
+	return failed;
+}
 
-		// clear two least significant bits of color channel
-		pixel[color_offset] &= 0xFC;
-		
-		// set two least significant bits of color channel
-		pixel[color_offset] |= data_chunk;
+// print the name and size of the payload of a single png
+void list_data(csteg_ctx* ctx, char* filename) {
+	// only the rows holding the signature are decoded
+	if (csteg_open_file(ctx, filename) != CSTEG_OK) {
+		exit_msg("%s", csteg_ctx_error(ctx));
+	}
 
-		// update data if current data has been consumed
-		if (bit_offset == 0) {
-			fread(&data_byte, 1, 1, file_ptr);
-		}
+	printf("name: %s\n", csteg_payload_name(ctx));
+	printf("size: %zu\n", csteg_payload_size(ctx));
 
-		i += 2;
+	csteg_shard shard;
+	if (csteg_payload_shard(ctx, &shard)) {
+		printf("shard: %u of %u, bytes %llu to %llu of %llu\n", shard.index + 1, shard.count,
+		       (unsigned long long) shard.offset, (unsigned long long) (shard.offset + shard.size),
+		       (unsigned long long) shard.total_size);
 	}
 
-	// write png
-	write_png_file(png_filename_out);
-
-	// cleanup allocated memory
-	free(signature);
+	// stop decoding before any of the data
+	csteg_close(ctx);
 }
 
-void read_data(char* filename, int force_flag) {
-	// read png
-	read_png_file(filename);
-
-	uint32_t data_filename_length = 0, data_file_size = 0;
-	char* data_filename;
-	uint8_t* data;
-
-	// current bit index
-	size_t i = 0;
-	size_t start_pos, end_pos; // start and stop positions for reading
-
-	// declare variables for reading data
-	size_t byte_offset; // current byte of PNG
-	size_t color_offset; // current color channel of PNG
-	size_t bit_offset; // current bit of data
-	size_t x, y; // x, y coordinates of current pixel
-	png_byte* pixel; // current pixel
-
-	size_t filename_pos = 0; // position of current character in filename
-	size_t data_pos = 0; // position of current byte in data
-
-	// read in length of filename
-	start_pos = i;
-	end_pos = SIG_SIZE_BITS;
-	for (i = start_pos; i < end_pos; i += 2) {
-		byte_offset = i / 6;
-		bit_offset = (SIG_SIZE_BITS-2) - i;
-		color_offset = (i / 2) % 3;
-		x = byte_offset % width;
-		y = byte_offset / width;
-
-		// 3 values per pixel for RGB, 4 values for RGBA
-		if (color_type == PNG_COLOR_TYPE_RGBA) {
-			pixel =	&(row_pointers[y][x*4]);
-		} else if (color_type == PNG_COLOR_TYPE_RGB) {
-			pixel =	&(row_pointers[y][x*3]);
-		}
-
-		data_filename_length |= ((pixel[color_offset] & 0x3) << bit_offset);
+// read the signature of a png into entry
+void list_png(csteg_ctx* ctx, const char* filename, list_entry* entry) {
+	if (!ctx) {
+		entry->error = strdup("list_png() : could not allocate context");
+		return;
 	}
 
-	// read in length of file
-	start_pos = end_pos;
-	end_pos = SIG_SIZE_BITS * 2;
-	for (i = start_pos; i < end_pos; i += 2) {
-		byte_offset = i / 6;
-		bit_offset = (SIG_SIZE_BITS*2-2) - i;
-		color_offset = (i / 2) % 3;
-		x = byte_offset % width;
-		y = byte_offset / width;
-
-		// 3 values per pixel for RGB, 4 values for RGBA
-		if (color_type == PNG_COLOR_TYPE_RGBA) {
-			pixel =	&(row_pointers[y][x*4]);
-		} else if (color_type == PNG_COLOR_TYPE_RGB) {
-			pixel =	&(row_pointers[y][x*3]);
-		}
-
-		data_file_size |= ((pixel[color_offset] & 0x3) << bit_offset);
+	if (csteg_open_file(ctx, filename) != CSTEG_OK) {
+		entry->error = strdup(csteg_ctx_error(ctx));
+		return;
 	}
 
-	// allocate memory for filename
-	data_filename = (char*) malloc(sizeof(char) * data_filename_length);
-
-	// read in file name
-	start_pos = end_pos;
-	end_pos = SIG_SIZE_BITS * 2 + data_filename_length * 8;
-	for (i = start_pos; i < end_pos; i += 2) {
-		byte_offset = i / 6;
-		bit_offset = 6 - (i % 8);
-		color_offset = (i / 2) % 3;
-		x = byte_offset % width;
-		y = byte_offset / width;
-
-		// 3 values per pixel for RGB, 4 values for RGBA
-		if (color_type == PNG_COLOR_TYPE_RGBA) {
-			pixel =	&(row_pointers[y][x*4]);
-		} else if (color_type == PNG_COLOR_TYPE_RGB) {
-			pixel =	&(row_pointers[y][x*3]);
-		}
-
-		data_filename[filename_pos] |= ((pixel[color_offset] & 0x3) << bit_offset);
+	entry->name = strdup(csteg_payload_name(ctx));
+	entry->size = csteg_payload_size(ctx);
+	entry->sharded = csteg_payload_shard(ctx, &entry->shard);
+	csteg_close(ctx);
+}
 
-		// if bit_offset is 0, we have finished writing this byte, update filename_pos
-		if (bit_offset == 0) {
-			filename_pos++;
+// list pngs of the job until there are none left, each thread taking the
+// next one as soon as it is done with the last, with a context of its own
+void list_task(void* arg, size_t index, size_t count) {
+	list_job* job = (list_job*) arg;
+	csteg_ctx* ctx = csteg_ctx_new();
+	(void) index;
+	(void) count;
+
+	for (;;) {
+		size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+		if (i >= job->count) {
+			break;
 		}
-	}
 
-	// check if output file exists
-	if (access(data_filename, F_OK) != -1) {
-		// if exists and force flag isn't set, check that the user wants to override it
-		if (!force_flag) {
-			confirm_file_overwrite(data_filename);
-		}
+		list_png(ctx, job->filenames[i], &job->entries[i]);
 	}
 
-	// allocate space for data
-	data = (uint8_t*) malloc(sizeof(uint8_t) * data_file_size);
-
-	// read in data
-	start_pos = SIG_SIZE_BITS * 2 + data_filename_length * 8;
-	end_pos = SIG_SIZE_BITS * 2 + data_filename_length * 8 + data_file_size * 8;
-	for (i = start_pos; i < end_pos; i+= 2) {
-		byte_offset = i / 6;
-		bit_offset = 6 - (i % 8);
-		color_offset = (i / 2) % 3;
-		x = byte_offset % width;
-		y = byte_offset / width;
-
-		// 3 values per pixel for RGB, 4 values for RGBA
-		if (color_type == PNG_COLOR_TYPE_RGBA) {
-			pixel =	&(row_pointers[y][x*4]);
-		} else if (color_type == PNG_COLOR_TYPE_RGB) {
-			pixel =	&(row_pointers[y][x*3]);
-		}
-
-		data[data_pos] |= ((pixel[color_offset] & 0x3) << bit_offset);
+	csteg_ctx_free(ctx);
+}
 
-		// if bit_offset is 0, we have finished writing this byte, update data_pos
-		if (bit_offset == 0) {
-			data_pos++;
+// print the name and size of the payload of every png as a json array,
+// reading them on threads threads. returns the number of files that could
+// not be read
+int list_data_json(char** filenames, int count, int threads) {
+	list_job job = {
+		.filenames = filenames,
+		.entries = (list_entry*) calloc(count, sizeof(list_entry)),
+		.count = count,
+		.next = 0,
+	};
+
+	if (!job.entries) {
+		exit_msg("list_data_json() : could not allocate %d entries", count);
+	}
+
+	// no more threads than files
+	thread_pool* pool = pool_create(threads < count ? threads : count);
+	if (!pool) {
+		exit_msg("list_data_json() : could not start %d threads", threads);
+	}
+	pool_run(pool, list_task, &job);
+	pool_destroy(pool);
+
+	// printed in the order given, once every png is read
+	int failed = 0;
+
+	printf("[\n");
+	for (int i = 0; i < count; i++) {
+		list_entry* entry = &job.entries[i];
+
+		printf("  {\"file\": ");
+		print_json_string(filenames[i]);
+
+		if (entry->error) {
+			printf(", \"error\": ");
+			print_json_string(entry->error);
+			failed++;
+		} else {
+			printf(", \"name\": ");
+			print_json_string(entry->name);
+			printf(", \"size\": %zu", entry->size);
+
+			if (entry->sharded) {
+				printf(", \"shard\": {\"id\": \"%016llx\", \"index\": %u, \"count\": %u, \"offset\": %llu, \"total_size\": %llu}",
+				       (unsigned long long) entry->shard.id, entry->shard.index, entry->shard.count,
+				       (unsigned long long) entry->shard.offset, (unsigned long long) entry->shard.total_size);
+			}
 		}
 
-	}
+		printf("}%s\n", i + 1 < count ? "," : "");
 
-	// create file
-	FILE *file_ptr = fopen(data_filename, "wb");
-	
-	// check that file_ptr exists
-	if (!file_ptr) {
-		abort_msg("read_data() : could not open %s for writing", data_filename);
+		free(entry->name);
+		free(entry->error);
 	}
+	printf("]\n");
 
-	// write data
-	fwrite(data, 1, data_file_size, file_ptr);
-
-	// close file
-	fclose(file_ptr);
+	free(job.entries);
+	return failed;
 }
 
 int main(int argc, char** argv) {
 	int read_flag = 0;
 	int write_flag = 0;
+	int probe_flag = 0;
+	int list_flag = 0;
 	int force_flag = 0;
 	char* png_filename_in = NULL;
 	char* png_filename_out = NULL;
 	char* data_filename = NULL;
+	char* kernel = NULL;
+	char* manifest_filename = NULL;
+	char* carrier_dir = NULL;
+	char* index_dir = NULL;
+	char* serve_socket = NULL;
+	char* client_socket = NULL;
+	int stats_flag = 0;
+	long cache_mib = -1; // -1 until set with --cache
+	char* precook_in = NULL;
+	int depth = 2;
+	int alpha_flag = 0;
+	int threads = 0; // 0 until set with -j
+	csteg_compression compression = CSTEG_COMPRESS_DEFAULT;
 	int arg;
 
+	// long options
+	struct option long_options[] = {
+		{ "kernel", required_argument, NULL, 'k' },
+		{ "compress", required_argument, NULL, 'z' },
+		{ "batch", required_argument, NULL, 'm' },
+		{ "carrier-pool", required_argument, NULL, 'p' },
+		{ "index", required_argument, NULL, 'x' },
+		{ "serve", required_argument, NULL, 'S' },
+		{ "client", required_argument, NULL, 'C' },
+		{ "stats", no_argument, NULL, 't' },
+		{ "cache", required_argument, NULL, 'M' },
+		{ "precook", required_argument, NULL, 'P' },
+		{ NULL, 0, NULL, 0 },
+	};
+
 	// handle flags
-	while ((arg = getopt(argc, argv, "rwfi:d:o:h?")) != -1) {
+	while ((arg = getopt_long(argc, argv, "rwclfab:j:i:d:o:h?", long_options, NULL)) != -1) {
 		switch (arg) {
 			case 'r':
 				read_flag = 1;
@@ -539,9 +467,32 @@ int main(int argc, char** argv) {
 			case 'w':
 				write_flag = 1;
 				break;
+			case 'c':
+				probe_flag = 1;
+				break;
+			case 'l':
+				list_flag = 1;
+				break;
 			case 'f':
 				force_flag = 1;
 				break;
+			case 'a':
+				alpha_flag = 1;
+				break;
+			case 'b':
+				depth = atoi(optarg);
+				if (depth < CSTEG_MIN_DEPTH || depth > CSTEG_MAX_DEPTH) {
+					print_usage();
+					exit(1);
+				}
+				break;
+			case 'j':
+				threads = atoi(optarg);
+				if (threads < 1 || threads > CSTEG_MAX_THREADS) {
+					print_usage();
+					exit(1);
+				}
+				break;
 			case 'i':
 				png_filename_in = optarg;
 				break;
@@ -551,6 +502,51 @@ int main(int argc, char** argv) {
 			case 'o':
 				png_filename_out = optarg;
 				break;
+			case 'k':
+				kernel = optarg;
+				break;
+			case 'm':
+				manifest_filename = optarg;
+				break;
+			case 'p':
+				carrier_dir = optarg;
+				break;
+			case 'x':
+				index_dir = optarg;
+				break;
+			case 'S':
+				serve_socket = optarg;
+				break;
+			case 'C':
+				client_socket = optarg;
+				break;
+			case 't':
+				stats_flag = 1;
+				break;
+			case 'P':
+				precook_in = optarg;
+				break;
+			case 'M': {
+				char* end;
+				cache_mib = strtol(optarg, &end, 10);
+				if (*optarg == '\0' || *end != '\0' || cache_mib < 0 || cache_mib > (long) (SIZE_MAX >> 21)) {
+					print_usage();
+					exit(1);
+				}
+				break;
+			}
+			case 'z': {
+				size_t i = 0;
+				while (i < sizeof(compression_names) / sizeof(compression_names[0]) && strcmp(optarg, compression_names[i]) != 0) {
+					i++;
+				}
+				if (i == sizeof(compression_names) / sizeof(compression_names[0])) {
+					print_usage();
+					exit(1);
+				}
+				compression = (csteg_compression) i;
+				break;
+			}
 			case 'h': // fall through intentional
 			case '?':
 				print_usage();
@@ -559,26 +555,246 @@ int main(int argc, char** argv) {
 		}
 	}
 
+	// pick the embed/extract kernels once, before any image is touched
+	if (csteg_select_kernel(kernel) != CSTEG_OK) {
+		exit_msg("main() : kernel %s is unknown or not supported by this cpu", kernel);
+	}
+
+	csteg_ctx* ctx = csteg_ctx_new();
+	if (!ctx) {
+		exit_msg("main() : could not allocate context");
+	}
+
+	csteg_set_depth(ctx, depth);
+	csteg_set_alpha(ctx, alpha_flag);
+	csteg_set_compression(ctx, compression);
+
+	// servers default to several workers, so one client can't hold them all
+	int workers = threads ? threads : SERVER_DEFAULT_WORKERS;
+	if (!threads) {
+		threads = 1;
+	}
+	csteg_set_threads(ctx, threads);
+
+	// carriers are only kept decoded by long running modes
+	if (cache_mib >= 0 && !serve_socket && !manifest_filename) {
+		print_usage();
+		exit(1);
+	}
+	size_t cache_size = (size_t) (cache_mib >= 0 ? cache_mib : CACHE_DEFAULT_MIB) << 20;
+
 	// validate input and perform operations
-	if (read_flag) {
-		// only input png should be specified
-		if (!png_filename_in || data_filename || png_filename_out || write_flag) {
+	if (serve_socket) {
+		// requests name their own files and options, -j sets how many
+		// connections are served at once
+		if (png_filename_in || data_filename || png_filename_out || read_flag || write_flag || probe_flag || list_flag ||
+		    manifest_filename || carrier_dir || index_dir || client_socket || stats_flag || argc > optind) {
 			print_usage();
 			exit(1);
 		}
-		read_data(png_filename_in, force_flag);
-	} else if (write_flag) {
-		// all fields should be specified
-		if (!png_filename_in || !data_filename || !png_filename_out || read_flag) {
+
+		if (serve(serve_socket, workers, cache_size) != 0) {
+			csteg_ctx_free(ctx);
+			return 1;
+		}
+	} else if (client_socket) {
+		// a single request on a single png, run by the server
+		client_options options = {
+			.socket_path = client_socket,
+			.force = force_flag,
+			.depth = depth,
+			.alpha = alpha_flag,
+			.compression = compression,
+		};
+
+		int operations = read_flag + write_flag + probe_flag + stats_flag;
+		if (operations != 1 || list_flag || manifest_filename || carrier_dir || index_dir || argc > optind ||
+		    (!png_filename_in) != stats_flag || (write_flag && (!data_filename || !png_filename_out)) ||
+		    (!write_flag && png_filename_out) || (read_flag && data_filename)) {
+			print_usage();
+			exit(1);
+		}
+
+		int result;
+		if (write_flag) {
+			result = client_embed(png_filename_in, data_filename, png_filename_out, &options);
+		} else if (read_flag) {
+			result = client_extract(png_filename_in, &options);
+		} else if (probe_flag) {
+			csteg_image image;
+			result = client_probe(png_filename_in, &image, &options);
+			if (result == 0) {
+				print_probe(&image, data_filename ? strlen(data_filename) : 0);
+			}
+		} else {
+			result = client_stats(&options);
+		}
+
+		if (result != 0) {
+			csteg_ctx_free(ctx);
+			return 1;
+		}
+	} else if (precook_in) {
+		// the precooked file is the only operand
+		if (argc - optind != 1 || png_filename_in || data_filename || png_filename_out || read_flag || write_flag ||
+		    probe_flag || list_flag || manifest_filename || carrier_dir || index_dir || stats_flag) {
+			print_usage();
+			exit(1);
+		}
+
+		precook_carrier(ctx, precook_in, argv[optind], force_flag);
+	} else if (index_dir) {
+		// only the directory is named
+		if (png_filename_in || data_filename || png_filename_out || read_flag || write_flag || probe_flag || list_flag ||
+		    manifest_filename || carrier_dir || client_socket || serve_socket || stats_flag || argc > optind) {
+			print_usage();
+			exit(1);
+		}
+
+		if (carrier_index_update(index_dir, threads) != 0) {
+			csteg_ctx_free(ctx);
+			return 1;
+		}
+	} else if (carrier_dir) {
+		// the carrier is picked from the directory instead of given with -i
+		if (!write_flag || png_filename_in || !data_filename || !png_filename_out || argc > optind) {
+			print_usage();
+			exit(1);
+		}
+
+		// the size has to be known before the data is loaded
+		struct stat st;
+		if (stat(data_filename, &st) != 0 || !S_ISREG(st.st_mode)) {
+			exit_msg("main() : File %s is not a regular file", data_filename);
+		}
+
+		char* carrier = carrier_select(carrier_dir, st.st_size, strlen(data_filename), depth, alpha_flag, threads);
+		if (!carrier) {
+			csteg_ctx_free(ctx);
+			return 1;
+		}
+
+		write_data(ctx, carrier, png_filename_out, data_filename, force_flag);
+		free(carrier);
+	} else if (manifest_filename) {
+		// every file is named by the manifest
+		if (png_filename_in || data_filename || png_filename_out || read_flag || write_flag || probe_flag || list_flag) {
 			print_usage();
 			exit(1);
 		}
-		write_data(png_filename_in, png_filename_out, data_filename, force_flag);
+
+		// items run on a thread each, -j sets how many run at once
+		batch_options options = {
+			.workers = threads,
+			.force = force_flag,
+			.depth = depth,
+			.alpha = alpha_flag,
+			.compression = compression,
+			.cache_size = cache_size,
+		};
+
+		long failed = run_batch(manifest_filename, &options);
+		if (failed < 0) {
+			exit_msg("main() : could not run batch %s", manifest_filename);
+		}
+		if (failed > 0) {
+			csteg_ctx_free(ctx);
+			return 1;
+		}
+	} else if (probe_flag) {
+		// a single png with -i, or any number of them after the options.
+		// the data file only sets the length of the name, and needn't exist
+		int file_count = argc - optind;
+		if ((!png_filename_in) == (file_count == 0) || png_filename_out || read_flag || write_flag || list_flag) {
+			print_usage();
+			exit(1);
+		}
+
+		size_t name_length = data_filename ? strlen(data_filename) : 0;
+		if (png_filename_in) {
+			probe_data(ctx, png_filename_in, name_length);
+		} else if (probe_data_json(ctx, &argv[optind], file_count, name_length) != 0) {
+			csteg_ctx_free(ctx);
+			return 1;
+		}
+	} else if (list_flag) {
+		// a single png with -i, or any number of them after the options
+		int file_count = argc - optind;
+		if ((!png_filename_in) == (file_count == 0) || data_filename || png_filename_out || read_flag || write_flag) {
+			print_usage();
+			exit(1);
+		}
+
+		if (png_filename_in) {
+			list_data(ctx, png_filename_in);
+		} else if (list_data_json(&argv[optind], file_count, threads) != 0) {
+			csteg_ctx_free(ctx);
+			return 1;
+		}
+	} else if (read_flag) {
+		int file_count = argc - optind;
+
+		// pngs after the options are shards of a single payload
+		if (file_count > 0) {
+			if (png_filename_in || data_filename || png_filename_out || write_flag) {
+				print_usage();
+				exit(1);
+			}
+
+			shard_options options = {
+				.workers = threads,
+				.force = force_flag,
+			};
+
+			if (shard_extract(&argv[optind], file_count, &options) != 0) {
+				csteg_ctx_free(ctx);
+				return 1;
+			}
+		} else {
+			// only input png should be specified
+			if (!png_filename_in || data_filename || png_filename_out || write_flag) {
+				print_usage();
+				exit(1);
+			}
+			read_data(ctx, png_filename_in, force_flag);
+		}
+	} else if (write_flag) {
+		int file_count = argc - optind;
+
+		// pngs after the options are carriers the data is sharded across
+		if (file_count > 0) {
+			if (png_filename_in || !data_filename || !png_filename_out || read_flag) {
+				print_usage();
+				exit(1);
+			}
+
+			shard_options options = {
+				.workers = threads,
+				.force = force_flag,
+				.depth = depth,
+				.alpha = alpha_flag,
+				.compression = compression,
+			};
+
+			if (shard_embed(data_filename, &argv[optind], file_count, png_filename_out, &options) != 0) {
+				csteg_ctx_free(ctx);
+				return 1;
+			}
+		} else {
+			// all fields should be specified
+			if (!png_filename_in || !data_filename || !png_filename_out || read_flag) {
+				print_usage();
+				exit(1);
+			}
+			write_data(ctx, png_filename_in, png_filename_out, data_filename, force_flag);
+		}
 	} else {
 		// did not specify read or write you silly goose
 		print_usage();
 		exit(1);
 	}
 
+	csteg_ctx_free(ctx);
+
 	return 0;
 }
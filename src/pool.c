@@ -0,0 +1,150 @@
+//===================== Copyright 2020, Jake Grossman =======================//
+//
+// Purpose: fixed set of worker threads running one task at a time
+//
+// The thread calling pool_run takes index 0 itself, so a pool of n threads
+// only starts n - 1 workers. Workers sleep until the generation count
+// changes, run the task once, and the last one to finish wakes the caller.
+//
+// This file is subject to the terms and conditions defined in the
+// file 'LICENSE.txt', which is part of this source code package
+//
+//===========================================================================//
+#include <stdlib.h> // malloc
+#include <pthread.h>
+#include "pool.h"
+
+// a worker and its index in the pool
+typedef struct {
+	thread_pool* pool;
+	size_t index;
+	pthread_t thread;
+} pool_worker;
+
+struct thread_pool {
+	size_t threads; // workers + the calling thread
+	pool_worker* workers;
+	size_t started; // number of workers running
+
+	pthread_mutex_t lock;
+	pthread_cond_t start; // signalled when a task is posted or the pool stops
+	pthread_cond_t done; // signalled when the last worker finishes a task
+
+	pool_task task;
+	void* arg;
+	unsigned long generation; // incremented for every task posted
+	size_t pending; // workers yet to finish the current task
+	int stopping;
+};
+
+static void* pool_worker_main(void* ptr) {
+	pool_worker* worker = (pool_worker*) ptr;
+	thread_pool* pool = worker->pool;
+
+	// no task has been posted before the worker starts
+	unsigned long seen = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (pool->generation == seen && !pool->stopping) {
+			pthread_cond_wait(&pool->start, &pool->lock);
+		}
+
+		if (pool->stopping) {
+			break;
+		}
+
+		seen = pool->generation;
+		pool_task task = pool->task;
+		void* arg = pool->arg;
+
+		// run the task unlocked
+		pthread_mutex_unlock(&pool->lock);
+		task(arg, worker->index, pool->threads);
+		pthread_mutex_lock(&pool->lock);
+
+		if (--pool->pending == 0) {
+			pthread_cond_signal(&pool->done);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+thread_pool* pool_create(size_t threads) {
+	thread_pool* pool = (thread_pool*) calloc(1, sizeof(thread_pool));
+	if (!pool) {
+		return NULL;
+	}
+
+	pool->threads = threads ? threads : 1;
+	pool->workers = (pool_worker*) calloc(pool->threads, sizeof(pool_worker));
+	if (!pool->workers) {
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	// index 0 is the thread calling pool_run
+	for (size_t i = 1; i < pool->threads; i++) {
+		pool_worker* worker = &pool->workers[pool->started];
+		worker->pool = pool;
+		worker->index = i;
+
+		if (pthread_create(&worker->thread, NULL, pool_worker_main, worker) != 0) {
+			pool_destroy(pool);
+			return NULL;
+		}
+		pool->started++;
+	}
+
+	return pool;
+}
+
+void pool_run(thread_pool* pool, pool_task task, void* arg) {
+	pthread_mutex_lock(&pool->lock);
+	pool->task = task;
+	pool->arg = arg;
+	pool->pending = pool->started;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	task(arg, 0, pool->threads);
+
+	// wait for the workers
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending > 0) {
+		pthread_cond_wait(&pool->done, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+size_t pool_threads(const thread_pool* pool) {
+	return pool->threads;
+}
+
+void pool_destroy(thread_pool* pool) {
+	if (!pool) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = 1;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (size_t i = 0; i < pool->started; i++) {
+		pthread_join(pool->workers[i].thread, NULL);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->start);
+	pthread_cond_destroy(&pool->done);
+	free(pool->workers);
+	free(pool);
+}
@@ -0,0 +1,32 @@
+//===================== Copyright 2020, Jake Grossman =======================//
+//
+// Purpose: fixed set of worker threads running one task at a time
+//
+// This file is subject to the terms and conditions defined in the
+// file 'LICENSE.txt', which is part of this source code package
+//
+//===========================================================================//
+#ifndef CSTEG_POOL_H
+#define CSTEG_POOL_H
+
+#include <stddef.h> // size_t
+
+// work run on every thread of a pool, index is 0 to count - 1
+typedef void (*pool_task)(void* arg, size_t index, size_t count);
+
+typedef struct thread_pool thread_pool;
+
+// start a pool of threads threads, counting the one calling pool_run.
+// returns NULL if the threads can't be created
+thread_pool* pool_create(size_t threads);
+
+// run task on every thread of the pool, returning once all are done
+void pool_run(thread_pool* pool, pool_task task, void* arg);
+
+// number of threads of the pool
+size_t pool_threads(const thread_pool* pool);
+
+// stop the threads of a pool and release it, NULL is ignored
+void pool_destroy(thread_pool* pool);
+
+#endif
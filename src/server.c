@@ -0,0 +1,858 @@
+//===================== Copyright 2020, Jake Grossman =======================//
+//
+// Purpose: long running server answering embed, extract and probe requests
+//          over a unix domain socket
+//
+// Every worker of the pool blocks in accept() on the listening socket and
+// serves the connection it gets until the client closes it, so no more
+// connections are served at once than there are workers, and the rest wait
+// in the backlog. Workers keep their context and buffers across requests.
+// Files passed as descriptors are mapped, so the embed kernel reads the
+// payload from the page cache and extraction writes to it directly.
+// Carriers embedded into are kept decoded in a cache shared by the workers.
+// Connections idle for SERVER_IDLE_TIMEOUT seconds are closed, so idle
+// clients can't hold every worker. Stopping shuts the listening socket and
+// the read side of every connection down, which lets the requests being
+// served finish.
+//
+// This file is subject to the terms and conditions defined in the
+// file 'LICENSE.txt', which is part of this source code package
+//
+//===========================================================================//
+#include <stdio.h>
+#include <stdlib.h> // malloc
+#include <stdarg.h> // va_list, va_start, va_end
+#include <stdint.h> // uint8_t, uint64_t
+#include <string.h> // strlen, memcpy, strerror
+#include <errno.h> // errno
+#include <signal.h> // sigaction
+#include <setjmp.h> // sigjmp_buf, sigsetjmp, siglongjmp
+#include <time.h> // clock_gettime, nanosleep
+#include <unistd.h> // close, unlink, ftruncate
+#include <sys/mman.h> // mmap, munmap
+#include <sys/socket.h> // socket, bind, listen, accept, setsockopt
+#include <sys/time.h> // timeval
+#include <sys/stat.h> // stat
+#include <sys/un.h> // sockaddr_un
+#include <pthread.h>
+#include "server.h"
+#include "frame.h"
+#include "csteg.h"
+#include "pool.h"
+#include "cache.h"
+
+// connections waiting for a worker
+#define SERVER_BACKLOG 128
+
+// most bytes of carrier and payload a request may stream, as they are held
+// in memory while it is served. files passed as descriptors are mapped
+#define SERVER_REQUEST_LIMIT ((size_t) 1 << 30)
+
+// seconds a connection may go without sending or taking any data before
+// it is closed, so idle clients don't hold workers
+#define SERVER_IDLE_TIMEOUT 30
+
+// pause before accepting again after accept() failed for want of resources
+#define ACCEPT_BACKOFF_MS 100
+
+// latencies are counted in buckets of powers of two microseconds
+#define LATENCY_BUCKETS 40
+
+// operations latencies are kept for
+enum {
+	STATS_EMBED,
+	STATS_EXTRACT,
+	STATS_PROBE,
+	STATS_OPERATIONS,
+};
+
+static const char* stats_names[] = { "embed", "extract", "probe" };
+
+// latencies of an operation
+typedef struct {
+	uint64_t count; // requests answered
+	uint64_t failed; // requests answered with an error
+	uint64_t total_us, max_us;
+	uint64_t buckets[LATENCY_BUCKETS]; // requests taking less than 2^(i + 1) microseconds
+} latency_stats;
+
+// file passed as a descriptor and mapped
+typedef struct {
+	uint8_t* data;
+	size_t size;
+	struct stat st; // identifies the file to the carrier cache
+} mapped_file;
+
+// state of a running server
+typedef struct {
+	int listen_fd;
+	carrier_cache* cache; // carriers kept decoded, NULL if they aren't
+	pthread_mutex_t lock; // held while stats are read or updated
+	latency_stats stats[STATS_OPERATIONS];
+} server;
+
+// state of a worker, kept across the requests it serves
+typedef struct {
+	server* srv;
+	csteg_ctx* ctx;
+	frame_buffer carrier; // carrier png of the request
+	frame_buffer data; // payload embedded by the request
+	uint8_t* block; // holds extracted data before it is sent
+	cached_carrier* entry; // carrier taken from the cache while embedding
+	size_t remaining; // bytes the request may still stream
+	int drop; // close the connection once the request is answered
+	csteg_status status; // outcome of the request
+	char error[256]; // describes the outcome, if it failed
+} server_worker;
+
+// sockets shut down to stop the server, from a signal handler. only the
+// listening socket and one connection per worker are ever open
+static volatile sig_atomic_t stopping;
+static volatile int listen_socket = -1;
+static volatile int connection_sockets[CSTEG_MAX_THREADS];
+
+static void stop_server(int signal) {
+	(void) signal;
+	stopping = 1;
+
+	if (listen_socket >= 0) {
+		shutdown(listen_socket, SHUT_RDWR);
+	}
+
+	// requests being served still get their answer
+	for (size_t i = 0; i < CSTEG_MAX_THREADS; i++) {
+		if (connection_sockets[i] >= 0) {
+			shutdown(connection_sockets[i], SHUT_RD);
+		}
+	}
+}
+
+// files passed as descriptors are mapped, and the client still holds them,
+// so it can shrink one while it is read or written. the pages past its new
+// end then raise SIGBUS when touched, which fails the request being served
+// by the worker it was raised on instead of killing the server
+static _Thread_local sigjmp_buf* volatile mapping_fault;
+
+static void fail_mapping(int signal) {
+	if (mapping_fault) {
+		siglongjmp(*mapping_fault, 1);
+	}
+
+	// not raised by a mapping, so the faulting access is retried and kills
+	// the process as it would have
+	struct sigaction action = { .sa_handler = SIG_DFL };
+	sigemptyset(&action.sa_mask);
+	sigaction(signal, &action, NULL);
+}
+
+// microseconds since an arbitrary point
+static uint64_t now_us(void) {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t) time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+
+// record how long a request took
+static void record_latency(server* srv, int operation, uint64_t elapsed_us, int failed) {
+	size_t bucket = 0;
+	while (bucket + 1 < LATENCY_BUCKETS && elapsed_us >= (uint64_t) 2 << bucket) {
+		bucket++;
+	}
+
+	pthread_mutex_lock(&srv->lock);
+	latency_stats* stats = &srv->stats[operation];
+	stats->count++;
+	stats->failed += failed;
+	stats->total_us += elapsed_us;
+	stats->max_us = elapsed_us > stats->max_us ? elapsed_us : stats->max_us;
+	stats->buckets[bucket]++;
+	pthread_mutex_unlock(&srv->lock);
+}
+
+// upper bound of the latency under which fraction of the requests fall
+static uint64_t latency_percentile(const latency_stats* stats, double fraction) {
+	uint64_t wanted = (uint64_t) (stats->count * fraction + 0.5);
+	uint64_t seen = 0;
+
+	for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += stats->buckets[i];
+		if (seen >= wanted && seen > 0) {
+			// no request took longer than the slowest one
+			uint64_t bound = (uint64_t) 2 << i;
+			return bound < stats->max_us ? bound : stats->max_us;
+		}
+	}
+
+	return 0;
+}
+
+// describe the latencies of every operation in text of at most size bytes
+static size_t format_stats(server* srv, char* text, size_t size) {
+	size_t length = 0;
+
+	pthread_mutex_lock(&srv->lock);
+	length += snprintf(text + length, size - length, "%-8s %10s %8s %10s %10s %10s %10s\n",
+	                   "op", "count", "failed", "mean_us", "p50_us", "p99_us", "max_us");
+
+	for (size_t i = 0; i < STATS_OPERATIONS && length < size; i++) {
+		const latency_stats* stats = &srv->stats[i];
+		length += snprintf(text + length, size - length, "%-8s %10llu %8llu %10llu %10llu %10llu %10llu\n",
+		                   stats_names[i], (unsigned long long) stats->count, (unsigned long long) stats->failed,
+		                   (unsigned long long) (stats->count ? stats->total_us / stats->count : 0),
+		                   (unsigned long long) latency_percentile(stats, 0.5),
+		                   (unsigned long long) latency_percentile(stats, 0.99),
+		                   (unsigned long long) stats->max_us);
+	}
+	pthread_mutex_unlock(&srv->lock);
+
+	if (srv->cache && length < size) {
+		cache_stats stats;
+		carrier_cache_stats(srv->cache, &stats);
+		length += snprintf(text + length, size - length, "carrier cache: %zu hits, %zu misses, %zu carriers in %zu bytes\n",
+		                   stats.hits, stats.misses, stats.entries, stats.bytes);
+	}
+
+	return length < size ? length : size - 1;
+}
+
+//===========================================================================//
+// requests
+//===========================================================================//
+
+// record the outcome of a request from its context
+static void ctx_outcome(server_worker* worker, csteg_status status) {
+	worker->status = status;
+	snprintf(worker->error, sizeof(worker->error), "%s", status == CSTEG_OK ? "" : csteg_ctx_error(worker->ctx));
+}
+
+// record a failed outcome of a request
+static void request_error(server_worker* worker, csteg_status status, const char* fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	worker->status = status;
+	vsnprintf(worker->error, sizeof(worker->error), fmt, args);
+	va_end(args);
+}
+
+// read a stream of frames of type sent by the request into buffer. returns
+// 0, 1 after recording that the request streams too much, in which case the
+// connection is closed once it is answered as the rest is left unread, or
+// -1 if the connection can't be used anymore
+static int read_stream(server_worker* worker, int fd, uint8_t type, frame_buffer* buffer) {
+	int result = frame_read_stream(fd, type, buffer, worker->remaining);
+
+	if (result > 0) {
+		request_error(worker, CSTEG_ERR_TOO_LARGE, "read_stream() : request streams more than the server's limit of %zu MiB",
+		              SERVER_REQUEST_LIMIT >> 20);
+		worker->drop = 1;
+	} else if (result == 0) {
+		worker->remaining -= buffer->size;
+	}
+
+	return result;
+}
+
+// map the regular file, or memfd, file_fd for reading. returns 0, or -1
+// after recording why
+static int map_file(server_worker* worker, int file_fd, const char* what, mapped_file* file) {
+	static uint8_t empty;
+	struct stat* st = &file->st;
+
+	if (fstat(file_fd, st) != 0 || !S_ISREG(st->st_mode)) {
+		request_error(worker, CSTEG_ERR_IO, "map_file() : %s passed is not a regular file", what);
+		return -1;
+	}
+
+	// empty files can't be mapped, but are valid payloads
+	file->size = st->st_size;
+	file->data = &empty;
+
+	if (file->size > 0) {
+		void* data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, file_fd, 0);
+		if (data == MAP_FAILED) {
+			request_error(worker, CSTEG_ERR_IO, "map_file() : could not map %s passed", what);
+			return -1;
+		}
+
+		// both the carrier and the payload are read front to back once
+		madvise(data, file->size, MADV_SEQUENTIAL);
+		file->data = (uint8_t*) data;
+	}
+
+	return 0;
+}
+
+// record that a file passed was shrunk while it was mapped, releasing what
+// the operation interrupted held
+static void mapping_lost(server_worker* worker, const char* func) {
+	carrier_cache_release(worker->srv->cache, worker->entry);
+	worker->entry = NULL;
+	csteg_close(worker->ctx);
+
+	request_error(worker, CSTEG_ERR_IO, "%s() : a file passed was truncated while it was being used", func);
+}
+
+static void unmap_file(mapped_file* file) {
+	if (file->size > 0) {
+		munmap(file->data, file->size);
+	}
+}
+
+// write size bytes of data to file_fd
+static int write_all(int file_fd, const uint8_t* data, size_t size) {
+	while (size > 0) {
+		ssize_t count = write(file_fd, data, size);
+		if (count < 0 && errno == EINTR) {
+			continue;
+		}
+		if (count <= 0) {
+			return -1;
+		}
+
+		data += count;
+		size -= count;
+	}
+
+	return 0;
+}
+
+// embed data into the png carrier, taking its pixels from the cache if it
+// was decoded before. st describes the file carrier was mapped from, if any
+static csteg_status embed_carrier(server_worker* worker, const uint8_t* carrier, size_t carrier_size, const struct stat* st,
+                                  const char* name, const uint8_t* data, size_t data_size, void** png, size_t* png_size) {
+	carrier_cache* cache = worker->srv->cache;
+	csteg_ctx* ctx = worker->ctx;
+
+	// held by the worker, so it is released if the request fails on a fault
+	worker->entry = NULL;
+	if (cache) {
+		csteg_status status = carrier_cache_memory(cache, ctx, carrier, carrier_size, st, &worker->entry);
+		if (status != CSTEG_OK) {
+			return status;
+		}
+	}
+
+	csteg_status status;
+	if (worker->entry) {
+		status = csteg_embed_carrier_memory(ctx, cached_carrier_pixels(worker->entry), name, data, data_size, png, png_size);
+	} else {
+		status = csteg_embed_memory(ctx, carrier, carrier_size, name, data, data_size, png, png_size);
+	}
+	carrier_cache_release(cache, worker->entry);
+	worker->entry = NULL;
+
+	return status;
+}
+
+// embed the payload into the carrier, sending the png written
+static int serve_embed(server_worker* worker, int fd, const char* name) {
+	int result = read_stream(worker, fd, FRAME_CARRIER, &worker->carrier);
+	if (result == 0) {
+		result = read_stream(worker, fd, FRAME_DATA, &worker->data);
+	}
+	if (result != 0) {
+		return result < 0 ? -1 : 0;
+	}
+
+	void* png;
+	size_t png_size;
+	csteg_status status = embed_carrier(worker, worker->carrier.data, worker->carrier.size, NULL, name,
+	                                    worker->data.data, worker->data.size, &png, &png_size);
+	ctx_outcome(worker, status);
+
+	if (status != CSTEG_OK) {
+		return 0;
+	}
+
+	for (size_t sent = 0; sent < png_size && result == 0; sent += FRAME_MAX_SIZE) {
+		size_t size = png_size - sent < FRAME_MAX_SIZE ? png_size - sent : FRAME_MAX_SIZE;
+		result = frame_write(fd, FRAME_OUTPUT, (uint8_t*) png + sent, size);
+	}
+
+	free(png);
+	return result;
+}
+
+// extract the payload of the carrier, sending its name and then its data
+// as it is extracted
+static int serve_extract(server_worker* worker, int fd) {
+	csteg_ctx* ctx = worker->ctx;
+
+	int result = read_stream(worker, fd, FRAME_CARRIER, &worker->carrier);
+	if (result != 0) {
+		return result < 0 ? -1 : 0;
+	}
+
+	csteg_status status = csteg_open_memory(ctx, worker->carrier.data, worker->carrier.size);
+	if (status != CSTEG_OK) {
+		ctx_outcome(worker, status);
+		return 0;
+	}
+
+	const char* name = csteg_payload_name(ctx);
+	if (frame_write(fd, FRAME_NAME, name, strlen(name)) != 0) {
+		csteg_close(ctx);
+		return -1;
+	}
+
+	size_t size;
+	do {
+		status = csteg_read(ctx, worker->block, FRAME_MAX_SIZE, &size);
+		if (status != CSTEG_OK) {
+			break;
+		}
+
+		if (size > 0 && frame_write(fd, FRAME_DATA, worker->block, size) != 0) {
+			csteg_close(ctx);
+			return -1;
+		}
+	} while (size == FRAME_MAX_SIZE);
+
+	ctx_outcome(worker, status);
+	csteg_close(ctx);
+	return 0;
+}
+
+// read the header of the carrier, of which only the start has to be sent
+static int serve_probe(server_worker* worker, int fd) {
+	int result = read_stream(worker, fd, FRAME_CARRIER, &worker->carrier);
+	if (result != 0) {
+		return result < 0 ? -1 : 0;
+	}
+
+	csteg_image image;
+	csteg_status status = csteg_probe_memory(worker->ctx, worker->carrier.data, worker->carrier.size, &image);
+	ctx_outcome(worker, status);
+
+	if (status != CSTEG_OK) {
+		return 0;
+	}
+
+	// capacities are left to the client, which knows the name it will use
+	uint8_t info[FRAME_PROBE_SIZE];
+	frame_store(info, image.width, 4);
+	frame_store(&info[4], image.height, 4);
+	info[8] = image.color_type;
+	info[9] = image.bit_depth;
+	info[10] = image.interlaced;
+
+	return frame_write(fd, FRAME_INFO, info, sizeof(info));
+}
+
+// embed the payload file into the carrier file, both passed as descriptors
+// and mapped, writing the png to the output file passed after them
+static int serve_embed_files(server_worker* worker, int fd, const char* name) {
+	static const uint8_t streams[] = { FRAME_CARRIER, FRAME_DATA, FRAME_OUTPUT };
+	int files[3] = { -1, -1, -1 };
+	int result = 0;
+
+	for (size_t i = 0; i < 3 && result == 0; i++) {
+		if (frame_read_file_fd(fd, streams[i], &files[i]) != 0 || files[i] < 0) {
+			result = -1;
+		}
+	}
+
+	mapped_file carrier = { 0 }, data = { 0 };
+	if (result == 0 && map_file(worker, files[0], "carrier", &carrier) == 0) {
+		if (map_file(worker, files[1], "payload", &data) == 0) {
+			void* png;
+			size_t png_size;
+			csteg_status status;
+			sigjmp_buf fault;
+
+			if (sigsetjmp(fault, 1) == 0) {
+				mapping_fault = &fault;
+				status = embed_carrier(worker, carrier.data, carrier.size, &carrier.st, name,
+				                       data.data, data.size, &png, &png_size);
+				ctx_outcome(worker, status);
+			} else {
+				mapping_lost(worker, "serve_embed_files");
+				status = CSTEG_ERR_IO;
+			}
+			mapping_fault = NULL;
+
+			if (status == CSTEG_OK) {
+				if (ftruncate(files[2], 0) != 0 || write_all(files[2], (const uint8_t*) png, png_size) != 0) {
+					request_error(worker, CSTEG_ERR_IO, "serve_embed_files() : error writing to the output file passed");
+				}
+				free(png);
+			}
+
+			unmap_file(&data);
+		}
+		unmap_file(&carrier);
+	}
+
+	for (size_t i = 0; i < 3; i++) {
+		if (files[i] >= 0) {
+			close(files[i]);
+		}
+	}
+
+	return result;
+}
+
+// extract the payload of the carrier passed as a descriptor, sending its
+// name, straight into the file the client then passes for it
+static int serve_extract_files(server_worker* worker, int fd) {
+	csteg_ctx* ctx = worker->ctx;
+	int carrier_fd;
+
+	if (frame_read_file_fd(fd, FRAME_CARRIER, &carrier_fd) != 0 || carrier_fd < 0) {
+		return -1;
+	}
+
+	mapped_file carrier;
+	int mapped = map_file(worker, carrier_fd, "carrier", &carrier) == 0;
+	close(carrier_fd);
+
+	if (!mapped) {
+		return 0;
+	}
+
+	// kept across a fault, so what was opened is released after it
+	volatile int target_fd = -1;
+	uint8_t* volatile target = NULL;
+	volatile size_t size = 0;
+	volatile int result = 0;
+	sigjmp_buf fault;
+
+	if (sigsetjmp(fault, 1) != 0) {
+		mapping_lost(worker, "serve_extract_files");
+	} else {
+		mapping_fault = &fault;
+
+		csteg_status status = csteg_open_memory(ctx, carrier.data, carrier.size);
+		if (status != CSTEG_OK) {
+			ctx_outcome(worker, status);
+		} else {
+			// the client opens the file named by the payload, or cancels
+			const char* name = csteg_payload_name(ctx);
+			int passed_fd = -1;
+			result = frame_write(fd, FRAME_NAME, name, strlen(name));
+			if (result == 0) {
+				result = frame_read_file_fd(fd, FRAME_DATA, &passed_fd);
+			}
+			target_fd = passed_fd;
+
+			if (result == 0 && target_fd >= 0) {
+				// the payload is decoded into the pages of the file, not copied
+				struct stat st;
+				size = csteg_payload_size(ctx);
+
+				if (fstat(target_fd, &st) != 0 || !S_ISREG(st.st_mode) || ftruncate(target_fd, size) != 0) {
+					request_error(worker, CSTEG_ERR_IO, "serve_extract_files() : could not resize the file passed for %s", name);
+				} else if (size > 0) {
+					void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, target_fd, 0);
+					if (mapping == MAP_FAILED) {
+						request_error(worker, CSTEG_ERR_IO, "serve_extract_files() : could not map the file passed for %s", name);
+					} else {
+						size_t length;
+						target = (uint8_t*) mapping;
+						ctx_outcome(worker, csteg_read(ctx, target, size, &length));
+					}
+				}
+			}
+		}
+	}
+	mapping_fault = NULL;
+
+	if (target) {
+		munmap(target, size);
+	}
+	if (target_fd >= 0) {
+		close(target_fd);
+	}
+
+	csteg_close(ctx);
+	unmap_file(&carrier);
+	return result;
+}
+
+// send the latencies of every operation
+static int serve_stats(server_worker* worker, int fd) {
+	char text[1024];
+	size_t length = format_stats(worker->srv, text, sizeof(text));
+
+	worker->status = CSTEG_OK;
+	worker->error[0] = '\0';
+	return frame_write(fd, FRAME_INFO, text, length);
+}
+
+// serve a request whose FRAME_REQUEST frame of size bytes is in request.
+// returns -1 if the connection can't be used anymore
+static int serve_request(server_worker* worker, int fd, uint8_t* request, size_t size) {
+	uint64_t start = now_us();
+	uint8_t operation = request[0];
+	int result = 0;
+	int stats = -1;
+
+	// the name is the rest of the frame
+	char* name = (char*) &request[FRAME_REQUEST_SIZE];
+	name[size - FRAME_REQUEST_SIZE] = '\0';
+
+	worker->status = CSTEG_OK;
+	worker->error[0] = '\0';
+	worker->remaining = SERVER_REQUEST_LIMIT;
+	worker->drop = 0;
+
+	// options are set for every request, as clients may differ
+	csteg_status status = csteg_set_depth(worker->ctx, request[1]);
+	if (status == CSTEG_OK) {
+		status = csteg_set_alpha(worker->ctx, request[2]);
+	}
+	if (status == CSTEG_OK) {
+		status = csteg_set_compression(worker->ctx, (csteg_compression) request[3]);
+	}
+
+	if (status != CSTEG_OK) {
+		// the streams of the request can't be told apart without knowing
+		// the operation, so the connection is dropped
+		ctx_outcome(worker, status);
+		result = -1;
+	} else {
+		switch (operation) {
+			case FRAME_OP_EMBED:
+				stats = STATS_EMBED;
+				result = serve_embed(worker, fd, name);
+				break;
+			case FRAME_OP_EXTRACT:
+				stats = STATS_EXTRACT;
+				result = serve_extract(worker, fd);
+				break;
+			case FRAME_OP_PROBE:
+				stats = STATS_PROBE;
+				result = serve_probe(worker, fd);
+				break;
+			case FRAME_OP_EMBED_FILES:
+				stats = STATS_EMBED;
+				result = serve_embed_files(worker, fd, name);
+				break;
+			case FRAME_OP_EXTRACT_FILES:
+				stats = STATS_EXTRACT;
+				result = serve_extract_files(worker, fd);
+				break;
+			case FRAME_OP_STATS:
+				result = serve_stats(worker, fd);
+				break;
+			default:
+				result = -1;
+		}
+	}
+
+	if (result != 0) {
+		return -1;
+	}
+
+	uint64_t elapsed_us = now_us() - start;
+	if (stats >= 0) {
+		record_latency(worker->srv, stats, elapsed_us, worker->status != CSTEG_OK);
+	}
+
+	// the status ends the answer
+	uint8_t status_frame[FRAME_STATUS_SIZE + sizeof(worker->error)];
+	size_t error_length = strlen(worker->error);
+	status_frame[0] = worker->status;
+	frame_store(&status_frame[1], elapsed_us, 8);
+	memcpy(&status_frame[FRAME_STATUS_SIZE], worker->error, error_length);
+
+	if (frame_write(fd, FRAME_STATUS, status_frame, FRAME_STATUS_SIZE + error_length) != 0) {
+		return -1;
+	}
+
+	return worker->drop ? -1 : 0;
+}
+
+// serve requests on a connection until the client closes it
+static void serve_connection(server_worker* worker, int fd, uint8_t* request) {
+	for (;;) {
+		uint8_t type;
+		uint32_t size;
+
+		if (frame_read_header(fd, &type, &size) != 0 || type != FRAME_REQUEST || size < FRAME_REQUEST_SIZE) {
+			return;
+		}
+
+		if (frame_read_body(fd, request, size) != 0 || serve_request(worker, fd, request, size) != 0) {
+			return;
+		}
+	}
+}
+
+// accept and serve connections until the server stops
+static void serve_task(void* arg, size_t index, size_t count) {
+	server* srv = (server*) arg;
+	(void) count;
+
+	server_worker worker = {
+		.srv = srv,
+		.ctx = csteg_ctx_new(),
+		.block = (uint8_t*) malloc(FRAME_MAX_SIZE),
+	};
+
+	// request frames hold a name, null terminated once read
+	uint8_t* request = (uint8_t*) malloc(FRAME_MAX_SIZE + 1);
+
+	if (!worker.ctx || !worker.block || !request) {
+		fprintf(stderr, "serve_task() : could not allocate worker %zu\n", index);
+	} else {
+		int failing = 0;
+
+		while (!stopping) {
+			int fd = accept(srv->listen_fd, NULL, NULL);
+			if (fd < 0) {
+				if (stopping || errno == EINTR || errno == ECONNABORTED) {
+					continue;
+				}
+
+				// out of descriptors or memory, which retrying at once
+				// won't change, so wait for connections being served to
+				// finish. reported once until accepting works again
+				if (!failing) {
+					fprintf(stderr, "serve_task() : could not accept a connection: %s\n", strerror(errno));
+					failing = 1;
+				}
+
+				struct timespec backoff = { 0, ACCEPT_BACKOFF_MS * 1000000L };
+				nanosleep(&backoff, NULL);
+				continue;
+			}
+
+			failing = 0;
+			connection_sockets[index] = fd;
+
+			// reads and writes on the connection fail once it times out
+			struct timeval timeout = { SERVER_IDLE_TIMEOUT, 0 };
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+			setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+			// a stop between accept and being recorded above is caught here
+			if (!stopping) {
+				serve_connection(&worker, fd, request);
+			}
+
+			connection_sockets[index] = -1;
+			close(fd);
+		}
+	}
+
+	csteg_ctx_free(worker.ctx);
+	free(worker.block);
+	free(worker.carrier.data);
+	free(worker.data.data);
+	free(request);
+}
+
+//===========================================================================//
+// listening
+//===========================================================================//
+
+// bind a listening socket to socket_path, replacing a stale socket
+static int open_socket(const char* socket_path) {
+	struct sockaddr_un address = { .sun_family = AF_UNIX };
+
+	if (strlen(socket_path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "open_socket() : socket path %s is too long\n", socket_path);
+		return -1;
+	}
+	strcpy(address.sun_path, socket_path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		fprintf(stderr, "open_socket() : could not create socket\n");
+		return -1;
+	}
+
+	int bound = bind(fd, (struct sockaddr*) &address, sizeof(address)) == 0;
+
+	if (!bound && errno == EADDRINUSE) {
+		// a socket nothing answers on was left by a server that is gone
+		struct stat st;
+		int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		int alive = probe >= 0 && connect(probe, (struct sockaddr*) &address, sizeof(address)) == 0;
+		if (probe >= 0) {
+			close(probe);
+		}
+
+		if (alive || stat(socket_path, &st) != 0 || !S_ISSOCK(st.st_mode)) {
+			fprintf(stderr, "open_socket() : %s is in use\n", socket_path);
+			close(fd);
+			return -1;
+		}
+
+		unlink(socket_path);
+		bound = bind(fd, (struct sockaddr*) &address, sizeof(address)) == 0;
+	}
+
+	if (!bound) {
+		fprintf(stderr, "open_socket() : could not bind %s\n", socket_path);
+		close(fd);
+		return -1;
+	}
+
+	if (listen(fd, SERVER_BACKLOG) != 0) {
+		fprintf(stderr, "open_socket() : could not listen on %s\n", socket_path);
+		close(fd);
+		unlink(socket_path);
+		return -1;
+	}
+
+	return fd;
+}
+
+int serve(const char* socket_path, int workers, size_t cache_size) {
+	if (workers > CSTEG_MAX_THREADS) {
+		workers = CSTEG_MAX_THREADS;
+	}
+
+	for (size_t i = 0; i < CSTEG_MAX_THREADS; i++) {
+		connection_sockets[i] = -1;
+	}
+
+	server srv = { .listen_fd = open_socket(socket_path) };
+	if (srv.listen_fd < 0) {
+		return -1;
+	}
+	pthread_mutex_init(&srv.lock, NULL);
+
+	thread_pool* pool = pool_create(workers);
+	if (cache_size > 0) {
+		srv.cache = carrier_cache_create(cache_size);
+	}
+
+	if (!pool || (cache_size > 0 && !srv.cache)) {
+		fprintf(stderr, "serve() : could not start %d threads\n", workers);
+		pool_destroy(pool);
+		carrier_cache_free(srv.cache);
+		close(srv.listen_fd);
+		unlink(socket_path);
+		return -1;
+	}
+
+	// stop on SIGINT or SIGTERM, without restarting accept() or read()
+	struct sigaction action = { .sa_handler = stop_server };
+	sigemptyset(&action.sa_mask);
+	listen_socket = srv.listen_fd;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	struct sigaction fault_action = { .sa_handler = fail_mapping };
+	sigemptyset(&fault_action.sa_mask);
+	sigaction(SIGBUS, &fault_action, NULL);
+
+	pool_run(pool, serve_task, &srv);
+	pool_destroy(pool);
+
+	listen_socket = -1;
+	close(srv.listen_fd);
+	unlink(socket_path);
+
+	// report what was served
+	char text[1024];
+	format_stats(&srv, text, sizeof(text));
+	fputs(text, stderr);
+
+	carrier_cache_free(srv.cache);
+	pthread_mutex_destroy(&srv.lock);
+	return 0;
+}
@@ -0,0 +1,26 @@
+//===================== Copyright 2020, Jake Grossman =======================//
+//
+// Purpose: long running server answering embed, extract and probe requests
+//          over a unix domain socket
+//
+// This file is subject to the terms and conditions defined in the
+// file 'LICENSE.txt', which is part of this source code package
+//
+//===========================================================================//
+#ifndef CSTEG_SERVER_H
+#define CSTEG_SERVER_H
+
+#include <stddef.h> // size_t
+
+// workers serving connections when -j isn't given
+#define SERVER_DEFAULT_WORKERS 4
+
+// serve requests on the unix domain socket socket_path, on workers threads
+// that each handle one connection at a time, until SIGINT or SIGTERM.
+// connections idle for 30 seconds are closed. a stale socket left by a
+// server that is no longer running is replaced. carriers embedded into are
+// kept decoded in up to cache_size bytes, 0 decodes every one. returns 0
+// once stopped, or -1 after printing why to stderr
+int serve(const char* socket_path, int workers, size_t cache_size);
+
+#endif
@@ -0,0 +1,458 @@
+//===================== Copyright 2020, Jake Grossman =======================//
+//
+// Purpose: split a payload across several carriers and reassemble it, with
+//          every shard embedded or extracted on a pool of worker threads
+//
+// Shards are laid out by probing the header of each carrier for its
+// capacity, so no image is decoded before it is written. Every shard records
+// its offset in the payload, so extraction writes each one straight to its
+// place in the output file, in whatever order the workers finish.
+//
+// This file is subject to the terms and conditions defined in the
+// file 'LICENSE.txt', which is part of this source code package
+//
+//===========================================================================//
+#include <stdio.h>
+#include <stdlib.h> // malloc, qsort
+#include <stdint.h> // uint8_t, uint64_t
+#include <string.h> // strlen, strrchr
+#include <unistd.h> // access, pwrite, ftruncate, getentropy
+#include <fcntl.h> // open
+#include <time.h> // time
+#include <sys/stat.h> // stat
+#include <pthread.h>
+#include "shard.h"
+#include "pool.h"
+
+// size of the blocks extracted data is written in, by each worker
+#define SHARD_BLOCK_SIZE (1 << 20)
+
+// a shard and the images it is embedded from or extracted from
+typedef struct {
+	const char* png_in; // carrier when embedding, shard when extracting
+	char* png_out; // image written when embedding
+	int written; // whether png_out was written, when embedding
+	char* name; // name of the payload, when extracting
+	csteg_shard shard;
+} shard_item;
+
+// shards handled by every thread of a pool
+typedef struct {
+	const shard_options* options;
+	const char* data_filename; // file embedded when embedding
+	int fd; // file written when extracting
+	shard_item* items;
+	size_t count;
+	size_t next; // index of the next shard to be handled, taken atomically
+	pthread_mutex_t lock; // held while reporting a failure
+	int failed; // whether any shard failed
+} shard_job;
+
+// report why the shard in filename failed
+static void shard_error(shard_job* job, const char* filename, const char* message) {
+	pthread_mutex_lock(&job->lock);
+	fprintf(stderr, "%s: %s\n", filename, message);
+	job->failed = 1;
+	pthread_mutex_unlock(&job->lock);
+}
+
+// index of the next shard a worker handles, job->count once there are none left
+static size_t next_shard(shard_job* job) {
+	size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+	return i < job->count ? i : job->count;
+}
+
+// context of a worker, running on a single thread
+static csteg_ctx* shard_ctx(const shard_options* options) {
+	csteg_ctx* ctx = csteg_ctx_new();
+
+	if (ctx) {
+		csteg_set_depth(ctx, options->depth);
+		csteg_set_alpha(ctx, options->alpha);
+		csteg_set_compression(ctx, options->compression);
+	}
+
+	return ctx;
+}
+
+// run task on workers threads, no more than there are shards. returns -1
+// if they can't be started
+static int run_shards(shard_job* job, pool_task task) {
+	size_t workers = (size_t) job->options->workers < job->count ? (size_t) job->options->workers : job->count;
+
+	thread_pool* pool = pool_create(workers);
+	if (!pool) {
+		fprintf(stderr, "run_shards() : could not start %zu threads\n", workers);
+		return -1;
+	}
+
+	job->next = 0;
+	pool_run(pool, task, job);
+	pool_destroy(pool);
+
+	return job->failed ? -1 : 0;
+}
+
+//===========================================================================//
+// embedding
+//===========================================================================//
+
+// name shard index is written to, png_out with .index inserted before its
+// extension, released with free()
+static char* shard_filename(const char* png_out, size_t index) {
+	const char* base = strrchr(png_out, '/');
+	const char* extension = strrchr(base ? base : png_out, '.');
+	size_t stem = extension ? (size_t) (extension - png_out) : strlen(png_out);
+
+	size_t size = strlen(png_out) + 24;
+	char* filename = (char*) malloc(size);
+
+	if (filename) {
+		snprintf(filename, size, "%.*s.%zu%s", (int) stem, png_out, index, extension ? extension : "");
+	}
+
+	return filename;
+}
+
+// random id shared by the shards of a payload
+static uint64_t payload_id(void) {
+	uint64_t id;
+
+	if (getentropy(&id, sizeof(id)) != 0) {
+		// only needs to tell payloads apart, not be unpredictable
+		id = ((uint64_t) time(NULL) << 32) ^ (uint64_t) getpid();
+	}
+
+	return id;
+}
+
+// embed shards until there are none left
+static void embed_task(void* arg, size_t index, size_t count) {
+	shard_job* job = (shard_job*) arg;
+	csteg_ctx* ctx = shard_ctx(job->options);
+	(void) index;
+	(void) count;
+
+	for (size_t i; (i = next_shard(job)) < job->count;) {
+		shard_item* item = &job->items[i];
+
+		if (!ctx) {
+			shard_error(job, item->png_in, "embed_task() : could not allocate context");
+		} else if (csteg_embed_shard_file(ctx, item->png_in, job->data_filename, &item->shard, item->png_out) != CSTEG_OK) {
+			shard_error(job, item->png_in, csteg_ctx_error(ctx));
+		} else {
+			item->written = 1;
+		}
+	}
+
+	csteg_ctx_free(ctx);
+}
+
+// lay out the shards of a payload of size bytes across the carriers into
+// items, returning the number of shards or -1 if they don't fit
+static int plan_shards(const char* data_filename, uint64_t size, char** carriers, int count, const shard_options* options,
+                       shard_item* items) {
+	csteg_ctx* ctx = csteg_ctx_new();
+	if (!ctx) {
+		fprintf(stderr, "plan_shards() : could not allocate context\n");
+		return -1;
+	}
+
+	// every shard stores the name and the shard fields ahead of its data
+	size_t name_length = strlen(data_filename) + CSTEG_SHARD_HEADER_SIZE;
+	uint64_t offset = 0;
+	int shards = 0;
+
+	for (int i = 0; i < count && (offset < size || shards == 0); i++) {
+		csteg_image image;
+		if (csteg_probe_file(ctx, carriers[i], &image) != CSTEG_OK) {
+			fprintf(stderr, "%s: %s\n", carriers[i], csteg_ctx_error(ctx));
+			csteg_ctx_free(ctx);
+			return -1;
+		}
+
+		// carriers too small to hold any data are passed over
+		uint64_t capacity = csteg_capacity(&image, options->depth, options->alpha, name_length);
+		uint64_t shard_size = size - offset < capacity ? size - offset : capacity;
+		if (shard_size == 0 && size > 0) {
+			continue;
+		}
+
+		items[shards++] = (shard_item) {
+			.png_in = carriers[i],
+			.shard = { .offset = offset, .size = shard_size, .total_size = size },
+		};
+		offset += shard_size;
+	}
+	csteg_ctx_free(ctx);
+
+	if (offset < size) {
+		fprintf(stderr, "plan_shards() : carriers can only hold %llu of the %llu bytes of %s at %d bits per channel\n",
+		        (unsigned long long) offset, (unsigned long long) size, data_filename, options->depth);
+		return -1;
+	}
+
+	return shards;
+}
+
+int shard_embed(const char* data_filename, char** carriers, int count, const char* png_out, const shard_options* options) {
+	// the size has to be known to lay out the shards, and every worker maps the file
+	struct stat st;
+	if (stat(data_filename, &st) != 0 || !S_ISREG(st.st_mode)) {
+		fprintf(stderr, "shard_embed() : File %s is not a regular file\n", data_filename);
+		return -1;
+	}
+
+	shard_item* items = (shard_item*) calloc(count, sizeof(shard_item));
+	if (!items) {
+		fprintf(stderr, "shard_embed() : could not allocate %d shards\n", count);
+		return -1;
+	}
+
+	int shards = plan_shards(data_filename, st.st_size, carriers, count, options, items);
+	int result = shards < 0 ? -1 : 0;
+
+	// name every shard, and number them now that their count is known
+	uint64_t id = payload_id();
+	for (int i = 0; i < shards && result == 0; i++) {
+		items[i].shard.id = id;
+		items[i].shard.index = i;
+		items[i].shard.count = shards;
+		items[i].png_out = shard_filename(png_out, i);
+
+		if (!items[i].png_out) {
+			fprintf(stderr, "shard_embed() : out of memory\n");
+			result = -1;
+		} else if (!options->force && access(items[i].png_out, F_OK) != -1) {
+			fprintf(stderr, "shard_embed() : File %s already exists\n", items[i].png_out);
+			result = -1;
+		}
+	}
+
+	if (result == 0) {
+		shard_job job = {
+			.options = options,
+			.data_filename = data_filename,
+			.fd = -1,
+			.items = items,
+			.count = shards,
+			.failed = 0,
+		};
+
+		pthread_mutex_init(&job.lock, NULL);
+		result = run_shards(&job, embed_task);
+		pthread_mutex_destroy(&job.lock);
+
+		// a partial set of shards can't be extracted, so none are kept. files
+		// of shards that failed are left as they were
+		if (result != 0) {
+			for (int i = 0; i < shards; i++) {
+				if (items[i].written) {
+					remove(items[i].png_out);
+				}
+			}
+		}
+	}
+
+	for (int i = 0; i < count; i++) {
+		free(items[i].png_out);
+	}
+	free(items);
+
+	return result;
+}
+
+//===========================================================================//
+// extracting
+//===========================================================================//
+
+// read the signature of every shard until there are none left
+static void scan_task(void* arg, size_t index, size_t count) {
+	shard_job* job = (shard_job*) arg;
+	csteg_ctx* ctx = csteg_ctx_new();
+	(void) index;
+	(void) count;
+
+	for (size_t i; (i = next_shard(job)) < job->count;) {
+		shard_item* item = &job->items[i];
+
+		if (!ctx) {
+			shard_error(job, item->png_in, "scan_task() : could not allocate context");
+			continue;
+		}
+
+		// only the rows holding the signature are decoded
+		if (csteg_open_file(ctx, item->png_in) != CSTEG_OK) {
+			shard_error(job, item->png_in, csteg_ctx_error(ctx));
+			continue;
+		}
+
+		if (!csteg_payload_shard(ctx, &item->shard)) {
+			shard_error(job, item->png_in, "scan_task() : image does not hold a shard");
+		} else if (!(item->name = strdup(csteg_payload_name(ctx)))) {
+			shard_error(job, item->png_in, "scan_task() : out of memory");
+		}
+
+		csteg_close(ctx);
+	}
+
+	csteg_ctx_free(ctx);
+}
+
+// extract shards into job->fd, each at its offset, until there are none left
+static void extract_task(void* arg, size_t index, size_t count) {
+	shard_job* job = (shard_job*) arg;
+	csteg_ctx* ctx = csteg_ctx_new();
+	uint8_t* block = (uint8_t*) malloc(SHARD_BLOCK_SIZE);
+	(void) index;
+	(void) count;
+
+	for (size_t i; (i = next_shard(job)) < job->count;) {
+		shard_item* item = &job->items[i];
+
+		if (!ctx || !block) {
+			shard_error(job, item->png_in, "extract_task() : out of memory");
+			continue;
+		}
+
+		if (csteg_open_file(ctx, item->png_in) != CSTEG_OK) {
+			shard_error(job, item->png_in, csteg_ctx_error(ctx));
+			continue;
+		}
+
+		uint64_t offset = item->shard.offset;
+		size_t size;
+
+		do {
+			if (csteg_read(ctx, block, SHARD_BLOCK_SIZE, &size) != CSTEG_OK) {
+				shard_error(job, item->png_in, csteg_ctx_error(ctx));
+				break;
+			}
+
+			// shards never overlap, so workers write to the file at once
+			size_t written = 0;
+			while (written < size) {
+				ssize_t length = pwrite(job->fd, block + written, size - written, offset + written);
+				if (length <= 0) {
+					break;
+				}
+				written += length;
+			}
+
+			if (written < size) {
+				shard_error(job, item->png_in, "extract_task() : error writing payload");
+				break;
+			}
+			offset += size;
+		} while (size == SHARD_BLOCK_SIZE);
+
+		csteg_close(ctx);
+	}
+
+	csteg_ctx_free(ctx);
+	free(block);
+}
+
+// order shards by index
+static int compare_shards(const void* a, const void* b) {
+	uint32_t index_a = ((const shard_item*) a)->shard.index;
+	uint32_t index_b = ((const shard_item*) b)->shard.index;
+
+	return (index_a > index_b) - (index_a < index_b);
+}
+
+// check that the shards are every shard of a single payload, sorting them
+// by index. returns -1 after printing why if they aren't
+static int check_shards(shard_item* items, size_t count) {
+	qsort(items, count, sizeof(shard_item), compare_shards);
+
+	const csteg_shard* first = &items[0].shard;
+	uint64_t offset = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		const csteg_shard* shard = &items[i].shard;
+
+		if (shard->id != first->id || shard->total_size != first->total_size || strcmp(items[i].name, items[0].name) != 0) {
+			fprintf(stderr, "%s: shard of a different payload than %s\n", items[i].png_in, items[0].png_in);
+			return -1;
+		}
+
+		if (shard->count != count || shard->index != i || shard->offset != offset) {
+			fprintf(stderr, "%s: shard %u of %u does not follow the shards before it, %zu shards were given\n",
+			        items[i].png_in, shard->index + 1, shard->count, count);
+			return -1;
+		}
+
+		offset += shard->size;
+	}
+
+	if (offset != first->total_size) {
+		fprintf(stderr, "check_shards() : shards hold %llu of the %llu bytes of %s\n",
+		        (unsigned long long) offset, (unsigned long long) first->total_size, items[0].name);
+		return -1;
+	}
+
+	return 0;
+}
+
+int shard_extract(char** shards, int count, const shard_options* options) {
+	shard_item* items = (shard_item*) calloc(count, sizeof(shard_item));
+	if (!items) {
+		fprintf(stderr, "shard_extract() : could not allocate %d shards\n", count);
+		return -1;
+	}
+
+	for (int i = 0; i < count; i++) {
+		items[i].png_in = shards[i];
+	}
+
+	shard_job job = {
+		.options = options,
+		.fd = -1,
+		.items = items,
+		.count = count,
+		.failed = 0,
+	};
+	pthread_mutex_init(&job.lock, NULL);
+
+	// read every signature before the output is created
+	int result = run_shards(&job, scan_task);
+	if (result == 0) {
+		result = check_shards(items, count);
+	}
+
+	const char* data_filename = items[0].name;
+	if (result == 0 && !options->force && access(data_filename, F_OK) != -1) {
+		fprintf(stderr, "shard_extract() : File %s already exists\n", data_filename);
+		result = -1;
+	}
+
+	if (result == 0) {
+		// sized up front, so every shard can be written at its offset
+		job.fd = open(data_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (job.fd < 0 || ftruncate(job.fd, items[0].shard.total_size) != 0) {
+			fprintf(stderr, "shard_extract() : could not open %s for writing\n", data_filename);
+			result = -1;
+		} else {
+			result = run_shards(&job, extract_task);
+		}
+
+		if (job.fd >= 0 && close(job.fd) != 0) {
+			fprintf(stderr, "shard_extract() : error writing to %s\n", data_filename);
+			result = -1;
+		}
+
+		if (result != 0 && job.fd >= 0) {
+			remove(data_filename);
+		}
+	}
+
+	pthread_mutex_destroy(&job.lock);
+
+	for (int i = 0; i < count; i++) {
+		free(items[i].name);
+	}
+	free(items);
+
+	return result;
+}
@@ -0,0 +1,35 @@
+//===================== Copyright 2020, Jake Grossman =======================//
+//
+// Purpose: split a payload across several carriers and reassemble it, with
+//          every shard embedded or extracted on a pool of worker threads
+//
+// This file is subject to the terms and conditions defined in the
+// file 'LICENSE.txt', which is part of this source code package
+//
+//===========================================================================//
+#ifndef CSTEG_SHARD_H
+#define CSTEG_SHARD_H
+
+#include "csteg.h"
+
+// options every shard is embedded or extracted with
+typedef struct {
+	int workers; // shards embedded or extracted at once, each on a single thread
+	int force; // overwrite existing output files
+	int depth; // bits per channel when embedding
+	int alpha; // also store data in alpha channels when embedding
+	csteg_compression compression; // compression of images written
+} shard_options;
+
+// split the file data_filename across the carriers, in order, filling each
+// to capacity before moving on to the next. shard i is written to png_out
+// with .i inserted before its extension. carriers past the last shard
+// needed are left unused. either every shard is written or none are.
+// returns 0, or -1 after printing why to stderr
+int shard_embed(const char* data_filename, char** carriers, int count, const char* png_out, const shard_options* options);
+
+// reassemble the payload split across the shards, given in any order, into
+// the file named by the shards. returns 0, or -1 after printing why to stderr
+int shard_extract(char** shards, int count, const shard_options* options);
+
+#endif
@@ -0,0 +1,145 @@
+//===================== Copyright 2020, Jake Grossman =======================//
+//
+// Purpose: write an image of random pixels for the command line tests
+//
+// usage: test/carrier width height image_out
+//
+// The image is an rgb png, or a binary ppm or 24-bit bmp when image_out ends
+// in .ppm or .bmp.
+//
+// The same size always gives the same pixels, so a failing test can be
+// repeated with the image it failed on.
+//
+// This file is subject to the terms and conditions defined in the
+// file 'LICENSE.txt', which is part of this source code package
+//
+//===========================================================================//
+#include <stdio.h>
+#include <stdlib.h> // malloc, strtol
+#include <stdint.h> // uint8_t
+#include <string.h> // strrchr, strcmp
+#include <png.h> // png_image
+
+// write width by height rgb pixels as a png
+static int write_png(const char* filename, long width, long height, const uint8_t* pixels) {
+	png_image image = {
+		.version = PNG_IMAGE_VERSION,
+		.width = (png_uint_32) width,
+		.height = (png_uint_32) height,
+		.format = PNG_FORMAT_RGB,
+	};
+
+	if (!png_image_write_to_file(&image, filename, 0, pixels, 0, NULL)) {
+		fprintf(stderr, "write_png() : %s\n", image.message);
+		return -1;
+	}
+
+	return 0;
+}
+
+// write width by height rgb pixels as a binary ppm
+static int write_ppm(const char* filename, long width, long height, const uint8_t* pixels) {
+	FILE* file_ptr = fopen(filename, "wb");
+	if (!file_ptr) {
+		fprintf(stderr, "write_ppm() : could not open %s for writing\n", filename);
+		return -1;
+	}
+
+	size_t size = (size_t) width * height * 3;
+	fprintf(file_ptr, "P6\n%ld %ld\n255\n", width, height);
+	int result = fwrite(pixels, 1, size, file_ptr) == size ? 0 : -1;
+	if (fclose(file_ptr) != 0 || result != 0) {
+		fprintf(stderr, "write_ppm() : error writing to %s\n", filename);
+		return -1;
+	}
+
+	return 0;
+}
+
+// store value in size bytes, least significant first
+static void put_le(uint8_t* dest, uint32_t value, int size) {
+	for (int i = 0; i < size; i++) {
+		dest[i] = (uint8_t) (value >> (8 * i));
+	}
+}
+
+// write width by height rgb pixels as a bottom-up 24-bit bmp
+static int write_bmp(const char* filename, long width, long height, const uint8_t* pixels) {
+	FILE* file_ptr = fopen(filename, "wb");
+	if (!file_ptr) {
+		fprintf(stderr, "write_bmp() : could not open %s for writing\n", filename);
+		return -1;
+	}
+
+	// rows are padded to a multiple of 4 bytes
+	size_t row_size = ((size_t) width * 3 + 3) & ~(size_t) 3;
+	uint8_t header[54] = { 'B', 'M' };
+	put_le(header + 2, (uint32_t) (sizeof(header) + row_size * height), 4);
+	put_le(header + 10, sizeof(header), 4); // offset of the pixels
+	put_le(header + 14, 40, 4); // BITMAPINFOHEADER
+	put_le(header + 18, (uint32_t) width, 4);
+	put_le(header + 22, (uint32_t) height, 4);
+	put_le(header + 26, 1, 2); // planes
+	put_le(header + 28, 24, 2); // bits per pixel
+
+	int result = fwrite(header, 1, sizeof(header), file_ptr) == sizeof(header) ? 0 : -1;
+
+	uint8_t row[16384 * 3 + 3] = { 0 };
+	for (long y = height - 1; y >= 0 && result == 0; y--) {
+		const uint8_t* src = pixels + (size_t) y * width * 3;
+		for (long x = 0; x < width; x++) {
+			row[x * 3] = src[x * 3 + 2];
+			row[x * 3 + 1] = src[x * 3 + 1];
+			row[x * 3 + 2] = src[x * 3];
+		}
+		if (fwrite(row, 1, row_size, file_ptr) != row_size) {
+			result = -1;
+		}
+	}
+
+	if (fclose(file_ptr) != 0 || result != 0) {
+		fprintf(stderr, "write_bmp() : error writing to %s\n", filename);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	if (argc != 4) {
+		fprintf(stderr, "usage: %s width height image_out\n", argv[0]);
+		return 1;
+	}
+
+	long width = strtol(argv[1], NULL, 10);
+	long height = strtol(argv[2], NULL, 10);
+	if (width <= 0 || height <= 0 || width > 16384 || height > 16384) {
+		fprintf(stderr, "main() : bad size %sx%s\n", argv[1], argv[2]);
+		return 1;
+	}
+
+	size_t size = (size_t) width * height * 3;
+	uint8_t* pixels = (uint8_t*) malloc(size);
+	if (!pixels) {
+		fprintf(stderr, "main() : out of memory\n");
+		return 1;
+	}
+
+	srand((unsigned) (width * 16384 + height));
+	for (size_t i = 0; i < size; i++) {
+		pixels[i] = (uint8_t) rand();
+	}
+
+	const char* extension = strrchr(argv[3], '.');
+	int result;
+	if (extension && strcmp(extension, ".ppm") == 0) {
+		result = write_ppm(argv[3], width, height, pixels);
+	} else if (extension && strcmp(extension, ".bmp") == 0) {
+		result = write_bmp(argv[3], width, height, pixels);
+	} else {
+		result = write_png(argv[3], width, height, pixels);
+	}
+	free(pixels);
+
+	return result == 0 ? 0 : 1;
+}
@@ -0,0 +1,201 @@
+#!/bin/sh
+#===================== Copyright 2020, Jake Grossman =======================#
+#
+# Purpose: run csteg the way a user would and check the files it leaves
+#
+# Run from the top of the tree by make test. Each check works in a scratch
+# directory that is removed on exit, so files are named relative to it.
+#
+# This file is subject to the terms and conditions defined in the
+# file 'LICENSE.txt', which is part of this source code package
+#
+#===========================================================================#
+
+top=$(pwd)
+csteg="$top/csteg"
+carrier="$top/test/carrier"
+
+work=$(mktemp -d) || exit 1
+server=
+trap 'stop_server; rm -rf "$work"' EXIT
+cd "$work" || exit 1
+
+failures=0
+
+# report a failed check and keep going
+fail() {
+	echo "FAIL: $*"
+	failures=$((failures + 1))
+}
+
+# write $2 bytes of random data to $1
+data() {
+	head -c "$2" /dev/urandom > "$1"
+}
+
+# serve on the socket $1 in the background, waiting until it accepts
+start_server() {
+	"$csteg" --serve="$1" 2> "$1.err" &
+	server=$!
+	tries=0
+	while [ ! -S "$1" ] && [ $tries -lt 50 ]; do
+		sleep 0.1
+		tries=$((tries + 1))
+	done
+	[ -S "$1" ] || fail "server on $1 did not start: $(cat "$1.err")"
+}
+
+# shut down the server started last, if it is running
+stop_server() {
+	if [ -n "$server" ]; then
+		kill "$server" 2> /dev/null
+		wait "$server" 2> /dev/null
+		server=
+	fi
+}
+
+# batch: good lines run even when one fails, and the failing line is named
+"$carrier" 64 64 batch.png
+data batch_a.bin 1000
+data batch_b.bin 2000
+printf 'batch.png\tbatch_a.bin\tbatch_a.png\nbatch.png\tmissing.bin\tbatch_m.png\n# comment\n\nbatch.png\tbatch_b.bin\tbatch_b.png\n' > embed.txt
+if "$csteg" -j2 --batch=embed.txt 2> batch.err; then
+	fail "batch: exited 0 with a missing data file"
+fi
+grep -q '^embed.txt:2: .*missing.bin' batch.err || fail "batch: line 2 not reported: $(cat batch.err)"
+[ "$(wc -l < batch.err)" -eq 1 ] || fail "batch: more than line 2 reported: $(cat batch.err)"
+[ -e batch_m.png ] && fail "batch: output of the failing line written"
+printf 'batch_a.png\tbatch_a.out\nbatch_b.png\n' > extract.txt
+mv batch_b.bin batch_b.orig
+"$csteg" -j2 --batch=extract.txt || fail "batch: extraction failed"
+cmp -s batch_a.out batch_a.bin || fail "batch: batch_a.out differs"
+cmp -s batch_b.bin batch_b.orig || fail "batch: batch_b.bin not extracted to its stored name"
+
+# shards: data too large for any one carrier is split across all of them,
+# read back in any order, and refused when a shard is missing
+"$carrier" 64 64 shard_a.png
+"$carrier" 64 64 shard_b.png
+"$carrier" 48 48 shard_c.png
+data shard.bin 7000
+"$csteg" -w -d shard.bin -o shard.png shard_a.png shard_b.png shard_c.png || fail "shards: split failed"
+[ -f shard.0.png ] && [ -f shard.1.png ] && [ -f shard.2.png ] || fail "shards: not split across 3 carriers"
+mv shard.bin shard.orig
+"$csteg" -r shard.2.png shard.0.png shard.1.png || fail "shards: reassembly failed"
+cmp -s shard.bin shard.orig || fail "shards: reassembled data differs"
+rm -f shard.bin
+if "$csteg" -r shard.0.png shard.2.png 2> shard.err; then
+	fail "shards: exited 0 with a missing shard"
+fi
+grep -q 'shard 1 of 3' shard.err || fail "shards: missing shard not reported: $(cat shard.err)"
+[ -e shard.bin ] && fail "shards: data written with a missing shard"
+
+# carrier pool: the smallest indexed carrier that holds the data is picked,
+# at the depth asked for
+mkdir pool
+"$carrier" 32 32 pool/small.png
+"$carrier" 64 64 pool/medium.png
+"$carrier" 128 128 pool/large.png
+"$csteg" --index=pool || fail "pool: indexing failed"
+data pick.bin 1000
+"$csteg" -w --carrier-pool=pool -d pick.bin -o pick.png || fail "pool: embed failed"
+"$csteg" -c -i pick.png | grep -q '^width: 64$' || fail "pool: 64x64 carrier not picked for 1000 bytes"
+"$csteg" -w -b 4 --carrier-pool=pool -d pick.bin -o pick4.png || fail "pool: embed at 4 bits failed"
+"$csteg" -c -i pick4.png | grep -q '^width: 32$' || fail "pool: 32x32 carrier not picked for 1000 bytes at 4 bits"
+mv pick.bin pick.orig
+"$csteg" -r -i pick4.png || fail "pool: extraction failed"
+cmp -s pick.bin pick.orig || fail "pool: extracted data differs"
+data huge.bin 100000
+if "$csteg" -w --carrier-pool=pool -d huge.bin -o huge.png 2> pool.err; then
+	fail "pool: exited 0 with no carrier large enough"
+fi
+grep -q 'no carrier in pool' pool.err || fail "pool: missing carrier not reported: $(cat pool.err)"
+
+# server: carriers and data that aren't regular files are streamed through
+# the socket, both ways
+start_server stream.sock
+"$carrier" 64 64 stream.png
+data stream.bin 1500
+mkfifo stream.fifo
+cat stream.bin > stream.fifo &
+"$csteg" --client=stream.sock -w -i stream.png -d stream.fifo -o stream_out.png || fail "stream: embed failed"
+# the writer is still blocked opening the fifo if the client never did
+kill $! 2> /dev/null
+wait $! 2> /dev/null
+rm -f stream.fifo
+cat stream_out.png | "$csteg" --client=stream.sock -r -i /dev/stdin || fail "stream: extraction failed"
+cmp -s stream.fifo stream.bin || fail "stream: extracted data differs"
+rm -f stream.fifo
+"$csteg" -r -i stream_out.png || fail "stream: served png not readable locally"
+cmp -s stream.fifo stream.bin || fail "stream: data extracted locally differs"
+stop_server
+
+# server: regular files are passed as descriptors, mapped by the server and
+# extracted straight into the output file
+start_server pass.sock
+"$carrier" 64 64 pass.png
+data pass.bin 2500
+"$csteg" --client=pass.sock -w -i pass.png -d pass.bin -o pass_out.png || fail "pass: embed failed"
+"$csteg" --client=pass.sock -c -i pass_out.png | grep -q '^width: 64$' || fail "pass: probe failed"
+if "$csteg" --client=pass.sock -r -i pass_out.png 2> pass.err; then
+	fail "pass: extraction overwrote pass.bin without -f"
+fi
+mv pass.bin pass.orig
+"$csteg" --client=pass.sock -r -i pass_out.png || fail "pass: extraction failed"
+cmp -s pass.bin pass.orig || fail "pass: extracted data differs"
+data pass.bin 5000
+"$csteg" -f --client=pass.sock -r -i pass_out.png || fail "pass: extraction with -f failed"
+cmp -s pass.bin pass.orig || fail "pass: data extracted over a longer file differs"
+stop_server
+
+# cache: a carrier embedded into twice is decoded once, which --stats counts
+start_server cache.sock
+"$carrier" 64 64 cache.png
+data cache.bin 1000
+"$csteg" --client=cache.sock -w -i cache.png -d cache.bin -o cache_1.png || fail "cache: first embed failed"
+"$csteg" --client=cache.sock -w -i cache.png -d cache.bin -o cache_2.png || fail "cache: second embed failed"
+cmp -s cache_1.png cache_2.png || fail "cache: embedding from the cached carrier gave a different png"
+"$csteg" --client=cache.sock --stats > cache.stats || fail "cache: --stats failed"
+grep -q '^carrier cache: 1 hits, 1 misses' cache.stats || fail "cache: hit not counted: $(cat cache.stats)"
+stop_server
+
+# precook: a precooked carrier gives the same png as the one it was made
+# from, locally and through the server
+"$carrier" 64 64 cook.png
+data cook.bin 2000
+"$csteg" --precook cook.png cook.raw || fail "precook: precook failed"
+"$csteg" -w -i cook.png -d cook.bin -o cook_png.png || fail "precook: embed from the png failed"
+"$csteg" -w -i cook.raw -d cook.bin -o cook_raw.png || fail "precook: embed from the precooked carrier failed"
+cmp -s cook_png.png cook_raw.png || fail "precook: precooked carrier gave a different png"
+start_server cook.sock
+"$csteg" --client=cook.sock -w -i cook.raw -d cook.bin -o cook_served.png || fail "precook: served embed failed"
+cmp -s cook_png.png cook_served.png || fail "precook: served precooked carrier gave a different png"
+stop_server
+mv cook.bin cook.orig
+"$csteg" -r -i cook_raw.png || fail "precook: extraction failed"
+cmp -s cook.bin cook.orig || fail "precook: extracted data differs"
+
+# uncompressed: ppm and bmp carriers are copied to an output of the same
+# format and size, or embedded into in place, and read back
+for format in ppm bmp; do
+	"$carrier" 61 37 "raw.$format"
+	data raw.bin 1500
+	"$csteg" -w -i "raw.$format" -d raw.bin -o "raw_out.$format" || fail "$format: embed failed"
+	[ "$(wc -c < "raw_out.$format")" -eq "$(wc -c < "raw.$format")" ] || fail "$format: output size differs"
+	mv raw.bin raw.orig
+	"$csteg" -r -i "raw_out.$format" || fail "$format: extraction failed"
+	cmp -s raw.bin raw.orig || fail "$format: extracted data differs"
+	data raw.bin 1200
+	cp raw.bin raw.orig
+	"$csteg" -f -w -i "raw.$format" -d raw.bin -o "raw.$format" || fail "$format: in place embed failed"
+	[ "$(wc -c < "raw.$format")" -eq "$(wc -c < "raw_out.$format")" ] || fail "$format: in place embed changed the size"
+	rm raw.bin
+	"$csteg" -r -i "raw.$format" || fail "$format: in place extraction failed"
+	cmp -s raw.bin raw.orig || fail "$format: data embedded in place differs"
+	rm -f raw.bin raw.orig
+done
+
+if [ "$failures" -ne 0 ]; then
+	echo "cli: $failures checks failed"
+	exit 1
+fi
+echo "cli: ok"
@@ -0,0 +1,335 @@
+//===================== Copyright 2020, Jake Grossman =======================//
+//
+// Purpose: embed into and extract from small pngs with every kernel, depth
+//          and number of threads
+//
+// Images with fewer rows than threads leave some threads without rows, which
+// the encoder has to handle. Every png written is decoded whole by libpng,
+// so a corrupt stream fails even if csteg could still read its own rows.
+// Payloads fill the carrier, so the vector loops and their tails both run.
+//
+// This file is subject to the terms and conditions defined in the
+// file 'LICENSE.txt', which is part of this source code package
+//
+//===========================================================================//
+#include <stdio.h>
+#include <stdlib.h> // malloc
+#include <stdint.h> // uint8_t
+#include <string.h> // memcmp
+#include <png.h> // png_image
+#include "../src/csteg.h"
+
+#define MAX_THREADS 8
+#define MAX_DATA_SIZE 4096
+#define DATA_NAME "roundtrip.bin"
+
+// legacy signatures, written before versioned ones, hold a 32-bit filename
+// length, whose top byte may hold flags, and a 32-bit data size
+#define LEGACY_HEADER_SIZE 8
+#define LEGACY_FLAG_PRESENT 0x80
+#define LEGACY_DATA_SIZE 200
+#define LEGACY_SIZE 64
+
+// png being written to memory
+typedef struct {
+	uint8_t* data;
+	size_t size;
+	size_t capacity;
+} png_buffer;
+
+static void write_buffer(png_structp png_ptr, png_bytep data, png_size_t size) {
+	png_buffer* buffer = (png_buffer*) png_get_io_ptr(png_ptr);
+
+	if (size > buffer->capacity - buffer->size) {
+		size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+		while (size > capacity - buffer->size) {
+			capacity *= 2;
+		}
+
+		uint8_t* data = (uint8_t*) realloc(buffer->data, capacity);
+		if (!data) {
+			png_error(png_ptr, "out of memory");
+		}
+		buffer->data = data;
+		buffer->capacity = capacity;
+	}
+
+	memcpy(buffer->data + buffer->size, data, size);
+	buffer->size += size;
+}
+
+static void flush_buffer(png_structp png_ptr) {
+	(void) png_ptr;
+}
+
+// encode a png of pixels, random unless given, NULL if libpng fails
+static void* make_png(size_t width, size_t height, int color_type, int bit_depth, int interlace,
+                      const uint8_t* pixels, size_t* size) {
+	png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	png_infop info_ptr = png_ptr ? png_create_info_struct(png_ptr) : NULL;
+	png_buffer buffer = { 0 };
+	uint8_t* random = NULL;
+
+	if (!info_ptr || setjmp(png_jmpbuf(png_ptr))) {
+		png_destroy_write_struct(&png_ptr, &info_ptr);
+		free(buffer.data);
+		free(random);
+		return NULL;
+	}
+
+	png_set_write_fn(png_ptr, &buffer, write_buffer, flush_buffer);
+	png_set_IHDR(png_ptr, info_ptr, width, height, bit_depth, color_type, interlace,
+	             PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_set_compression_level(png_ptr, 1);
+	png_write_info(png_ptr, info_ptr);
+
+	size_t rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+	if (!pixels) {
+		random = (uint8_t*) malloc(rowbytes * height);
+		if (!random) {
+			png_error(png_ptr, "out of memory");
+		}
+		for (size_t i = 0; i < rowbytes * height; i++) {
+			random[i] = rand();
+		}
+		pixels = random;
+	}
+
+	// every pass of an interlaced image is written from the same rows
+	int passes = png_set_interlace_handling(png_ptr);
+	for (int pass = 0; pass < passes; pass++) {
+		for (size_t y = 0; y < height; y++) {
+			png_write_row(png_ptr, (png_const_bytep) &pixels[y * rowbytes]);
+		}
+	}
+
+	png_write_end(png_ptr, info_ptr);
+	png_destroy_write_struct(&png_ptr, &info_ptr);
+	free(random);
+
+	*size = buffer.size;
+	return buffer.data;
+}
+
+// whether libpng decodes the whole of a png without error
+static int decodes(const void* png, size_t size) {
+	png_image image;
+	memset(&image, 0, sizeof(image));
+	image.version = PNG_IMAGE_VERSION;
+
+	if (!png_image_begin_read_from_memory(&image, png, size)) {
+		return 0;
+	}
+
+	uint8_t* pixels = (uint8_t*) malloc(PNG_IMAGE_SIZE(image));
+	int ok = pixels && png_image_finish_read(&image, NULL, pixels, 0, NULL);
+
+	free(pixels);
+	png_image_free(&image);
+	return ok;
+}
+
+// extract the payload of png and compare it with data_size bytes of data,
+// returning 0 if they match
+static int check_payload(csteg_ctx* ctx, const void* png, size_t png_size, const uint8_t* data, size_t data_size) {
+	char* name;
+	void* extracted;
+	size_t extracted_size;
+
+	if (csteg_extract_memory(ctx, png, png_size, &name, &extracted, &extracted_size) != CSTEG_OK) {
+		fprintf(stderr, "extracting: %s\n", csteg_ctx_error(ctx));
+		return -1;
+	}
+
+	int result = 0;
+	if (extracted_size != data_size || memcmp(extracted, data, data_size) != 0 || strcmp(name, DATA_NAME) != 0) {
+		fprintf(stderr, "the data extracted differs from the data embedded\n");
+		result = -1;
+	}
+
+	free(name);
+	free(extracted);
+	return result;
+}
+
+// store size bytes in the low depth bits of consecutive channels from
+// channel on, first byte and most significant bits first, as every version
+// stores them. returns the channel following them
+static size_t store_bits(uint8_t* channels, size_t channel, const uint8_t* bytes, size_t size, int depth) {
+	for (size_t bit = 0; bit < size * 8; bit++) {
+		int value = (bytes[bit / 8] >> (7 - bit % 8)) & 1;
+		int shift = depth - 1 - bit % depth;
+		uint8_t* target = &channels[channel + bit / depth];
+		*target = (*target & ~(1 << shift)) | (value << shift);
+	}
+
+	return channel + (size * 8 + depth - 1) / depth;
+}
+
+// write an 8-bit RGB png holding data under a legacy signature, as written
+// by versions before the versioned header. flags of 0 leave the data at 2
+// bits per channel, anything else is stored in the top byte of the filename
+// length, with the depth of the data minus one
+static void* make_legacy_png(const uint8_t* data, uint8_t flags, size_t* size) {
+	size_t name_length = strlen(DATA_NAME);
+	uint8_t header[LEGACY_HEADER_SIZE + sizeof(DATA_NAME)];
+	header[0] = flags;
+	header[1] = name_length >> 16;
+	header[2] = name_length >> 8;
+	header[3] = name_length;
+	header[4] = LEGACY_DATA_SIZE >> 24;
+	header[5] = LEGACY_DATA_SIZE >> 16;
+	header[6] = LEGACY_DATA_SIZE >> 8;
+	header[7] = LEGACY_DATA_SIZE;
+	memcpy(&header[LEGACY_HEADER_SIZE], DATA_NAME, name_length);
+
+	uint8_t pixels[LEGACY_SIZE * LEGACY_SIZE * 3];
+	for (size_t i = 0; i < sizeof(pixels); i++) {
+		pixels[i] = rand();
+	}
+
+	// the signature is always at 2 bits per channel, the data follows it
+	int depth = flags ? (flags & 0x03) + 1 : 2;
+	size_t channel = store_bits(pixels, 0, header, LEGACY_HEADER_SIZE + name_length, 2);
+	store_bits(pixels, channel, data, LEGACY_DATA_SIZE, depth);
+
+	return make_png(LEGACY_SIZE, LEGACY_SIZE, PNG_COLOR_TYPE_RGB, 8, PNG_INTERLACE_NONE, pixels, size);
+}
+
+// embed data_size bytes of data into png with the options set on ctx and
+// read it back, returning 0 if both the png and the data survive
+static int roundtrip(csteg_ctx* ctx, const void* png, size_t png_size, const uint8_t* data, size_t data_size) {
+	void* out;
+	size_t out_size;
+
+	if (csteg_embed_memory(ctx, png, png_size, DATA_NAME, data, data_size, &out, &out_size) != CSTEG_OK) {
+		fprintf(stderr, "embedding: %s\n", csteg_ctx_error(ctx));
+		return -1;
+	}
+
+	int result = 0;
+	if (!decodes(out, out_size)) {
+		fprintf(stderr, "libpng can't decode the png written\n");
+		result = -1;
+	} else {
+		result = check_payload(ctx, out, out_size, data, data_size);
+	}
+
+	free(out);
+	return result;
+}
+
+int main(void) {
+	static const struct {
+		size_t width, height;
+		int color_type, bit_depth, interlace;
+	} images[] = {
+		{ 400, 1, PNG_COLOR_TYPE_RGBA, 8, PNG_INTERLACE_NONE },
+		{ 400, 2, PNG_COLOR_TYPE_RGBA, 8, PNG_INTERLACE_NONE },
+		{ 400, 3, PNG_COLOR_TYPE_RGB, 8, PNG_INTERLACE_NONE },
+		{ 400, 5, PNG_COLOR_TYPE_RGB, 8, PNG_INTERLACE_NONE },
+		{ 64, 64, PNG_COLOR_TYPE_RGBA, 8, PNG_INTERLACE_NONE },
+		{ 64, 64, PNG_COLOR_TYPE_GRAY, 8, PNG_INTERLACE_NONE },
+		{ 64, 64, PNG_COLOR_TYPE_GRAY_ALPHA, 8, PNG_INTERLACE_NONE },
+
+		// 16-bit samples take the stride-2 kernels
+		{ 64, 64, PNG_COLOR_TYPE_RGB, 16, PNG_INTERLACE_NONE },
+		{ 64, 64, PNG_COLOR_TYPE_RGBA, 16, PNG_INTERLACE_NONE },
+		{ 64, 64, PNG_COLOR_TYPE_GRAY, 16, PNG_INTERLACE_NONE },
+		{ 64, 64, PNG_COLOR_TYPE_GRAY_ALPHA, 16, PNG_INTERLACE_NONE },
+		{ 400, 3, PNG_COLOR_TYPE_RGBA, 16, PNG_INTERLACE_NONE },
+
+		// interlaced images are decoded whole before being embedded into
+		{ 64, 64, PNG_COLOR_TYPE_RGB, 8, PNG_INTERLACE_ADAM7 },
+		{ 61, 37, PNG_COLOR_TYPE_RGBA, 8, PNG_INTERLACE_ADAM7 },
+		{ 64, 64, PNG_COLOR_TYPE_RGBA, 16, PNG_INTERLACE_ADAM7 },
+		{ 13, 11, PNG_COLOR_TYPE_GRAY_ALPHA, 8, PNG_INTERLACE_ADAM7 },
+	};
+
+	uint8_t data[MAX_DATA_SIZE];
+	for (size_t i = 0; i < MAX_DATA_SIZE; i++) {
+		data[i] = rand();
+	}
+
+	csteg_ctx* ctx = csteg_ctx_new();
+	if (!ctx) {
+		fprintf(stderr, "could not create context\n");
+		return 1;
+	}
+
+	int failed = 0;
+	for (size_t i = 0; i < sizeof(images) / sizeof(images[0]); i++) {
+		size_t png_size;
+		void* png = make_png(images[i].width, images[i].height, images[i].color_type, images[i].bit_depth,
+		                     images[i].interlace, NULL, &png_size);
+		csteg_image image;
+		if (!png || csteg_probe_memory(ctx, png, png_size, &image) != CSTEG_OK) {
+			fprintf(stderr, "could not encode a %zux%zu carrier\n", images[i].width, images[i].height);
+			return 1;
+		}
+
+		int has_alpha = (images[i].color_type & PNG_COLOR_MASK_ALPHA) != 0;
+
+		for (size_t k = 0; csteg_kernel_name(k); k++) {
+			const char* kernel = csteg_kernel_name(k);
+			if (csteg_select_kernel(kernel) != CSTEG_OK) {
+				continue; // not supported by this cpu
+			}
+
+			for (int depth = CSTEG_MIN_DEPTH; depth <= CSTEG_MAX_DEPTH; depth++) {
+				for (int alpha = 0; alpha <= has_alpha; alpha++) {
+					// fill the carrier
+					size_t data_size = csteg_capacity(&image, depth, alpha, strlen(DATA_NAME));
+					if (data_size > MAX_DATA_SIZE) {
+						data_size = MAX_DATA_SIZE;
+					}
+
+					csteg_set_depth(ctx, depth);
+					csteg_set_alpha(ctx, alpha);
+
+					for (int threads = 1; threads <= MAX_THREADS; threads++) {
+						csteg_set_threads(ctx, threads);
+						if (roundtrip(ctx, png, png_size, data, data_size) != 0) {
+							fprintf(stderr, "FAIL %zux%zu color type %d, %d-bit%s, %s kernel, depth %d%s, %d threads\n",
+							        images[i].width, images[i].height, images[i].color_type, images[i].bit_depth,
+							        images[i].interlace ? " interlaced" : "", kernel, depth, alpha ? " with -a" : "", threads);
+							failed++;
+						}
+					}
+				}
+			}
+		}
+
+		free(png);
+	}
+
+	// legacy signatures, without and with flags, are still read
+	static const uint8_t legacy_flags[] = { 0, LEGACY_FLAG_PRESENT | (3 - 1), LEGACY_FLAG_PRESENT | (1 - 1) };
+	for (size_t i = 0; i < sizeof(legacy_flags); i++) {
+		size_t png_size;
+		void* png = make_legacy_png(data, legacy_flags[i], &png_size);
+		if (!png) {
+			fprintf(stderr, "could not encode a legacy carrier\n");
+			return 1;
+		}
+
+		for (size_t k = 0; csteg_kernel_name(k); k++) {
+			if (csteg_select_kernel(csteg_kernel_name(k)) == CSTEG_OK &&
+			    check_payload(ctx, png, png_size, data, LEGACY_DATA_SIZE) != 0) {
+				fprintf(stderr, "FAIL legacy signature with flags 0x%02x, %s kernel\n", legacy_flags[i], csteg_kernel_name(k));
+				failed++;
+			}
+		}
+
+		free(png);
+	}
+
+	csteg_ctx_free(ctx);
+
+	if (failed) {
+		return 1;
+	}
+
+	printf("roundtrip: ok\n");
+	return 0;
+}